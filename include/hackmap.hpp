@@ -29,14 +29,41 @@
 #ifndef HACKMAP_HASH_MAP_H
 #define HACKMAP_HASH_MAP_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iostream>
 #include <iomanip>
+#include <iterator>
 #include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define HACKMAP_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <emmintrin.h>
+#ifdef HACKMAP_LATENCY
+#include <x86intrin.h>
+#endif
 
 
 #ifdef __GNUC__
@@ -65,10 +92,48 @@
 
 #define UNUSED(x)
 
+#if defined(HACKMAP_COUNTERS_THREAD)
+#define HACKMAP_COUNT(name, n) (::hackmap::thread_counters().name += (n))
+#elif defined(HACKMAP_COUNTERS)
+#define HACKMAP_COUNT(name, n) \
+    (mCounters.add(offsetof(::hackmap::unordered_map_counters, name) \
+                   / sizeof(::hackmap::size_type), (n)))
+#else
+#define HACKMAP_COUNT(name, n) ((void)0)
+#endif
+
+#ifdef HACKMAP_LATENCY
+#ifndef HACKMAP_LATENCY_RATE
+#define HACKMAP_LATENCY_RATE (1024)
+#endif
+/*
+ * Return the timed call for one in HACKMAP_LATENCY_RATE calls. The call
+ * takes the already computed hash, captured by value so it stays in a
+ * register on the untimed path.
+ */
+#define HACKMAP_SAMPLE(hist, on, call) \
+    if ((on) && UNLIKELY(detail::latency_tick< \
+            &::hackmap::unordered_map_latency::hist>())) \
+    { \
+        return detail::timed(mLatency.hist, [&, hash]() { return call; }); \
+    }
+#define HACKMAP_TIME(hist) \
+    detail::LatencySample latencySample_(mLatency.hist)
+#else
+#define HACKMAP_SAMPLE(hist, on, call)
+#define HACKMAP_TIME(hist) ((void)0)
+#endif
+
 namespace hackmap
 {
 using size_type = std::size_t;
 
+/**
+ * @brief Structural statistics gathered by unordered_map::gather_stats().
+ *
+ * Per link index averages are capped at LEN links; the chain length and
+ * block fill histograms grow to whatever the table holds.
+ */
 class unordered_map_stats
 {
     static constexpr size_type LEN = 32;
@@ -80,15 +145,32 @@ private:
     size_type mRunMax;
     size_type mRunCount;
     size_type mRunTotal;
+    size_type mLeaps;
+    size_type mFindLeaps;
+    size_type mFindLeapsTotal;
+    size_type mHomeMax;
     std::vector<size_type> mLinkDistances;
     std::vector<size_type> mLeapDistancesCount;
     std::vector<size_type> mLeapDistancesTotal;
     std::vector<size_type> mHomeDistancesCount;
     std::vector<size_type> mHomeDistancesTotal;
+    std::vector<size_type> mChainLengths;
+    std::vector<size_type> mBlockFill;
 
 public:
     unordered_map_stats()
-        : mLinkDistances(LEN, 0)
+        : mLen(0)
+        , mSize(0)
+        , mEmpty(0)
+        , mRun(0)
+        , mRunMax(0)
+        , mRunCount(0)
+        , mRunTotal(0)
+        , mLeaps(0)
+        , mFindLeaps(0)
+        , mFindLeapsTotal(0)
+        , mHomeMax(0)
+        , mLinkDistances(LEN, 0)
         , mLeapDistancesCount(LEN, 0)
         , mLeapDistancesTotal(LEN, 0)
         , mHomeDistancesCount(LEN, 0)
@@ -105,11 +187,17 @@ public:
         mRunMax = 0;
         mRunCount = 0;
         mRunTotal = 0;
-        mLinkDistances.clear();
-        mLeapDistancesCount.clear();
-        mLeapDistancesTotal.clear();
-        mHomeDistancesCount.clear();
-        mHomeDistancesTotal.clear();
+        mLeaps = 0;
+        mFindLeaps = 0;
+        mFindLeapsTotal = 0;
+        mHomeMax = 0;
+        mLinkDistances.assign(LEN, 0);
+        mLeapDistancesCount.assign(LEN, 0);
+        mLeapDistancesTotal.assign(LEN, 0);
+        mHomeDistancesCount.assign(LEN, 0);
+        mHomeDistancesTotal.assign(LEN, 0);
+        mChainLengths.clear();
+        mBlockFill.clear();
     }
 
     void
@@ -137,6 +225,7 @@ public:
     void
     leap_distance(size_type link_index, size_type dist)
     {
+        ++mLeaps;
         if (link_index < LEN)
         {
             mLeapDistancesCount[link_index]++;
@@ -144,9 +233,21 @@ public:
         }
     }
 
+    /** @brief A leap stored as FIND, resolved by extended_leap over dist. */
+    void
+    find_leap(size_type dist)
+    {
+        ++mFindLeaps;
+        mFindLeapsTotal += dist;
+    }
+
     void
     home_distance(size_type link_index, size_type dist)
     {
+        if (dist > mHomeMax)
+        {
+            mHomeMax = dist;
+        }
         if (link_index < LEN)
         {
             mHomeDistancesCount[link_index]++;
@@ -154,12 +255,78 @@ public:
         }
     }
 
+    /** @brief A whole chain, head included, of len elements. */
+    void
+    chain_length(size_type len)
+    {
+        if (len >= mChainLengths.size())
+        {
+            mChainLengths.resize(len + 1, 0);
+        }
+        mChainLengths[len]++;
+    }
+
+    /** @brief A block with used occupied entries. */
+    void
+    block_fill(size_type used)
+    {
+        if (used >= mBlockFill.size())
+        {
+            mBlockFill.resize(used + 1, 0);
+        }
+        mBlockFill[used]++;
+    }
+
     void
     stop()
     {
         flush_run();
     }
 
+    size_type
+    leaps()
+    const noexcept
+    { return mLeaps; }
+
+    size_type
+    find_leaps()
+    const noexcept
+    { return mFindLeaps; }
+
+    /** @brief Fraction of followed leaps that were FIND leaps. */
+    double
+    find_leap_fraction()
+    const noexcept
+    { return mLeaps ? double(mFindLeaps)/double(mLeaps) : 0.0; }
+
+    /** @brief Mean distance covered by an extended_leap. */
+    double
+    extended_leap_average()
+    const noexcept
+    { return mFindLeaps ? double(mFindLeapsTotal)/double(mFindLeaps) : 0.0; }
+
+    size_type
+    home_distance_max()
+    const noexcept
+    { return mHomeMax; }
+
+    size_type
+    run_max()
+    const noexcept
+    { return mRunMax; }
+
+    /** @brief Chains by length: [n] counts chains of n elements. */
+    const std::vector<size_type>&
+    chain_lengths()
+    const noexcept
+    { return mChainLengths; }
+
+    /** @brief Blocks by occupancy: [n] counts blocks with n used entries. */
+    const std::vector<size_type>&
+    block_fills()
+    const noexcept
+    { return mBlockFill; }
+
     void
     print()
     {
@@ -198,6 +365,40 @@ public:
                    << std::endl;
             }
 
+            os << "Find Leaps: " << mFindLeaps << std::endl;
+            os << "Find Leap Fraction: "
+               << find_leap_fraction() * 100.0
+               << "%"
+               << std::endl;
+            os << "Extended Leap Avg: "
+               << extended_leap_average()
+               << std::endl;
+            os << "Home Max: " << mHomeMax << std::endl;
+
+            for (size_type i = 0; i < mChainLengths.size(); ++i)
+            {
+                if (mChainLengths[i])
+                {
+                    os << "Chain "
+                       << i
+                       << ": "
+                       << mChainLengths[i]
+                       << std::endl;
+                }
+            }
+
+            for (size_type i = 0; i < mBlockFill.size(); ++i)
+            {
+                if (mBlockFill[i])
+                {
+                    os << "Block Fill "
+                       << i
+                       << ": "
+                       << mBlockFill[i]
+                       << std::endl;
+                }
+            }
+
             for (size_type i = 0; i < LEN; ++i)
             {
                 size_type linkdist = mLinkDistances[i];
@@ -246,7 +447,106 @@ public:
         }
     }
 
+    /** @brief One JSON object; histograms are arrays indexed by bucket. */
+    void
+    print_json(std::ostream &os)
+    {
+        os << "{\"len\":" << mLen
+           << ",\"size\":" << mSize
+           << ",\"empty\":" << mEmpty
+           << ",\"run_max\":" << mRunMax
+           << ",\"run_avg\":"
+           << (mRunCount ? double(mRunTotal)/double(mRunCount) : 0.0)
+           << ",\"leaps\":" << mLeaps
+           << ",\"find_leaps\":" << mFindLeaps
+           << ",\"find_leap_fraction\":" << find_leap_fraction()
+           << ",\"extended_leap_avg\":" << extended_leap_average()
+           << ",\"home_max\":" << mHomeMax;
+        print_json_array(os, "chain_lengths", mChainLengths);
+        print_json_array(os, "block_fill", mBlockFill);
+        print_json_array(os, "links", mLinkDistances);
+        print_json_means(os, "leap_avg",
+                         mLeapDistancesTotal, mLeapDistancesCount);
+        print_json_means(os, "home_avg",
+                         mHomeDistancesTotal, mHomeDistancesCount);
+        os << "}" << std::endl;
+    }
+
+    /** @brief "metric,index,value" rows; scalars use index 0. */
+    void
+    print_csv(std::ostream &os)
+    {
+        os << "metric,index,value" << std::endl;
+        os << "len,0," << mLen << std::endl;
+        os << "size,0," << mSize << std::endl;
+        os << "empty,0," << mEmpty << std::endl;
+        os << "run_max,0," << mRunMax << std::endl;
+        os << "run_avg,0,"
+           << (mRunCount ? double(mRunTotal)/double(mRunCount) : 0.0)
+           << std::endl;
+        os << "leaps,0," << mLeaps << std::endl;
+        os << "find_leaps,0," << mFindLeaps << std::endl;
+        os << "find_leap_fraction,0," << find_leap_fraction() << std::endl;
+        os << "extended_leap_avg,0," << extended_leap_average() << std::endl;
+        os << "home_max,0," << mHomeMax << std::endl;
+        for (size_type i = 0; i < mChainLengths.size(); ++i)
+        {
+            os << "chain_lengths," << i << "," << mChainLengths[i] << std::endl;
+        }
+        for (size_type i = 0; i < mBlockFill.size(); ++i)
+        {
+            os << "block_fill," << i << "," << mBlockFill[i] << std::endl;
+        }
+        for (size_type i = 0; i < LEN; ++i)
+        {
+            os << "links," << i << "," << mLinkDistances[i] << std::endl;
+        }
+        for (size_type i = 0; i < LEN; ++i)
+        {
+            os << "leap_avg," << i << ","
+               << mean(mLeapDistancesTotal[i], mLeapDistancesCount[i])
+               << std::endl;
+        }
+        for (size_type i = 0; i < LEN; ++i)
+        {
+            os << "home_avg," << i << ","
+               << mean(mHomeDistancesTotal[i], mHomeDistancesCount[i])
+               << std::endl;
+        }
+    }
+
 private:
+    static double
+    mean(size_type total, size_type count)
+    {
+        return count ? double(total)/double(count) : 0.0;
+    }
+
+    static void
+    print_json_array(std::ostream &os, const char *name,
+                     const std::vector<size_type> &v)
+    {
+        os << ",\"" << name << "\":[";
+        for (size_type i = 0; i < v.size(); ++i)
+        {
+            os << (i ? "," : "") << v[i];
+        }
+        os << "]";
+    }
+
+    static void
+    print_json_means(std::ostream &os, const char *name,
+                     const std::vector<size_type> &total,
+                     const std::vector<size_type> &count)
+    {
+        os << ",\"" << name << "\":[";
+        for (size_type i = 0; i < total.size(); ++i)
+        {
+            os << (i ? "," : "") << mean(total[i], count[i]);
+        }
+        os << "]";
+    }
+
     void
     flush_run()
     {
@@ -263,2418 +563,7143 @@ private:
     }
 };
 
-template <typename Key, typename Hash = std::hash<Key>>
-struct fibonacci_hash: public Hash
+/** @brief One chain picked out by unordered_map::hotspots(). */
+struct unordered_map_hotspot
 {
-    fibonacci_hash(const Hash& h = Hash{}) : Hash(h) {}
-#if HASH_SIZE == 32
-    /*
-     * (2**32)/(Golden Ratio) ~= 2654435769
-     * The two closest primes are 2654435761 and 2654435789
-     */
-    static constexpr size_type FIB = size_type(2654435761UL);
-#elif HASH_SIZE == 64
-    /*
-     * (2**64)/(Golden Ratio) ~= 11400714819323198486
-     * Seems impractical to find nearest prime number, so let's make it odd.
-     * 11400714819323198487
-     */
-    static constexpr size_type FIB = size_type(11400714819323198485ULL);
-#else
-    // Error already reported above.
-#endif
+    size_type home = 0;              ///< Index of the chain's head.
+    size_type length = 0;            ///< Elements in the chain.
+    size_type find_leaps = 0;        ///< Links resolved by extended_leap.
+    size_type extended_distance = 0; ///< Entries those links spanned.
+    std::vector<std::string> keys;   ///< Formatted sample, head first.
 
-#if 0
-    static constexpr int RSHIFT = (sizeof(size_type) * 8) / 2;
-    static constexpr int LSHIFT = (sizeof(size_type) * 8) / 2;
-#else
-    static constexpr int RSHIFT = 13;
-    static constexpr int LSHIFT = (sizeof(size_type) * 8) - RSHIFT;
-#endif
-
-    size_type
-    operator()(const Key& k)
+    void
+    print(std::ostream& os)
     const
     {
-        size_type result = FIB * Hash::operator()(k);
-        return (result >> RSHIFT) | (result << LSHIFT);
+        os << "Home " << home
+           << ": length " << length
+           << ", find leaps " << find_leaps
+           << ", extended distance " << extended_distance;
+        for (size_type i = 0; i < keys.size(); ++i)
+        {
+            os << (i ? ", " : " [") << keys[i];
+        }
+        os << (keys.empty() ? "" : "]") << std::endl;
     }
 };
 
-namespace detail
-{
-
-static constexpr int BLOCK_LEN = int(16);
-
-struct BlockFull {};
-struct IteratorLeap{};
-
-class search_map
+/** @brief Worst chains of a map, worst first. */
+struct unordered_map_hotspots
 {
-public:
-    search_map(int map)
-        : mMap(map)
-    {}
-
-    search_map(search_map& m)
-        : mMap(m.mMap)
-    {}
-
-    search_map(search_map&& m)
-        : mMap(m.mMap)
-    {}
+    std::vector<unordered_map_hotspot> by_length;   ///< Longest chains.
+    std::vector<unordered_map_hotspot> by_extended; ///< Costliest leaps.
 
-    search_map&
-    operator=(search_map& m)
+    void
+    print()
+    const
     {
-        mMap = m.mMap;
-        return *this;
+        print(std::cout);
     }
 
-    search_map&
-    operator=(search_map&& m)
+    void
+    print(std::ostream& os)
+    const
     {
-        mMap = m.mMap;
-        return *this;
+        os << "Longest Chains:" << std::endl;
+        for (const auto& h : by_length)
+        {
+            h.print(os);
+        }
+        os << "Costliest Extended Leaps:" << std::endl;
+        for (const auto& h : by_extended)
+        {
+            h.print(os);
+        }
     }
+};
 
-    bool
-    has()
+/**
+ * @brief Snapshot of the operation counters.
+ *
+ * Counted only when compiled with HACKMAP_COUNTERS (per map) or
+ * HACKMAP_COUNTERS_THREAD (per thread, shared by every map on it);
+ * otherwise the counting compiles away and snapshots stay zero.
+ */
+struct unordered_map_counters
+{
+    size_type hits = 0;            ///< Finds that found the key.
+    size_type misses = 0;          ///< Finds that did not.
+    size_type compares = 0;        ///< Key comparisons.
+    size_type false_positives = 0; ///< Key comparisons that failed.
+    size_type leaps = 0;           ///< List links followed.
+    size_type extended_leaps = 0;  ///< Links that needed an extended search.
+    size_type extended_blocks = 0; ///< Blocks scanned by extended searches.
+    size_type cascades = 0;        ///< Calls to cascade.
+    size_type empty_blocks = 0;    ///< Blocks scanned for an empty entry.
+    size_type resizes = 0;         ///< Table rebuilds (grow, shrink, rehash).
+    size_type bytes_moved = 0;     ///< Value bytes moved by rebuilds.
+
+    size_type
+    lookups()
     const noexcept
     {
-        return !!mMap;
+        return hits + misses;
     }
 
-    int
-    next()
-    const noexcept
+    unordered_map_counters&
+    operator+=(const unordered_map_counters& o)
+    noexcept
     {
-        return __builtin_ffs(mMap) - 1;
+        hits += o.hits;
+        misses += o.misses;
+        compares += o.compares;
+        false_positives += o.false_positives;
+        leaps += o.leaps;
+        extended_leaps += o.extended_leaps;
+        extended_blocks += o.extended_blocks;
+        cascades += o.cascades;
+        empty_blocks += o.empty_blocks;
+        resizes += o.resizes;
+        bytes_moved += o.bytes_moved;
+        return *this;
     }
 
     void
-    clear(int i)
+    print()
+    const
     {
-        mMap &= ~(1 << i);
+        print(std::cout);
     }
 
-    int
-    value()
+    void
+    print(std::ostream& os)
     const
     {
-        return mMap;
+        os << "Lookups: " << lookups() << std::endl;
+        os << "Hits: " << hits << std::endl;
+        os << "Misses: " << misses << std::endl;
+        os << "Compares: " << compares << std::endl;
+        os << "False Positives: " << false_positives << std::endl;
+        os << "Leaps: " << leaps << std::endl;
+        os << "Extended Leaps: " << extended_leaps << std::endl;
+        os << "Extended Blocks: " << extended_blocks << std::endl;
+        os << "Cascades: " << cascades << std::endl;
+        os << "Empty Blocks: " << empty_blocks << std::endl;
+        os << "Resizes: " << resizes << std::endl;
+        os << "Bytes Moved: " << bytes_moved << std::endl;
     }
-
-private:
-    int mMap;
 };
 
+#ifdef HACKMAP_COUNTERS_THREAD
+/** @return Counters for every map used by the calling thread. */
+inline unordered_map_counters&
+thread_counters()
+noexcept
+{
+    static thread_local unordered_map_counters counters;
+    return counters;
+}
+#elif defined(HACKMAP_COUNTERS)
+namespace detail
+{
+
 /**
- * @brief Define block type.
- *
- * Notes:
- * The bitwise format for the hash byte:
- * | 1           | 1        | 6         |
- * | special bit | link bit | hash bits |
- * FF = empty
- * FE = unsearchable, no search will match this entry
- * 40 = mask for the link bit
- * 3F = mask for the hash bits
- *
- * The leap byte specifies where the next entry is:
- * 0 = end of linked list
- * [1, FE] = jump distance to next link
- * FF = do inefficient search
+ * @brief A map's own counters, added to with relaxed atomics since const
+ *        lookups may run on several threads at once (e.g. a threaded
+ *        hash_join probe). A copy starts from zero.
  */
-template <typename Value>
-class Block
+class SharedCounters
 {
-private:
-    uint8_t mHash[BLOCK_LEN];
-    uint8_t mLeap[BLOCK_LEN];
-    Value   mValue[BLOCK_LEN];
-
-    /* Hash related */
-    static constexpr uint8_t SPECIAL   = uint8_t(0x80);
-    static constexpr uint8_t EMPTY     = uint8_t(0xFF);
-    static constexpr uint8_t NOFIND    = uint8_t(0xFE);
-    static constexpr uint8_t SENTINEL  = uint8_t(0xFD);
-    static constexpr uint8_t LINK      = uint8_t(0x40);
-    static constexpr uint8_t HASH_MASK = uint8_t(0x3F);
-    /* Link related */
-    static constexpr uint8_t FIND      = uint8_t(0xFF);
-
 public:
-    static Block*
-    get(Block* b, size_type i)
-    { return b +  (i / BLOCK_LEN); }
-
-    static uint8_t
-    set_link_hash(uint8_t h)
-    { return h | LINK; }
+    static constexpr size_type LEN =
+        sizeof(unordered_map_counters) / sizeof(size_type);
+    static_assert(std::is_trivially_copyable<unordered_map_counters>::value
+                  && LEN * sizeof(size_type) == sizeof(unordered_map_counters),
+                  "counters must be an array of size_type");
 
-    static uint8_t
-    clear_link_hash(uint8_t h)
-    { return h & HASH_MASK; }
-
-    static bool
-    can_leap(size_type d)
-    { return d < size_type(FIND); }
-
-    static void
-    fill_empty(unsigned char *p, size_type len)
-    { std::memset(p, EMPTY, len); }
-
-    static void
-    fill_sentinel(unsigned char *p)
+    SharedCounters()
+    noexcept
     {
-#if 1
-        p[0] = SENTINEL;
-#else
-        std::memset(p, SENTINEL, BLOCK_LEN);
-#endif
+        reset();
     }
 
-    static size_type
-    sentinel_memory_size()
+    SharedCounters(const SharedCounters&)
+    noexcept
+        : SharedCounters()
+    {}
+
+    SharedCounters&
+    operator=(const SharedCounters&)
+    noexcept
     {
-#if 1
-        return 1;
-#else
-        return BLOCK_LEN;
-#endif
+        return *this;
     }
 
-    static size_type
-    construct_index(size_type i, int sub)
-    { return (i & ~(BLOCK_LEN - 1)) + sub; }
+    void
+    add(size_type i, size_type n)
+    noexcept
+    {
+        mCounts[i].fetch_add(n, std::memory_order_relaxed);
+    }
 
-    Block()
-        : mHash{ 0xFF, 0xFF, 0xFF, 0xFF,
-                 0xFF, 0xFF, 0xFF, 0xFF,
-                 0xFF, 0xFF, 0xFF, 0xFF,
-                 0xFF, 0xFF, 0xFF, 0xFF } {}
+    unordered_map_counters
+    snapshot()
+    const noexcept
+    {
+        size_type counts[LEN];
+        for (size_type i = 0; i < LEN; ++i)
+        {
+            counts[i] = mCounts[i].load(std::memory_order_relaxed);
+        }
+        unordered_map_counters c;
+        std::memcpy(&c, counts, sizeof(c));
+        return c;
+    }
 
-    Block(BlockFull UNUSED(full))
-        : mHash{ 0xFE, 0xFE, 0xFE, 0xFE,
-                 0xFE, 0xFE, 0xFE, 0xFE,
-                 0xFE, 0xFE, 0xFE, 0xFE,
-                 0xFE, 0xFE, 0xFE, 0xFE } {}
+    void
+    reset()
+    noexcept
+    {
+        for (auto& count : mCounts)
+        {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
 
-    bool
-    is_empty(size_type i)
-    const noexcept
-    { return mHash[i % BLOCK_LEN] == EMPTY; }
+private:
+    std::atomic<size_type> mCounts[LEN];
+};
+}
+#endif
 
-    bool
-    is_empty_or_link(size_type i)
-    const noexcept
-    { return mHash[i % BLOCK_LEN] & (SPECIAL | LINK); }
+#ifdef HACKMAP_LATENCY
+namespace detail
+{
+class SharedHistogram;
+}
+#endif
 
-    bool
-    is_full(size_type i)
-    const noexcept
-    { return !is_empty(i); }
+/**
+ * @brief Log bucketed latency histogram, HDR style.
+ *
+ * Each power of two range is split into SUB linear buckets, so recorded
+ * values keep 3 significant bits (within 12.5%). Values past 2**40 land
+ * in the last bucket.
+ */
+class latency_histogram
+{
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr int MAX_BITS = 40;
+    static constexpr int LEN = (MAX_BITS - SUB_BITS + 1) * SUB;
 
-    bool
-    is_head(size_type i)
-    const noexcept
-    { return !is_link(i); }
+    void
+    record(uint64_t value)
+    noexcept
+    {
+        ++mBuckets[index(value)];
+        ++mCount;
+        mTotal += value;
+        mMax = value > mMax ? value : mMax;
+    }
 
-    bool
-    is_link(size_type i)
+    latency_histogram&
+    operator+=(const latency_histogram& o)
+    noexcept
+    {
+        for (int i = 0; i < LEN; ++i)
+        {
+            mBuckets[i] += o.mBuckets[i];
+        }
+        mCount += o.mCount;
+        mTotal += o.mTotal;
+        mMax = o.mMax > mMax ? o.mMax : mMax;
+        return *this;
+    }
+
+    uint64_t
+    count()
     const noexcept
-    { return mHash[i % BLOCK_LEN] & LINK; }
+    {
+        return mCount;
+    }
 
-    bool
-    is_end(size_type i)
+    uint64_t
+    max()
     const noexcept
-    { return 0 == mLeap[i % BLOCK_LEN]; }
+    {
+        return mMax;
+    }
 
-    bool
-    is_local(size_type i)
+    double
+    mean()
     const noexcept
-    { return !is_foreign(i); }
+    {
+        return mCount ? double(mTotal) / double(mCount) : 0.0;
+    }
 
-    bool
-    is_foreign(size_type i)
+    /** @return Lower bound of the bucket holding the p quantile (0 to 1). */
+    uint64_t
+    percentile(double p)
     const noexcept
-    { return mLeap[i % BLOCK_LEN] == FIND; }
+    {
+        uint64_t rank = uint64_t(p * double(mCount));
+        rank = rank < mCount ? rank : mCount - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LEN; ++i)
+        {
+            seen += mBuckets[i];
+            if (seen > rank)
+            {
+                return value(i);
+            }
+        }
+        return 0;
+    }
 
     void
-    set_nofind(size_type i)
-    noexcept
-    { mHash[i % BLOCK_LEN] = NOFIND; }
+    print(std::ostream& os, const char* name)
+    const
+    {
+        os << name
+           << ": count " << mCount
+           << ", mean " << mean();
+        if (mCount)
+        {
+            os << ", p50 " << percentile(0.5)
+               << ", p90 " << percentile(0.9)
+               << ", p99 " << percentile(0.99)
+               << ", p99.9 " << percentile(0.999);
+        }
+        os << ", max " << mMax << std::endl;
+    }
 
-    uint8_t
-    get_hash(size_type i)
-    const noexcept
-    { return mHash[i % BLOCK_LEN]; }
+    /** @return Bucket for value. */
+    static int
+    index(uint64_t value)
+    noexcept
+    {
+        if (value < uint64_t(SUB))
+        {
+            return int(value);
+        }
+        int e = 63 - __builtin_clzll(value);
+        if (e >= MAX_BITS)
+        {
+            return LEN - 1;
+        }
+        int sub = int(value >> (e - SUB_BITS)) & (SUB - 1);
+        return (e - SUB_BITS + 1) * SUB + sub;
+    }
 
-    uint8_t
-    get_hash_only(size_type i)
-    const noexcept
-    { return mHash[i % BLOCK_LEN] & HASH_MASK; }
+    /** @return Smallest value in bucket i. */
+    static uint64_t
+    value(int i)
+    noexcept
+    {
+        if (i < SUB)
+        {
+            return uint64_t(i);
+        }
+        int e = i / SUB + SUB_BITS - 1;
+        return uint64_t(SUB + i % SUB) << (e - SUB_BITS);
+    }
 
-    uint8_t
-    get_hash_as_link(size_type i)
-    const noexcept
-    { return set_link_hash(mHash[i % BLOCK_LEN]); }
+private:
+#ifdef HACKMAP_LATENCY
+    friend class detail::SharedHistogram;
+#endif
 
-    void
-    set_hash(size_type i, uint8_t hash)
-    noexcept
-    { mHash[i % BLOCK_LEN] = hash; }
+    uint64_t mBuckets[LEN] = {};
+    uint64_t mCount = 0;
+    uint64_t mTotal = 0;
+    uint64_t mMax = 0;
+};
 
-    uint8_t
-    get_leap(size_type i)
-    const noexcept
-    { return mLeap[i % BLOCK_LEN]; }
+/**
+ * @brief Latency histograms per operation, in TSC cycles.
+ *
+ * Filled only when compiled with HACKMAP_LATENCY: one in
+ * HACKMAP_LATENCY_RATE inserts, finds, and erases is timed (an insert's
+ * time includes any resize it triggers), and every resize is timed.
+ */
+struct unordered_map_latency
+{
+    latency_histogram insert;
+    latency_histogram find;
+    latency_histogram erase;
+    latency_histogram resize;
 
-    void
-    set_leap(size_type i, uint8_t leap)
+    unordered_map_latency&
+    operator+=(const unordered_map_latency& o)
     noexcept
-    { mLeap[i % BLOCK_LEN] = leap; }
+    {
+        insert += o.insert;
+        find += o.find;
+        erase += o.erase;
+        resize += o.resize;
+        return *this;
+    }
 
     void
-    set_find(size_type i)
-    noexcept
-    { mLeap[i % BLOCK_LEN] = FIND; }
+    print()
+    const
+    {
+        print(std::cout);
+    }
 
     void
-    set_end(size_type i)
+    print(std::ostream& os)
+    const
+    {
+        insert.print(os, "Insert");
+        find.print(os, "Find");
+        erase.print(os, "Erase");
+        resize.print(os, "Resize");
+    }
+};
+
+#ifdef HACKMAP_LATENCY
+namespace detail
+{
+/**
+ * @brief A map's own histogram, recorded with relaxed atomics since const
+ *        finds may be timed on several threads at once. Only sampled calls
+ *        record, so the atomics cost nothing on the untimed path.
+ *        A copy starts empty.
+ */
+class SharedHistogram
+{
+public:
+    SharedHistogram()
     noexcept
-    { mLeap[i % BLOCK_LEN] = 0; }
+    {
+        reset();
+    }
 
-    void
-    set_empty(size_type i)
+    SharedHistogram(const SharedHistogram&)
     noexcept
-    { mHash[i % BLOCK_LEN] = EMPTY; }
+        : SharedHistogram()
+    {}
 
-    Value&
-    get_value(size_type i)
+    SharedHistogram&
+    operator=(const SharedHistogram&)
     noexcept
-    { return *(mValue + (i % BLOCK_LEN)); }
+    {
+        return *this;
+    }
 
-    Value*
-    get_value_ptr(size_type i)
+    /**
+     * @brief Two locked adds a sample; the count is summed from the
+     *        buckets and the max only swapped when exceeded.
+     */
+    void
+    record(uint64_t value)
     noexcept
-    { return mValue + (i % BLOCK_LEN); }
+    {
+        mBuckets[latency_histogram::index(value)].fetch_add(
+            1, std::memory_order_relaxed);
+        mTotal.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = mMax.load(std::memory_order_relaxed);
+        while (value > max
+               && !mMax.compare_exchange_weak(max, value,
+                                              std::memory_order_relaxed))
+        {}
+    }
 
-    search_map
-    find(uint8_t h)
+    latency_histogram
+    snapshot()
     const noexcept
     {
-#if defined __SSE2__
-        // Documentation:
-        // https://software.intel.com/sites/landingpage/IntrinsicsGuide/
-        __m128i first = _mm_set1_epi8((char)h);
-        __m128i second = _mm_loadu_si128((__m128i*)(mHash));
-        return { _mm_movemask_epi8(_mm_cmpeq_epi8(first, second)) };
-#else
-        // Slower implementation available if we don't have SSE instructions.
-        int result = 0;
-
-        int i;
-        for (i = 0; i < SLOTLEN; ++i)
+        latency_histogram hist;
+        for (int i = 0; i < latency_histogram::LEN; ++i)
         {
-            if (slot->hashes[i] == searchhash)
-            {
-                result |= (1 << i);
-            }
+            hist.mBuckets[i] = mBuckets[i].load(std::memory_order_relaxed);
+            hist.mCount += hist.mBuckets[i];
         }
-
-        return { result };
-#endif
+        hist.mTotal = mTotal.load(std::memory_order_relaxed);
+        hist.mMax = mMax.load(std::memory_order_relaxed);
+        return hist;
     }
 
-    search_map
-    find_empty(size_type i)
-    const noexcept
+    void
+    reset()
+    noexcept
     {
-        return { find_empty().value() & ~((1 << (i % BLOCK_LEN)) - 1) };
+        for (auto& bucket : mBuckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        mTotal.store(0, std::memory_order_relaxed);
+        mMax.store(0, std::memory_order_relaxed);
     }
 
-    search_map
-    find_empty()
+private:
+    std::atomic<uint64_t> mBuckets[latency_histogram::LEN];
+    std::atomic<uint64_t> mTotal;
+    std::atomic<uint64_t> mMax;
+};
+
+/** @brief A map's live histograms, see unordered_map_latency. */
+struct SharedLatency
+{
+    SharedHistogram insert;
+    SharedHistogram find;
+    SharedHistogram erase;
+    SharedHistogram resize;
+
+    unordered_map_latency
+    snapshot()
     const noexcept
     {
-        return { find(EMPTY) };
+        return unordered_map_latency{ insert.snapshot(), find.snapshot(),
+                                      erase.snapshot(), resize.snapshot() };
     }
 
-    search_map
-    find_full(size_type i)
-    const noexcept
+    void
+    reset()
+    noexcept
     {
-        return { find_full().value() & ~((1 << (i % BLOCK_LEN)) - 1) };
+        insert.reset();
+        find.reset();
+        erase.reset();
+        resize.reset();
     }
+};
 
-    search_map
-    find_full()
-    const noexcept
+/**
+ * @return True once every HACKMAP_LATENCY_RATE calls of Hist's operation
+ *         on this thread (across maps), to pick which calls to time.
+ *         A countdown, so the untimed path is a decrement and a branch.
+ */
+template <latency_histogram unordered_map_latency::*Hist>
+inline bool
+latency_tick()
+noexcept
+{
+    static thread_local uint32_t countdown = HACKMAP_LATENCY_RATE;
+    if (UNLIKELY(0 == --countdown))
     {
-        return { ~find(EMPTY).value() & ((1 << BLOCK_LEN) - 1) };
+        countdown = HACKMAP_LATENCY_RATE;
+        return true;
     }
+    return false;
+}
+}
+#endif
 
-    bool
-    is_empty_by_subindex(int i)
-    const noexcept
-    { return mHash[i] == EMPTY; }
+/** @brief What a compute() or upsert() callback leaves in the map. */
+enum class compute_action
+{
+    keep,  ///< Keep the (possibly updated) value.
+    erase, ///< Erase the entry.
+};
 
-    bool
-    is_nofind_by_subindex(int i)
-    const noexcept
-    { return mHash[i] == NOFIND; }
+/** @brief Why the table was rebuilt or emptied. */
+enum class resize_reason
+{
+    grow,    ///< An insert passed the load limit.
+    reserve, ///< reserve() asked for room.
+    rehash,  ///< rehash() shrank the table.
+    reseed,  ///< hash_guard switched seeds (same length).
+    clear,   ///< clear() dropped every entry (same length).
+};
 
-    bool
-    is_head_by_subindex(int i)
-    const noexcept
-    { return !(mHash[i] & LINK); }
+/** @brief Leads a map written by save(), in native byte order. */
+struct snapshot_header
+{
+    char magic[8];         ///< "hackmap" and a NUL.
+    uint32_t version;
+    uint32_t raw;          ///< 1 if the table's bytes follow, else values.
+    uint64_t layout;       ///< Block, value, and policy sizes (must match).
+    uint64_t len;          ///< bucket_count().
+    uint64_t size;
+    uint64_t load_factor;  ///< MaxLoadFactor of the saving map.
+    uint64_t bytes;        ///< Table bytes that follow (raw only).
+    uint64_t fingerprint;  ///< Mix of the first keys' hashes.
+};
 
-    bool
-    is_special_by_subindex(int i)
-    { return mHash[i] & SPECIAL; }
+/** @brief One table rebuild, as reported to a resize_listener. */
+struct resize_event
+{
+    resize_reason reason;
+    size_type old_len;         ///< Entries before (0 if unallocated).
+    size_type new_len;         ///< Entries after.
+    size_type size;            ///< Elements moved (or dropped by clear).
+    size_type bytes_allocated; ///< Bytes of the new table.
+    size_type bytes_freed;     ///< Bytes of the old table.
+    uint64_t nanoseconds;      ///< Wall clock time of the rebuild.
+};
 
+/**
+ * @brief Told of every resize of the maps it is installed on.
+ *
+ * Installed with set_resize_listener() on maps whose policy sets
+ * resize_listener. Called after the rebuild, on the resizing thread,
+ * and must not throw.
+ */
+class resize_listener
+{
+public:
+    virtual
+    ~resize_listener() = default;
 
-    uint8_t
-    get_hash_by_subindex(int i)
-    const noexcept
-    { return mHash[i]; }
+    virtual void
+    on_resize(const resize_event& e)
+    noexcept = 0;
+};
 
-    uint8_t
-    get_leap_by_subindex(int i)
-    const noexcept
-    { return mLeap[i]; }
+/**
+ * @brief Trait flagging a hasher whose every output bit depends on every
+ * input bit.
+ *
+ * A hasher opts in by declaring a nested `is_avalanching` type. The map
+ * uses the low bits for the index and the high bits for the fragment, so
+ * such a hasher needs no further mixing.
+ */
+template <typename Hash, typename = void>
+struct is_avalanching : std::false_type {};
 
-    Value&
-    get_value_by_subindex(int i)
-    { return mValue[i]; }
-};
+template <typename Hash>
+struct is_avalanching<Hash, typename std::conditional<true, void,
+    typename Hash::is_avalanching>::type>
+    : std::true_type {};
 
-static Block<uint8_t> NULL_BLOCK(BlockFull{});
+namespace detail
+{
+/*
+ * Mixing constants and primitives follow wyhash (public domain).
+ */
+static constexpr uint64_t WYP0 = 0xa0761d6478bd642fULL;
+static constexpr uint64_t WYP1 = 0xe7037ed1a0b428dbULL;
+static constexpr uint64_t WYP2 = 0x8ebc6af09c88c6e3ULL;
+static constexpr uint64_t WYP3 = 0x589965cc75374cc3ULL;
+
+/** @brief Full 64x64->128 multiply; low half in a, high half in b. */
+static inline void
+wymum(uint64_t& a, uint64_t& b)
+noexcept
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = a;
+    r *= b;
+    a = uint64_t(r);
+    b = uint64_t(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = uint32_t(a), lb = uint32_t(b);
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    a = lo;
+    b = hi;
+#endif
+}
 
-template <int MaxLoadFactor,
-          typename Key,
-          typename T,
-          typename Hash = fibonacci_hash<Key>,
-          typename Pred = std::equal_to<Key>,
-          typename Alloc = std::allocator<unsigned char>
-          >
-class unordered_map: public Hash, public Pred, public Alloc
+/** @brief Fold the 128 bit product of a and b into 64 bits. */
+static inline uint64_t
+wymix(uint64_t a, uint64_t b)
+noexcept
 {
-    using allocator_traits = std::allocator_traits<Alloc>;
+    wymum(a, b);
+    return a ^ b;
+}
 
-public:
-    using key_type = Key;
-    using mapped_type = T;
-    using value_type = std::pair<const key_type, mapped_type>;
-    using hasher = Hash;
-    using key_equal = Pred;
-    using allocator_type = Alloc;
-    using block_type = Block<value_type>;
-    using self_type =
-        unordered_map<MaxLoadFactor,
-                      key_type,
-                      mapped_type,
-                      hasher,
-                      key_equal,
-                      allocator_type>;
+static inline uint64_t
+wyr8(const uint8_t *p)
+noexcept
+{
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t
+wyr4(const uint8_t *p)
+noexcept
+{
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t
+wyr3(const uint8_t *p, size_t len)
+noexcept
+{
+    return (uint64_t(p[0]) << 16) | (uint64_t(p[len >> 1]) << 8) | p[len - 1];
+}
 
-public:
-    template <bool IsConstant>
-    class Iterator
+/**
+ * @brief Hash a run of bytes.
+ *
+ * Short inputs are read with overlapping loads, long inputs
+ * in three independent 16 octet lanes.
+ */
+static inline uint64_t
+hash_bytes(const void *key, size_t len, uint64_t seed = 0)
+noexcept
+{
+    const uint8_t *p = static_cast<const uint8_t *>(key);
+    seed ^= wymix(seed ^ WYP0, WYP1);
+    uint64_t a;
+    uint64_t b;
+    if (LIKELY(len <= 16))
     {
-    public:
-        using iterator_category = std::forward_iterator_tag;
-        using value_type = typename self_type::value_type;
-        using difference_type = std::ptrdiff_t;
-        using pointer =
-            typename std::conditional<IsConstant,
-                                      const value_type*,
-                                      value_type*>::type;
-        using reference =
-            typename std::conditional<IsConstant,
-                                      const value_type&,
-                                      value_type&>::type;
-        using block_type = typename self_type::block_type;
-
-        Iterator() = delete;
-
-        template <bool OtherIsConstant>
-        Iterator(const Iterator<OtherIsConstant>& o)
-            : mBlock(o.mBlock), mIndex(o.mIndex)
-        {}
-
-        Iterator(block_type* blockPointer, size_type index)
-            : mBlock(blockPointer), mIndex(index)
-        {}
-
-        Iterator(block_type* blockPointer, size_type index,
-                 IteratorLeap UNUSED(unused))
-            : mBlock(blockPointer), mIndex(index)
+        if (LIKELY(len >= 4))
         {
-            leap_if_empty();
+            size_t off = (len >> 3) << 2;
+            a = (wyr4(p) << 32) | wyr4(p + off);
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - off);
         }
-
-        template <bool OtherIsConstant,
-                  typename =
-                      typename std::enable_if<IsConstant
-                                              && !OtherIsConstant>
-                                              ::type
-                  >
-        Iterator&
-        operator=(const Iterator<OtherIsConstant>& o)
-        noexcept
+        else if (LIKELY(len > 0))
         {
-            mBlock = o.mBlock;
-            mIndex = o.mIndex;
-            return *this;
+            a = wyr3(p, len);
+            b = 0;
         }
-
-        Iterator&
-        operator++()
-        noexcept
+        else
         {
-            ++mIndex;
-            leap_if_empty();
-            return *this;
+            a = b = 0;
         }
-
-        Iterator
-        operator++(int)
-        noexcept
+    }
+    else
+    {
+        size_t i = len;
+        if (UNLIKELY(i > 48))
         {
-            return { mBlock, mIndex + 1 };
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+            do
+            {
+                seed = wymix(wyr8(p) ^ WYP1, wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ WYP2, wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ WYP3, wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            }
+            while (LIKELY(i > 48));
+            seed ^= see1 ^ see2;
         }
-
-        reference
-        operator*()
-        const
+        while (UNLIKELY(i > 16))
         {
-            auto block = block_type::get(mBlock, mIndex);
-            return block->get_value(mIndex);
+            seed = wymix(wyr8(p) ^ WYP1, wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
         }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+    a ^= WYP1;
+    b ^= seed;
+    wymum(a, b);
+    return wymix(a ^ WYP0 ^ len, b ^ WYP1);
+}
 
-        pointer
-        operator->()
-        const
-        {
-            auto block = block_type::get(mBlock, mIndex);
-            return block->get_value_ptr(mIndex);
-        }
+/**
+ * @brief Mix a 64 bit integer.
+ *
+ * The splitmix64 finalizer (Stafford's variant 13); every output bit
+ * depends on every input bit, which a single wide multiply does not give
+ * for the high bits of sequential keys.
+ */
+static inline uint64_t
+hash_int(uint64_t k, uint64_t seed = 0)
+noexcept
+{
+    k ^= seed;
+    k ^= k >> 30;
+    k *= 0xbf58476d1ce4e5b9ULL;
+    k ^= k >> 27;
+    k *= 0x94d049bb133111ebULL;
+    k ^= k >> 31;
+    return k;
+}
+
+/** @brief Fold another hash into a running hash. */
+static inline uint64_t
+hash_combine(uint64_t h, uint64_t k)
+noexcept
+{
+    return wymix(h ^ WYP2, k ^ WYP3);
+}
+}
 
-        template <bool OtherIsConstant>
-        bool
-        operator==(const Iterator<OtherIsConstant>& o)
-        const noexcept
-        {
-            return mIndex == o.mIndex;
-        }
+/**
+ * @brief Avalanching hash family.
+ *
+ * Integers, enums, and pointers get the splitmix64 finalizer,
+ * strings a wyhash style byte hash, and pairs and tuples combine
+ * their member hashes. Any other key is hashed with std::hash and mixed.
+ * All specializations are flagged is_avalanching, so fibonacci_hash
+ * passes them through untouched.
+ *
+ * Each takes an optional seed; see seeded_hash.
+ */
+template <typename Key, typename Enable = void>
+struct hash
+{
+    using is_avalanching = void;
 
-        template <bool OtherIsConstant>
-        bool
-        operator!=(const Iterator<OtherIsConstant>& o)
-        const noexcept
-        {
-            return mIndex != o.mIndex;
-        }
+    size_type
+    operator()(const Key& k, uint64_t seed = 0)
+    const noexcept(noexcept(std::hash<Key>{}(k)))
+    {
+        return size_type(detail::hash_int(uint64_t(std::hash<Key>{}(k)), seed));
+    }
+};
 
+template <typename Key>
+struct hash<Key, typename std::enable_if<
+    std::is_integral<Key>::value || std::is_enum<Key>::value>::type>
+{
+    using is_avalanching = void;
 
-    private:
-        block_type* mBlock;
-        size_type   mIndex;
+    size_type
+    operator()(Key k, uint64_t seed = 0)
+    const noexcept
+    {
+        return size_type(detail::hash_int(uint64_t(k), seed));
+    }
+};
 
-        INLINE void
-        leap_if_empty()
-        {
-            auto block = block_type::get(mBlock, mIndex);
-            if (block->is_empty(mIndex))
-            {
-#if 1
-                search_map map = block->find_full(mIndex);
-                while (!map.has())
-                {
-                    mIndex += 16;
-                    block = block_type::get(mBlock, mIndex);
+template <typename T>
+struct hash<T *>
+{
+    using is_avalanching = void;
 
-                    // Make sure we don't overshoot our sentinel.
-                    if (!block->is_empty_by_subindex(0))
-                    {
-                        map = search_map(1);
-                        break;
-                    }
+    size_type
+    operator()(T *k, uint64_t seed = 0)
+    const noexcept
+    {
+        return size_type(detail::hash_int(
+            uint64_t(reinterpret_cast<uintptr_t>(k)), seed));
+    }
+};
 
-                    map = block->find_full();
-                }
-                mIndex = block_type::construct_index(mIndex, map.next());
-#else
-                switch (block_type::get_subindex(mIndex))
-                {
-                    case 0:
-                    case 1:
-                    case 2:
-                    case 3:
-                    case 4:
-                    case 5:
-                    case 6:
-                    case 7:
-                    case 8:
-                    case 9:
-                    case 10:
-                    case 11:
-                    case 12:
-                    case 13:
-                    case 14:
-                    case 15:
-                }
-#endif
-            }
-        }
+template <typename CharT, typename Traits, typename Alloc>
+struct hash<std::basic_string<CharT, Traits, Alloc>>
+{
+    using is_avalanching = void;
 
-        friend class unordered_map<MaxLoadFactor,
-                                   key_type,
-                                   mapped_type,
-                                   hasher,
-                                   key_equal,
-                                   allocator_type>;
-    };
+    size_type
+    operator()(const std::basic_string<CharT, Traits, Alloc>& k,
+               uint64_t seed = 0)
+    const noexcept
+    {
+        return size_type(detail::hash_bytes(k.data(), k.size() * sizeof(CharT),
+                                            seed));
+    }
+};
 
-private:
-    // TODO the maximum possible size may be much smaller than this due to use of doubles in loadfactor calculations
-    static constexpr size_type MAX_SIZE =
-        size_type(1) << ((sizeof(size_type) * 8) - 2);
-    block_type* mBlock      = reinterpret_cast<block_type*>(&NULL_BLOCK);
-    size_type   mSize       = 0;
-    size_type   mLoad       = 0;
-    size_type   mLen        = 0;
-    size_type   mMask       = 0;
+#if __cplusplus >= 201703L
+template <typename CharT, typename Traits>
+struct hash<std::basic_string_view<CharT, Traits>>
+{
+    using is_avalanching = void;
 
-public:
-    using iterator = Iterator<false>;
-    using const_iterator = Iterator<true>;
+    size_type
+    operator()(std::basic_string_view<CharT, Traits> k, uint64_t seed = 0)
+    const noexcept
+    {
+        return size_type(detail::hash_bytes(k.data(), k.size() * sizeof(CharT),
+                                            seed));
+    }
+};
+#endif
 
-    unordered_map() = default;
+template <typename A, typename B>
+struct hash<std::pair<A, B>>
+{
+    using is_avalanching = void;
 
-    explicit
-    unordered_map(size_type count,
-                  const hasher& hash = hasher(),
-                  const key_equal& equal = key_equal(),
-                  const allocator_type& alloc = allocator_type())
-        : hasher(hash), key_equal(equal), allocator_type(alloc)
+    size_type
+    operator()(const std::pair<A, B>& k, uint64_t seed = 0)
+    const
     {
-        reserve(count);
+        return size_type(detail::hash_combine(hash<A>{}(k.first, seed),
+                                              hash<B>{}(k.second, seed)));
     }
+};
 
-    explicit
-    unordered_map(const allocator_type& alloc)
-        : allocator_type(alloc)
-    {}
+template <typename... T>
+struct hash<std::tuple<T...>>
+{
+    using is_avalanching = void;
 
-    template <class InputIterator>
-    unordered_map(InputIterator start, InputIterator stop,
-                  size_type count = 0,
-                  const hasher& hash = hasher(),
-                  const key_equal& equal = key_equal(),
-                  const allocator_type& alloc = allocator_type())
-        : hasher(hash), key_equal(equal), allocator_type(alloc)
+    size_type
+    operator()(const std::tuple<T...>& k, uint64_t seed = 0)
+    const
     {
-        reserve(count);
-        insert(start, stop);
+        return combine(k, seed, std::index_sequence_for<T...>{});
     }
 
-    unordered_map(const unordered_map& o)
-        : hasher(static_cast<const hasher&>(o)),
-          key_equal(static_cast<const key_equal&>(o)),
-          allocator_type(static_cast<const allocator_type&>(o))
+private:
+    template <std::size_t... I>
+    static size_type
+    combine(const std::tuple<T...>& k, uint64_t seed, std::index_sequence<I...>)
     {
-        if (o.mSize)
-        {
-            reserve(o.mSize);
-            insert(o.cbegin(), o.cend());
-        }
+        uint64_t h = detail::WYP0;
+        using expand = int[];
+        (void)expand{0, (h = detail::hash_combine(h,
+            hash<typename std::tuple_element<I, std::tuple<T...>>::type>{}(
+                std::get<I>(k), seed)), 0)...};
+        return size_type(h);
     }
+};
 
-    unordered_map(const unordered_map& o, const allocator_type& alloc)
-        : hasher(static_cast<const hasher&>(o)),
-          key_equal(static_cast<const key_equal&>(o)),
-          allocator_type(alloc)
-    {
-        if (o.mSize)
-        {
-            reserve(o.mSize);
-            insert(o.cbegin(), o.cend());
-        }
-    }
+namespace detail
+{
+/**
+ * @return A fresh seed per call; one random_device draw per process,
+ * then a counter run through the mixer.
+ */
+static inline uint64_t
+random_seed()
+{
+    static const uint64_t base =
+        (uint64_t(std::random_device{}()) << 32) ^ std::random_device{}();
+    static std::atomic<uint64_t> counter{0};
+    return hash_int(base + counter.fetch_add(0x9e3779b97f4a7c15ULL,
+                                             std::memory_order_relaxed));
+}
+}
 
-    unordered_map(unordered_map&& o)
-        : hasher(std::move(static_cast<const hasher&>(o))),
-          key_equal(std::move(static_cast<const key_equal&>(o))),
-          allocator_type(std::move(static_cast<const allocator_type&>(o)))
-    {
-        if (o.mSize)
-        {
-            mBlock = std::move(o.mBlock);
-            mSize = std::move(o.mSize);
-            mLoad = std::move(o.mLoad);
-            mLen = std::move(o.mLen);
-            mMask = std::move(o.mMask);
-            o.set_moved_from();
-        }
-        else
-        {
-            o.reset();
-        }
-    }
+/**
+ * @brief Hash family member with a per instance random seed.
+ *
+ * Use for keys chosen by an adversary: without the seed, colliding keys
+ * can be precomputed and all land on one head, turning each insert
+ * into a long empty search. Each default constructed map draws its own
+ * seed; copies keep it so the layouts match.
+ */
+template <typename Key, typename Hash = hash<Key>>
+struct seeded_hash: public Hash
+{
+    using is_avalanching = void;
 
-    unordered_map(unordered_map&& o, const allocator_type& alloc)
-        : hasher(std::move(static_cast<const hasher&>(o))),
-          key_equal(std::move(static_cast<const key_equal&>(o))),
-          allocator_type(alloc)
-    {
-        if (o.mSize)
-        {
-            mBlock = std::move(o.mBlock);
-            mSize = std::move(o.mSize);
-            mLoad = std::move(o.mLoad);
-            mLen = std::move(o.mLen);
-            mMask = std::move(o.mMask);
-            o.set_moved_from();
-        }
-        else
-        {
-            o.reset();
-        }
-    }
+    seeded_hash()
+        : mSeed(detail::random_seed())
+    {}
 
-    unordered_map(std::initializer_list<value_type> il,
-                  size_type count = 0,
-                  const hasher& hash = hasher(),
-                  const key_equal& equal = key_equal(),
-                  const allocator_type& alloc = allocator_type())
-        : hasher(hash), key_equal(equal), allocator_type(alloc)
+    explicit
+    seeded_hash(uint64_t seed)
+        : mSeed(seed)
+    {}
+
+    size_type
+    operator()(const Key& k)
+    const
     {
-        reserve(count);
-        insert(il.begin(), il.end());
+        return Hash::operator()(k, mSeed);
     }
 
-    ~unordered_map()
+    uint64_t
+    seed()
+    const noexcept
     {
-        destroy_values();
-        deallocate_blocks(mBlock, mLen);
-        mBlock = nullptr;
+        return mSeed;
     }
 
-    mapped_type&
-    at(const key_type& k)
+private:
+    uint64_t mSeed;
+};
+
+template <typename Key, typename Hash = std::hash<Key>>
+struct fibonacci_hash: public Hash
+{
+    fibonacci_hash(const Hash& h = Hash{}) : Hash(h) {}
+#if HASH_SIZE == 32
+    /*
+     * (2**32)/(Golden Ratio) ~= 2654435769
+     * The two closest primes are 2654435761 and 2654435789
+     */
+    static constexpr size_type FIB = size_type(2654435761UL);
+#elif HASH_SIZE == 64
+    /*
+     * (2**64)/(Golden Ratio) ~= 11400714819323198486
+     * Seems impractical to find nearest prime number, so let's make it odd.
+     * 11400714819323198487
+     */
+    static constexpr size_type FIB = size_type(11400714819323198485ULL);
+#else
+    // Error already reported above.
+#endif
+
+#if 0
+    static constexpr int RSHIFT = (sizeof(size_type) * 8) / 2;
+    static constexpr int LSHIFT = (sizeof(size_type) * 8) / 2;
+#else
+    static constexpr int RSHIFT = 13;
+    static constexpr int LSHIFT = (sizeof(size_type) * 8) - RSHIFT;
+#endif
+
+    /** @return h spread over all bits; usable at compile time. */
+    static constexpr size_type
+    mix(size_type h)
+    noexcept
     {
-        size_type index = find_index(k);
-        if (index == mLen)
-        {
-            throw std::out_of_range("hackmap::unordered_map key not found");
-        }
-        auto block = get_block(index);
-        return block->get_value(index).second;
+        return ((FIB * h) >> RSHIFT) | ((FIB * h) << LSHIFT);
     }
 
-    const mapped_type&
-    at(const key_type& k)
+    size_type
+    operator()(const Key& k)
     const
     {
-        size_type index = find_index(k);
-        if (index == mLen)
+        if (is_avalanching<Hash>::value)
         {
-            throw std::out_of_range("hackmap::unordered_map key not found");
+            return Hash::operator()(k);
         }
-        auto block = get_block(index);
-        return block->get_value(index).second;
+        return mix(Hash::operator()(k));
     }
+};
 
-    iterator
-    begin()
-    noexcept
-    {
-        return iterator{ mBlock, 0, IteratorLeap{} };
-    }
+/**
+ * @brief Storage policy for the per-entry overhead.
+ *
+ * Derive from this and override members to change the table layout.
+ * Each entry stores a hash_type (special bit, link bit, and hash fragment)
+ * and a leap_type (distance to the next entry in its list).
+ */
+struct default_policy
+{
+    using hash_type = uint8_t;
+    using leap_type = uint8_t;
+    /** Keep a bit per block flagging that the block has an empty entry. */
+    static constexpr bool free_summary = false;
+    /** Keep a bit per block flagging that the block has a full entry. */
+    static constexpr bool full_summary = false;
+    /** Keep a Bloom word per block of the keys whose lists start there. */
+    static constexpr bool miss_filter = false;
+    /** Watch insert chain costs and reseed when the hash degrades. */
+    static constexpr bool hash_guard = false;
+    /** Keep a resize_listener pointer and time every resize for it. */
+    static constexpr bool resize_listener = false;
+};
 
-    const_iterator
-    begin()
-    const noexcept
-    {
-        return cbegin();
-    }
+/**
+ * @brief Keep a 14 bit hash fragment per entry.
+ *
+ * Cuts false positive key comparisons from ~1/64 to ~1/16384 per
+ * probed entry at the cost of one extra octet per entry.
+ * Use when key comparison is expensive (e.g. long strings).
+ */
+struct wide_hash_policy: public default_policy
+{
+    using hash_type = uint16_t;
+};
+
+/**
+ * @brief Keep a two octet leap per entry.
+ *
+ * Links up to 65534 entries apart stay direct instead of falling back
+ * to an extended search (rehashing every fragment match until the list
+ * member is found).
+ * Use when keys cluster or the hash is weak at high load factors.
+ */
+struct wide_leap_policy: public default_policy
+{
+    using leap_type = uint16_t;
+};
+
+/**
+ * @brief Keep a summary bit per block set while the block has an empty entry.
+ *
+ * Searching for an empty entry then skips 64 full blocks per word
+ * instead of loading each block, at the cost of updating the summary on
+ * insert and erase.
+ * Use when inserting near clusters at high load factors.
+ */
+struct free_summary_policy: public default_policy
+{
+    static constexpr bool free_summary = true;
+};
+
+/**
+ * @brief Keep a summary bit per block set while the block has a full entry.
+ *
+ * A second level keeps a bit per summary word that has a bit set.
+ * Iterators then skip runs of empty blocks 64 (or 4096) at a time,
+ * so iterating costs about the number of entries rather than the
+ * table length.
+ * Use when iterating sparse tables (e.g. after heavy erasure).
+ */
+struct full_summary_policy: public default_policy
+{
+    static constexpr bool full_summary = true;
+};
+
+/**
+ * @brief Keep a 64 bit Bloom filter per block of the keys whose lists
+ *        start in it.
+ *
+ * A miss that would walk a list past its head first tests two bits of
+ * the head block's word (8 blocks per cache line) and, if either is
+ * clear, returns without leaping. Inserts set bits and erases leave
+ * them; an insert that takes a word past FILTER_FILL bits rebuilds it
+ * from the keys of the lists headed there, so churn doesn't saturate it.
+ * Leaps mostly stay in nearby blocks, so this pays off only when they
+ * are expensive (long lists, costly key compares), not for small keys.
+ */
+struct miss_filter_policy: public default_policy
+{
+    static constexpr bool miss_filter = true;
+};
+
+/**
+ * @brief Detect a degenerate hash on insert and recover from it.
+ *
+ * Inserts that walk a long list, or take extended leaps, count as strikes.
+ * Past a threshold the map switches from Hash to a randomly seeded
+ * hash<Key> and rehashes, which reseed_count() reports.
+ * Requires hash<Key> to agree with Pred (true for std::equal_to).
+ * Use when the hash function may be poor for the keys it sees.
+ */
+struct hash_guard_policy: public default_policy
+{
+    static constexpr bool hash_guard = true;
+};
+
+/**
+ * @brief Report every resize, reserve, rehash, reseed, and clear.
+ *
+ * The map keeps a pointer to a resize_listener (none by default) and
+ * passes it a resize_event with the lengths, bytes, and time taken.
+ * Without this policy there is no pointer, clock read, or branch.
+ * Use to log or alert on maps that resize often and should be presized.
+ */
+struct resize_listener_policy: public default_policy
+{
+    static constexpr bool resize_listener = true;
+};
+
+template <typename Key, typename T, typename Hash, typename Pred>
+class frozen_map;
+
+template <typename Key, typename T, typename Hash, typename Pred>
+class perfect_map;
+
+namespace detail
+{
+
+static constexpr int BLOCK_LEN = int(16);
+/** Miss filter word bits past which an insert rebuilds the word. */
+static constexpr int FILTER_FILL = int(40);
+
+struct BlockFull {};
+/** Makes a mapped_type, called only if an insert needs one. */
+template <typename Factory>
+struct MappedFactory
+{
+    Factory& factory;
+};
+
+/** Arguments for a mapped_type, built only if an insert needs one. */
+template <typename... Args>
+struct MappedArgs
+{
+    std::tuple<Args&&...> args;
+};
+struct IteratorLeap{};
+
+/** @brief Table length, only kept by iterators that need it. */
+template <bool HasLen>
+class IteratorLen
+{
+public:
+    IteratorLen(size_type UNUSED(len))
+    {}
 
     size_type
-    bucket(const key_type& k)
-    const
+    get_len()
+    const noexcept
     {
-        return find_index(k);
+        return 0;
     }
+};
+
+template <>
+class IteratorLen<true>
+{
+public:
+    IteratorLen(size_type len)
+        : mLen(len)
+    {}
 
     size_type
-    bucket_count()
+    get_len()
     const noexcept
     {
         return mLen;
     }
 
-    size_type
-    bucket_size(size_type index)
-    const
+private:
+    size_type mLen;
+};
+
+/** @brief Bad hash detection state, only kept by maps that need it. */
+template <bool HasGuard>
+class HashGuard
+{
+public:
+    uint64_t
+    get_guard_seed()
+    const noexcept
     {
-        auto block = get_block(index);
-        return block->is_empty(index) ? 0 : 1;
+        return 0;
     }
 
-    const_iterator
-    cbegin()
+    size_type
+    get_reseeds()
     const noexcept
     {
-        return const_iterator{ mBlock, 0, IteratorLeap{} };
+        return 0;
     }
 
-    const_iterator
-    cend()
-    const noexcept
+    bool
+    guard_strike(size_type UNUSED(size))
+    noexcept
     {
-        return const_iterator{ mBlock, mLen };
+        return false;
     }
 
     void
-    clear()
+    guard_pass()
     noexcept
-    {
-        if (empty())
-        {
-            return;
-        }
+    {}
 
-        destroy_values();
-        clear_data();
-        mSize = 0;
+    void
+    guard_forgive()
+    noexcept
+    {}
+
+    void
+    guard_reseed()
+    noexcept
+    {}
+};
+
+template <>
+class HashGuard<true>
+{
+public:
+    /** Leaps walked by one insert (extended leaps count a block each). */
+    static constexpr size_type GUARD_COST = 128;
+    /** Costly inserts tolerated before reseeding (plus 1 per 1024 entries). */
+    static constexpr size_type GUARD_STRIKES = 16;
+    /** Cheap chained inserts that forgive one strike. */
+    static constexpr size_type GUARD_PASSES = 1024;
+
+    uint64_t
+    get_guard_seed()
+    const noexcept
+    {
+        return mSeed;
     }
 
     size_type
-    count(const Key& k)
-    const
+    get_reseeds()
+    const noexcept
     {
-        return find_index(k) != mLen ? 1 : 0;
+        return mReseeds;
     }
 
-    template <class... Args>
-    std::pair<iterator, bool>
-    emplace(Args&&... args)
+    /** @return True if the map should reseed. */
+    bool
+    guard_strike(size_type size)
+    noexcept
     {
-        return upsert<true, false, false>(std::forward<Args>(args)...);
+        return ++mStrikes > GUARD_STRIKES + size / 1024;
     }
 
-    template <class... Args>
-    iterator
-    emplace_hint(const_iterator UNUSED(position), Args&&... args)
+    /** @brief Count a cheap chained insert, forgiving a strike now and then. */
+    void
+    guard_pass()
+    noexcept
     {
-        return upsert<true, false, false>(std::forward<Args>(args)...);
+        if (UNLIKELY(++mPasses >= GUARD_PASSES))
+        {
+            mPasses = 0;
+            mStrikes -= mStrikes ? 1 : 0;
+        }
     }
 
-    bool
-    empty()
-    const noexcept
+    /** @brief Forget strikes, e.g. once growth has shortened the lists. */
+    void
+    guard_forgive()
+    noexcept
     {
-        return 0 == mSize;
+        mStrikes = 0;
+        mPasses = 0;
     }
 
-    iterator
-    end()
-    noexcept
+    void
+    guard_reseed()
     {
-        return iterator{ mBlock, mLen };
+        mSeed = random_seed() | 1;
+        ++mReseeds;
+        guard_forgive();
     }
 
-    const_iterator
-    end()
+private:
+    uint64_t mSeed = 0;
+    size_type mReseeds = 0;
+    size_type mStrikes = 0;
+    size_type mPasses = 0;
+};
+
+/** @brief Resize listener, only kept by maps that report resizes. */
+template <bool HasListener>
+class ResizeHook
+{
+public:
+    resize_listener*
+    get_listener()
     const noexcept
     {
-        return cend();
+        return nullptr;
     }
 
-    std::pair<iterator, iterator>
-    equal_range(const key_type& k)
+    uint64_t
+    resize_start()
+    const noexcept
     {
-        size_type index = find_index(k);
-        if (index != mLen)
-        {
-            return { iterator{ mBlock, index },
-                     iterator{ mBlock, index + 1, IteratorLeap{} } };
-        }
-        else
-        {
-            return { end(), end() };
-        }
+        return 0;
     }
 
-    std::pair<const_iterator, const_iterator>
-    equal_range(const key_type& k)
-    const
+    void
+    resize_notify(const resize_event& UNUSED(e), uint64_t UNUSED(start))
+    const noexcept
+    {}
+};
+
+template <>
+class ResizeHook<true>
+{
+public:
+    resize_listener*
+    get_listener()
+    const noexcept
     {
-        size_type index = find_index(k);
-        if (index != mLen)
-        {
-            return { const_iterator{ mBlock, index },
-                     const_iterator{ mBlock, index + 1, IteratorLeap{} } };
-        }
-        else
-        {
-            return { cend(), cend() };
-        }
+        return mListener;
     }
 
-    iterator
-    erase(const_iterator position)
+    void
+    set_listener(resize_listener* l)
+    noexcept
     {
-        erase((*position).first);
-        return iterator{ position.mBlock, position.mIndex + 1, IteratorLeap{} };
+        mListener = l;
     }
 
-    size_type
-    erase(const key_type& k)
+    /** @return Start time, or 0 when there is no one to tell. */
+    uint64_t
+    resize_start()
+    const noexcept
     {
-        size_type hash = hash_key(k);
-        size_type ihead = hash_to_index(hash);
-        auto block = get_block(ihead);
+        return mListener ? now() : 0;
+    }
 
-        if (block->is_empty_or_link(ihead))
+    void
+    resize_notify(resize_event e, uint64_t start)
+    const noexcept
+    {
+        if (mListener)
         {
-            return 0;
+            e.nanoseconds = now() - start;
+            mListener->on_resize(e);
         }
+    }
 
-        uint8_t frag = hash_fragment(hash);
+private:
+    static uint64_t
+    now()
+    noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-        if (frag == block->get_hash(ihead))
-        {
-            if (LIKELY(compare_keys(block->get_value(ihead).first, k)))
-            {
-                allocator_traits::destroy(*this, block->get_value_ptr(ihead));
-                if (LIKELY(block->is_end(ihead)))
-                {
-                    block->set_empty(ihead);
-                }
-                else
-                {
-                    unlink_head_of_list(ihead);
-                }
-                --mSize;
-                return 1;
-            }
-        }
+    resize_listener* mListener = nullptr;
+};
 
-        if (block->is_end(ihead))
-        {
-            return 0;
-        }
+#ifdef HACKMAP_LATENCY
+/** @brief Times its scope into a histogram. */
+class LatencySample
+{
+public:
+    explicit
+    LatencySample(SharedHistogram& hist)
+    noexcept
+        : mHist(hist)
+        , mStart(__rdtsc())
+    {}
 
-        size_type index = ihead;
-        frag = block_type::set_link_hash(frag);
-        for (;;)
-        {
-            bool notrust = false;
-            size_type iprev = index;
-            index = leap(ihead, index, notrust);
-            block = get_block(index);
+    ~LatencySample()
+    {
+        mHist.record(__rdtsc() - mStart);
+    }
 
-            if (frag == block->get_hash(index) || notrust)
-            {
-                if (LIKELY(compare_keys(block->get_value(index).first, k)))
-                {
-                    unlink(ihead, iprev, index);
-                    block->set_empty(index);
-                    allocator_traits::destroy(*this,
-                        block->get_value_ptr(index));
-                    --mSize;
-                    return 1;
-                }
-            }
+private:
+    SharedHistogram& mHist;
+    uint64_t mStart;
+};
 
-            if (block->is_end(index))
-            {
-                return 0;
-            }
-        }
-        
-        return 0;
-    }
+/**
+ * @brief Call fn, timing it into hist.
+ * Kept out of line so the untimed path stays a counter and a branch.
+ */
+template <typename Fn>
+NOINLINE
+auto
+timed(SharedHistogram& hist, Fn&& fn) -> decltype(fn())
+{
+    LatencySample sample(hist);
+    return fn();
+}
+#endif
 
-    iterator
-    erase(const_iterator first, const_iterator last)
-    {
-        iterator start = iterator{ first.mBlock, first.mIndex };
-        while (start != last)
-        {
-            erase((*start).first);
-            ++start;
-        }
-        return start;
-    }
+class search_map
+{
+public:
+    search_map(int map)
+        : mMap(map)
+    {}
 
-    iterator
-    find(const key_type& k)
+    search_map(search_map& m)
+        : mMap(m.mMap)
+    {}
+
+    search_map(search_map&& m)
+        : mMap(m.mMap)
+    {}
+
+    search_map&
+    operator=(search_map& m)
     {
-        const size_type index = find_index(k);
-        return iterator{ mBlock, index };
+        mMap = m.mMap;
+        return *this;
     }
 
-    const_iterator
-    find(const key_type& k)
-    const
+    search_map&
+    operator=(search_map&& m)
     {
-        const size_type index = find_index(k);
-        return const_iterator{ mBlock, index };
+        mMap = m.mMap;
+        return *this;
     }
 
-    allocator_type
-    get_allocator()
+    bool
+    has()
     const noexcept
     {
-        return allocator_type{};
+        return !!mMap;
     }
 
-    hasher
-    hash_function()
-    const
+    int
+    next()
+    const noexcept
     {
-        return hasher{};
+        return __builtin_ffs(mMap) - 1;
     }
 
-    std::pair<iterator, bool>
-    insert(const value_type& val)
+    void
+    clear(int i)
     {
-        return upsert<false, false, false>(val);
+        mMap &= ~(1 << i);
     }
 
-    std::pair<iterator, bool>
-    insert(value_type&& val)
+    int
+    value()
+    const
     {
-        return upsert<false, false, false>(std::move(val));
+        return mMap;
     }
 
-    template <typename P>
-    std::pair<iterator, bool>
-    insert(P&& val)
-    {
-        return upsert<false, false, false>(std::move(val));
-    }
+private:
+    int mMap;
+};
 
-    iterator
-    insert(const_iterator UNUSED(hint), const value_type& val)
+/** @return Bit i set if hashes[i] == h, over one block. */
+static inline int
+block_match(const uint8_t* hashes, uint8_t h)
+noexcept
+{
+#if defined __SSE2__
+    // Documentation:
+    // https://software.intel.com/sites/landingpage/IntrinsicsGuide/
+    __m128i first = _mm_set1_epi8((char)h);
+    __m128i second = _mm_loadu_si128((const __m128i*)(hashes));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(first, second));
+#else
+    // Slower implementation available if we don't have SSE instructions.
+    int result = 0;
+
+    int i;
+    for (i = 0; i < BLOCK_LEN; ++i)
     {
-        return upsert<false, false, false>(val).first;
+        if (hashes[i] == h)
+        {
+            result |= (1 << i);
+        }
     }
 
-    template <typename P,
-              typename =
-                  typename std::enable_if<typeid(P) == typeid(const_iterator)
-                                          && typeid(P) == typeid(iterator)>
-                                          ::type
-              >
-    iterator
-    insert(const_iterator UNUSED(hint), P&& val)
-    {
-        return upsert<false, false, false>(std::move(val)).first;
-    }
+    return result;
+#endif
+}
 
-    template <typename InputIterator>
-    void
-    insert(InputIterator first, InputIterator last)
+static inline int
+block_match(const uint16_t* hashes, uint16_t h)
+noexcept
+{
+#if defined __SSE2__
+    // Compare both halves, then pack the 16-bit masks down to bytes
+    // so a single movemask gives one bit per entry.
+    __m128i first = _mm_set1_epi16((short)h);
+    __m128i low = _mm_loadu_si128((const __m128i*)(hashes));
+    __m128i high = _mm_loadu_si128((const __m128i*)(hashes + 8));
+    return _mm_movemask_epi8(
+        _mm_packs_epi16(_mm_cmpeq_epi16(first, low),
+                        _mm_cmpeq_epi16(first, high)));
+#else
+    int result = 0;
+
+    int i;
+    for (i = 0; i < BLOCK_LEN; ++i)
     {
-        while (first != last)
+        if (hashes[i] == h)
         {
-            upsert<false, false, false>(value_type(*first));
-            ++first;
+            result |= (1 << i);
         }
     }
 
-    void
-    insert(std::initializer_list<value_type> il)
-    {
-        insert(il.begin(), il.end());
-    }
+    return result;
+#endif
+}
 
-    key_equal
-    key_eq()
-    const
-    {
-        return key_equal{};
-    }
+/**
+ * @brief Define block type.
+ *
+ * Notes:
+ * The bitwise format for the hash byte (default policy):
+ * | 1           | 1        | 6         |
+ * | special bit | link bit | hash bits |
+ * FF = empty
+ * FE = unsearchable, no search will match this entry
+ * 40 = mask for the link bit
+ * 3F = mask for the hash bits
+ * Wider hash types keep the same format with more hash bits,
+ * e.g. 16 bits gives 14 bits of hash and FFFF as empty.
+ *
+ * The leap byte specifies where the next entry is:
+ * 0 = end of linked list
+ * [1, FE] = jump distance to next link
+ * FF = do inefficient search
+ * Wider leap types keep the same format, e.g. FFFF for 16 bits.
+ */
+template <typename Value, typename Policy = default_policy>
+class Block
+{
+public:
+    using hash_type = typename Policy::hash_type;
+    using leap_type = typename Policy::leap_type;
 
-    float
-    load_factor()
-    const
-    {
-        return static_cast<float>(mSize) / static_cast<float>(mLen);
-    }
+    static_assert(sizeof(hash_type) == 1 || sizeof(hash_type) == 2,
+                  "hash_type must be one or two octets");
+    static_assert(std::is_unsigned<hash_type>::value
+                  && std::is_unsigned<leap_type>::value,
+                  "hash_type and leap_type must be unsigned");
 
-    size_type
-    max_bucket_count()
-    const noexcept
-    {
-        return max_size();
-    }
+    /** Number of hash bits kept in each entry's hash fragment. */
+    static constexpr int HASH_BITS = int(sizeof(hash_type) * 8) - 2;
 
-    float
-    max_load_factor()
-    const
-    {
-        return static_cast<float>(MaxLoadFactor) / 100.0F;
-    }
+private:
+    hash_type mHash[BLOCK_LEN];
+    leap_type mLeap[BLOCK_LEN];
+    Value     mValue[BLOCK_LEN];
 
-    size_type
-    max_size()
-    const noexcept
-    {
-        return MAX_SIZE;
-    }
+    /* Hash related */
+    static constexpr hash_type SPECIAL   = hash_type(1u << (HASH_BITS + 1));
+    static constexpr hash_type EMPTY     = hash_type(~hash_type(0));
+    static constexpr hash_type NOFIND    = hash_type(EMPTY - 1);
+    static constexpr hash_type SENTINEL  = hash_type(EMPTY - 2);
+    static constexpr hash_type LINK      = hash_type(1u << HASH_BITS);
+    static constexpr hash_type HASH_MASK = hash_type(LINK - 1);
+    /* Link related */
+    static constexpr leap_type FIND      = leap_type(~leap_type(0));
 
-    unordered_map&
-    operator=(const unordered_map& o)
-    {
-        if (this == &o)
-        {
-            return *this;
-        }
+public:
+    static Block*
+    get(Block* b, size_type i)
+    { return b +  (i / BLOCK_LEN); }
 
-        if (mLen != o.mLen)
-        {
-            reset();
-            reserve(o.mSize);
-        }
-        else
-        {
-            clear();
-        }
+    static hash_type
+    set_link_hash(hash_type h)
+    { return h | LINK; }
 
-        hasher::operator=(static_cast<const hasher&>(o));
-        key_equal::operator=(static_cast<const key_equal&>(o));
-        allocator_type::operator=(static_cast<const allocator_type&>(o));
+    static hash_type
+    clear_link_hash(hash_type h)
+    { return h & HASH_MASK; }
 
-        insert(o.cbegin(), o.cend());
+    static bool
+    can_leap(size_type d)
+    { return d < size_type(FIND); }
 
-        return *this;
-    }
+    static void
+    fill_empty(unsigned char *p, size_type len)
+    { std::memset(p, 0xFF, len); }
 
-    unordered_map&
-    operator=(unordered_map&& o)
-    noexcept
+    static void
+    fill_sentinel(unsigned char *p)
     {
-        if (this == &o)
-        {
-            return *this;
-        }
-
-        if (o.mSize)
-        {
-            deallocate_blocks(mBlock, mLen);
-            mBlock = std::move(o.mBlock);
-            mSize = std::move(o.mSize);
-            mLoad = std::move(o.mLoad);
-            mLen = std::move(o.mLen);
-            mMask = std::move(o.mMask);
-            o.set_moved_from();
-        }
-        else
-        {
-            clear();
-            o.reset();
-        }
-
-        hasher::operator=(static_cast<const hasher&>(o));
-        key_equal::operator=(static_cast<const key_equal&>(o));
-        allocator_type::operator=(static_cast<const allocator_type&>(o));
-
-        return *this;
+#if 1
+        hash_type s = SENTINEL;
+        std::memcpy(p, &s, sizeof(s));
+#else
+        std::memset(p, SENTINEL, BLOCK_LEN);
+#endif
     }
 
-    unordered_map&
-    operator=(std::initializer_list<value_type> il)
+    static size_type
+    sentinel_memory_size()
     {
-        clear();
-        insert(il.begin(), il.end());
-        return *this;
+#if 1
+        return sizeof(hash_type);
+#else
+        return BLOCK_LEN;
+#endif
     }
 
-    template <typename OtherMap>
-    bool
-    operator==(const OtherMap& o)
-    const
+    static size_type
+    construct_index(size_type i, int sub)
+    { return (i & ~(BLOCK_LEN - 1)) + sub; }
+
+    Block()
     {
-        if (size() != o.size())
+        for (int i = 0; i < BLOCK_LEN; ++i)
         {
-            return false;
+            mHash[i] = EMPTY;
         }
+    }
 
-        iterator start{ mBlock, 0, IteratorLeap{} };
-        const_iterator stop = cend();
-
-        while (start != stop)
+    Block(BlockFull UNUSED(full))
+    {
+        for (int i = 0; i < BLOCK_LEN; ++i)
         {
-            if (0 == o.count((*start).first))
-            {
-                return false;
-            }
-            ++start;
+            mHash[i] = NOFIND;
         }
-        
-        return true;
     }
 
-    template <typename OtherMap>
     bool
-    operator!=(const OtherMap& o)
-    const
-    {
-        return !operator==(o);
-    }
+    is_empty(size_type i)
+    const noexcept
+    { return mHash[i % BLOCK_LEN] == EMPTY; }
 
-    mapped_type&
-    operator[](const key_type& k)
-    {
-        return upsert<false, false, false>(k, mapped_type()).first->second;
-    }
+    bool
+    is_empty_or_link(size_type i)
+    const noexcept
+    { return mHash[i % BLOCK_LEN] & (SPECIAL | LINK); }
 
-    mapped_type&
-    operator[](key_type&& k)
-    {
-        return upsert<false, false, false>(std::move(k),
-                                          mapped_type()).first->second;
-    }
+    bool
+    is_full(size_type i)
+    const noexcept
+    { return !is_empty(i); }
 
-    void
-    rehash(size_type n)
-    {
-        if (mSize <= n && n < mLen)
-        {
-            resize_to(n);
-        }
-    }
+    bool
+    is_head(size_type i)
+    const noexcept
+    { return !is_link(i); }
 
-    void
-    reset()
-    noexcept
-    {
-        destroy_values();
-        deallocate_blocks(mBlock, mLen);
-        set_moved_from();
-    }
+    bool
+    is_link(size_type i)
+    const noexcept
+    { return mHash[i % BLOCK_LEN] & LINK; }
 
-    void
-    reserve(size_type count)
-    {
-        if (mLoad < count)
-        {
-            size_type lenFor = len_by_force_load(count);
-            resize_to(lenFor);
-        }
-    }
+    bool
+    is_end(size_type i)
+    const noexcept
+    { return 0 == mLeap[i % BLOCK_LEN]; }
 
-    size_type
-    size()
+    bool
+    is_local(size_type i)
     const noexcept
-    {
-        return mSize;
-    }
+    { return !is_foreign(i); }
 
-    void
-    swap(unordered_map& o)
-    {
-        if (this == &o)
+    bool
+    is_foreign(size_type i)
+    const noexcept
+    { return mLeap[i % BLOCK_LEN] == FIND; }
+
+    void
+    set_nofind(size_type i)
+    noexcept
+    { mHash[i % BLOCK_LEN] = NOFIND; }
+
+    hash_type
+    get_hash(size_type i)
+    const noexcept
+    { return mHash[i % BLOCK_LEN]; }
+
+    hash_type
+    get_hash_only(size_type i)
+    const noexcept
+    { return mHash[i % BLOCK_LEN] & HASH_MASK; }
+
+    hash_type
+    get_hash_as_link(size_type i)
+    const noexcept
+    { return set_link_hash(mHash[i % BLOCK_LEN]); }
+
+    void
+    set_hash(size_type i, hash_type hash)
+    noexcept
+    { mHash[i % BLOCK_LEN] = hash; }
+
+    leap_type
+    get_leap(size_type i)
+    const noexcept
+    { return mLeap[i % BLOCK_LEN]; }
+
+    void
+    set_leap(size_type i, leap_type leap)
+    noexcept
+    { mLeap[i % BLOCK_LEN] = leap; }
+
+    void
+    set_find(size_type i)
+    noexcept
+    { mLeap[i % BLOCK_LEN] = FIND; }
+
+    void
+    set_end(size_type i)
+    noexcept
+    { mLeap[i % BLOCK_LEN] = 0; }
+
+    void
+    set_empty(size_type i)
+    noexcept
+    { mHash[i % BLOCK_LEN] = EMPTY; }
+
+    Value&
+    get_value(size_type i)
+    noexcept
+    { return *(mValue + (i % BLOCK_LEN)); }
+
+    Value*
+    get_value_ptr(size_type i)
+    noexcept
+    { return mValue + (i % BLOCK_LEN); }
+
+    search_map
+    find(hash_type h)
+    const noexcept
+    {
+        return { block_match(mHash, h) };
+    }
+
+    search_map
+    find_empty(size_type i)
+    const noexcept
+    {
+        return { find_empty().value() & ~((1 << (i % BLOCK_LEN)) - 1) };
+    }
+
+    search_map
+    find_empty()
+    const noexcept
+    {
+        return { find(EMPTY) };
+    }
+
+    search_map
+    find_full(size_type i)
+    const noexcept
+    {
+        return { find_full().value() & ~((1 << (i % BLOCK_LEN)) - 1) };
+    }
+
+    search_map
+    find_full()
+    const noexcept
+    {
+        return { ~find(EMPTY).value() & ((1 << BLOCK_LEN) - 1) };
+    }
+
+    bool
+    is_empty_by_subindex(int i)
+    const noexcept
+    { return mHash[i] == EMPTY; }
+
+    bool
+    is_nofind_by_subindex(int i)
+    const noexcept
+    { return mHash[i] == NOFIND; }
+
+    bool
+    is_head_by_subindex(int i)
+    const noexcept
+    { return !(mHash[i] & LINK); }
+
+    bool
+    is_special_by_subindex(int i)
+    { return mHash[i] & SPECIAL; }
+
+
+    hash_type
+    get_hash_by_subindex(int i)
+    const noexcept
+    { return mHash[i]; }
+
+    leap_type
+    get_leap_by_subindex(int i)
+    const noexcept
+    { return mLeap[i]; }
+
+    Value&
+    get_value_by_subindex(int i)
+    { return mValue[i]; }
+};
+
+template <typename Policy>
+static Block<uint8_t, Policy> NULL_BLOCK(BlockFull{});
+
+template <int MaxLoadFactor,
+          typename Key,
+          typename T,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>,
+          typename Alloc = std::allocator<unsigned char>,
+          typename Policy = default_policy
+          >
+class unordered_map: public Hash, public Pred, public Alloc,
+                     private HashGuard<Policy::hash_guard>,
+                     private ResizeHook<Policy::resize_listener>
+{
+    using allocator_traits = std::allocator_traits<Alloc>;
+    using guard_type = HashGuard<Policy::hash_guard>;
+    using hook_type = ResizeHook<Policy::resize_listener>;
+
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<const key_type, mapped_type>;
+    using hasher = Hash;
+    using key_equal = Pred;
+    using allocator_type = Alloc;
+    using policy_type = Policy;
+    using block_type = Block<value_type, policy_type>;
+    using hash_type = typename block_type::hash_type;
+    using leap_type = typename block_type::leap_type;
+    using self_type =
+        unordered_map<MaxLoadFactor,
+                      key_type,
+                      mapped_type,
+                      hasher,
+                      key_equal,
+                      allocator_type,
+                      policy_type>;
+
+public:
+    template <bool IsConstant>
+    class Iterator: public IteratorLen<policy_type::full_summary>
+    {
+        using len_type = IteratorLen<policy_type::full_summary>;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename self_type::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer =
+            typename std::conditional<IsConstant,
+                                      const value_type*,
+                                      value_type*>::type;
+        using reference =
+            typename std::conditional<IsConstant,
+                                      const value_type&,
+                                      value_type&>::type;
+        using block_type = typename self_type::block_type;
+
+        Iterator() = delete;
+
+        template <bool OtherIsConstant>
+        Iterator(const Iterator<OtherIsConstant>& o)
+            : len_type(o.get_len()), mBlock(o.mBlock), mIndex(o.mIndex)
+        {}
+
+        Iterator(block_type* blockPointer, size_type index, size_type len)
+            : len_type(len), mBlock(blockPointer), mIndex(index)
+        {}
+
+        Iterator(block_type* blockPointer, size_type index, size_type len,
+                 IteratorLeap UNUSED(unused))
+            : len_type(len), mBlock(blockPointer), mIndex(index)
+        {
+            leap_if_empty();
+        }
+
+        template <bool OtherIsConstant,
+                  typename =
+                      typename std::enable_if<IsConstant
+                                              && !OtherIsConstant>
+                                              ::type
+                  >
+        Iterator&
+        operator=(const Iterator<OtherIsConstant>& o)
+        noexcept
+        {
+            len_type::operator=(o);
+            mBlock = o.mBlock;
+            mIndex = o.mIndex;
+            return *this;
+        }
+
+        Iterator&
+        operator++()
+        noexcept
+        {
+            ++mIndex;
+            leap_if_empty();
+            return *this;
+        }
+
+        Iterator
+        operator++(int)
+        noexcept
+        {
+            return { mBlock, mIndex + 1, this->get_len() };
+        }
+
+        reference
+        operator*()
+        const
+        {
+            auto block = block_type::get(mBlock, mIndex);
+            return block->get_value(mIndex);
+        }
+
+        pointer
+        operator->()
+        const
+        {
+            auto block = block_type::get(mBlock, mIndex);
+            return block->get_value_ptr(mIndex);
+        }
+
+        template <bool OtherIsConstant>
+        bool
+        operator==(const Iterator<OtherIsConstant>& o)
+        const noexcept
+        {
+            return mIndex == o.mIndex;
+        }
+
+        template <bool OtherIsConstant>
+        bool
+        operator!=(const Iterator<OtherIsConstant>& o)
+        const noexcept
+        {
+            return mIndex != o.mIndex;
+        }
+
+
+    private:
+        block_type* mBlock;
+        size_type   mIndex;
+
+        INLINE void
+        leap_if_empty()
+        {
+            auto block = block_type::get(mBlock, mIndex);
+            if (block->is_empty(mIndex))
+            {
+#if 1
+                search_map map = block->find_full(mIndex);
+                if (policy_type::full_summary && !map.has())
+                {
+                    size_type len = this->get_len();
+                    size_type iblock = self_type::next_full_block(
+                        mBlock, len, (mIndex / BLOCK_LEN) + 1);
+                    mIndex = iblock * BLOCK_LEN;
+                    if (mIndex >= len)
+                    {
+                        mIndex = len;
+                        return;
+                    }
+                    block = block_type::get(mBlock, mIndex);
+                    map = block->find_full();
+                }
+                while (!map.has())
+                {
+                    mIndex += 16;
+                    block = block_type::get(mBlock, mIndex);
+
+                    // Make sure we don't overshoot our sentinel.
+                    if (!block->is_empty_by_subindex(0))
+                    {
+                        map = search_map(1);
+                        break;
+                    }
+
+                    map = block->find_full();
+                }
+                mIndex = block_type::construct_index(mIndex, map.next());
+#else
+                switch (block_type::get_subindex(mIndex))
+                {
+                    case 0:
+                    case 1:
+                    case 2:
+                    case 3:
+                    case 4:
+                    case 5:
+                    case 6:
+                    case 7:
+                    case 8:
+                    case 9:
+                    case 10:
+                    case 11:
+                    case 12:
+                    case 13:
+                    case 14:
+                    case 15:
+                }
+#endif
+            }
+        }
+
+        friend class unordered_map<MaxLoadFactor,
+                                   key_type,
+                                   mapped_type,
+                                   hasher,
+                                   key_equal,
+                                   allocator_type,
+                                   policy_type>;
+    };
+
+private:
+    template <typename, typename, typename, typename>
+    friend class hackmap::frozen_map;
+
+    // TODO the maximum possible size may be much smaller than this due to use of doubles in loadfactor calculations
+    static constexpr size_type MAX_SIZE =
+        size_type(1) << ((sizeof(size_type) * 8) - 2);
+    block_type* mBlock      =
+        reinterpret_cast<block_type*>(&NULL_BLOCK<policy_type>);
+    size_type   mSize       = 0;
+    size_type   mLoad       = 0;
+    size_type   mLen        = 0;
+    size_type   mMask       = 0;
+#if defined(HACKMAP_COUNTERS) && !defined(HACKMAP_COUNTERS_THREAD)
+    mutable detail::SharedCounters mCounters;
+#endif
+#ifdef HACKMAP_LATENCY
+    mutable detail::SharedLatency mLatency;
+#endif
+
+public:
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    unordered_map() = default;
+
+    explicit
+    unordered_map(size_type count,
+                  const hasher& hash = hasher(),
+                  const key_equal& equal = key_equal(),
+                  const allocator_type& alloc = allocator_type())
+        : hasher(hash), key_equal(equal), allocator_type(alloc)
+    {
+        reserve(count);
+    }
+
+    explicit
+    unordered_map(const allocator_type& alloc)
+        : allocator_type(alloc)
+    {}
+
+    template <class InputIterator>
+    unordered_map(InputIterator start, InputIterator stop,
+                  size_type count = 0,
+                  const hasher& hash = hasher(),
+                  const key_equal& equal = key_equal(),
+                  const allocator_type& alloc = allocator_type())
+        : hasher(hash), key_equal(equal), allocator_type(alloc)
+    {
+        reserve(count);
+        insert(start, stop);
+    }
+
+    unordered_map(const unordered_map& o)
+        : hasher(static_cast<const hasher&>(o)),
+          key_equal(static_cast<const key_equal&>(o)),
+          allocator_type(static_cast<const allocator_type&>(o))
+    {
+        if (o.mSize)
+        {
+            reserve(o.mSize);
+            insert(o.cbegin(), o.cend());
+        }
+    }
+
+    unordered_map(const unordered_map& o, const allocator_type& alloc)
+        : hasher(static_cast<const hasher&>(o)),
+          key_equal(static_cast<const key_equal&>(o)),
+          allocator_type(alloc)
+    {
+        if (o.mSize)
+        {
+            reserve(o.mSize);
+            insert(o.cbegin(), o.cend());
+        }
+    }
+
+    unordered_map(unordered_map&& o)
+        : hasher(std::move(static_cast<const hasher&>(o))),
+          key_equal(std::move(static_cast<const key_equal&>(o))),
+          allocator_type(std::move(static_cast<const allocator_type&>(o))),
+          guard_type(static_cast<const guard_type&>(o)),
+          hook_type(static_cast<const hook_type&>(o))
+    {
+        if (o.mSize)
+        {
+            mBlock = std::move(o.mBlock);
+            mSize = std::move(o.mSize);
+            mLoad = std::move(o.mLoad);
+            mLen = std::move(o.mLen);
+            mMask = std::move(o.mMask);
+            o.set_moved_from();
+        }
+        else
+        {
+            o.reset();
+        }
+    }
+
+    unordered_map(unordered_map&& o, const allocator_type& alloc)
+        : hasher(std::move(static_cast<const hasher&>(o))),
+          key_equal(std::move(static_cast<const key_equal&>(o))),
+          allocator_type(alloc),
+          guard_type(static_cast<const guard_type&>(o)),
+          hook_type(static_cast<const hook_type&>(o))
+    {
+        if (o.mSize)
+        {
+            mBlock = std::move(o.mBlock);
+            mSize = std::move(o.mSize);
+            mLoad = std::move(o.mLoad);
+            mLen = std::move(o.mLen);
+            mMask = std::move(o.mMask);
+            o.set_moved_from();
+        }
+        else
+        {
+            o.reset();
+        }
+    }
+
+    unordered_map(std::initializer_list<value_type> il,
+                  size_type count = 0,
+                  const hasher& hash = hasher(),
+                  const key_equal& equal = key_equal(),
+                  const allocator_type& alloc = allocator_type())
+        : hasher(hash), key_equal(equal), allocator_type(alloc)
+    {
+        reserve(count);
+        insert(il.begin(), il.end());
+    }
+
+    ~unordered_map()
+    {
+        destroy_values();
+        deallocate_blocks(mBlock, mLen);
+        mBlock = nullptr;
+    }
+
+    mapped_type&
+    at(const key_type& k)
+    {
+        size_type index = find_index(k);
+        if (index == mLen)
+        {
+            throw std::out_of_range("hackmap::unordered_map key not found");
+        }
+        auto block = get_block(index);
+        return block->get_value(index).second;
+    }
+
+    const mapped_type&
+    at(const key_type& k)
+    const
+    {
+        size_type index = find_index(k);
+        if (index == mLen)
+        {
+            throw std::out_of_range("hackmap::unordered_map key not found");
+        }
+        auto block = get_block(index);
+        return block->get_value(index).second;
+    }
+
+    iterator
+    begin()
+    noexcept
+    {
+        return iterator{ mBlock, 0, mLen, IteratorLeap{} };
+    }
+
+    const_iterator
+    begin()
+    const noexcept
+    {
+        return cbegin();
+    }
+
+    size_type
+    bucket(const key_type& k)
+    const
+    {
+        return find_index(k);
+    }
+
+    size_type
+    bucket_count()
+    const noexcept
+    {
+        return mLen;
+    }
+
+    size_type
+    bucket_size(size_type index)
+    const
+    {
+        auto block = get_block(index);
+        return block->is_empty(index) ? 0 : 1;
+    }
+
+    /** @return Bucket of it, as bucket(it->first) would return. */
+    size_type
+    bucket_of(const_iterator it)
+    const noexcept
+    {
+        return it.mIndex;
+    }
+
+    /** @return Iterator to the element in (non empty) bucket index. */
+    iterator
+    bucket_entry(size_type index)
+    noexcept
+    {
+        return iterator{ mBlock, index, mLen };
+    }
+
+    /**
+     * @brief Erase the element in (non empty) bucket index.
+     * @note The bucket may then hold another element moved up its chain.
+     */
+    void
+    erase_bucket(size_type index)
+    {
+        erase_at(index);
+    }
+
+    /**
+     * @return Bit per non empty bucket of the BLOCK_LEN buckets holding
+     *         index, lowest bit first (one SSE2 compare).
+     */
+    int
+    bucket_block_mask(size_type index)
+    const noexcept
+    {
+        return get_block(index)->find_full().value();
+    }
+
+    const_iterator
+    cbegin()
+    const noexcept
+    {
+        return const_iterator{ mBlock, 0, mLen, IteratorLeap{} };
+    }
+
+    const_iterator
+    cend()
+    const noexcept
+    {
+        return const_iterator{ mBlock, mLen, mLen };
+    }
+
+    void
+    clear()
+    noexcept
+    {
+        if (empty())
+        {
+            return;
+        }
+
+        uint64_t start = hook_type::resize_start();
+        size_type oldSize = mSize;
+        destroy_values();
+        clear_data();
+        mSize = 0;
+        notify_resize(resize_reason::clear, mLen, oldSize, start);
+    }
+
+    size_type
+    count(const Key& k)
+    const
+    {
+        return find_index(k) != mLen ? 1 : 0;
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool>
+    emplace(Args&&... args)
+    {
+        return upsert<true, false, false>(std::forward<Args>(args)...);
+    }
+
+    template <class... Args>
+    iterator
+    emplace_hint(const_iterator UNUSED(position), Args&&... args)
+    {
+        return upsert<true, false, false>(std::forward<Args>(args)...);
+    }
+
+    /**
+     * @brief Insert k with mapped_type(args...) unless k is present;
+     *        args are only used (and a value only built) on insert.
+     */
+    template <class... Args>
+    std::pair<iterator, bool>
+    try_emplace(const key_type& k, Args&&... args)
+    {
+        return upsert<false, false, false>(k, MappedArgs<Args...>{
+            std::forward_as_tuple(std::forward<Args>(args)...) });
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool>
+    try_emplace(key_type&& k, Args&&... args)
+    {
+        return upsert<false, false, false>(std::move(k), MappedArgs<Args...>{
+            std::forward_as_tuple(std::forward<Args>(args)...) });
+    }
+
+    /**
+     * @brief Find k, or insert k with mapped_type(on_insert()), in one probe.
+     *        On a hit on_exists(value) updates the value in place and may
+     *        return compute_action::erase to remove the entry.
+     * @return Entry (end() if erased) and whether it was inserted.
+     */
+    template <class Factory, class Updater>
+    std::pair<iterator, bool>
+    upsert(const key_type& k, Factory on_insert, Updater on_exists)
+    {
+        auto it = upsert<false, false, false>(k, MappedFactory<Factory>{
+            on_insert });
+        if (!it.second
+            && compute_action::erase == call_update(on_exists, it.first))
+        {
+            erase_at(it.first.mIndex);
+            return { end(), false };
+        }
+        return it;
+    }
+
+    /**
+     * @brief Run fn(value) on k's value, inserted as mapped_type() if k is
+     *        new, in one probe; fn may return compute_action::erase.
+     * @return Entry, or end() if erased.
+     */
+    template <class Fn>
+    iterator
+    compute(const key_type& k, Fn fn)
+    {
+        auto it = try_emplace(k).first;
+        if (compute_action::erase == call_update(fn, it))
+        {
+            erase_at(it.mIndex);
+            return end();
+        }
+        return it;
+    }
+
+    /** @brief try_emplace() with hash from hash_of(k). */
+    template <class... Args>
+    std::pair<iterator, bool>
+    try_emplace_hashed(size_type hash, const key_type& k, Args&&... args)
+    {
+        return upsert_hashed<false, false, false>(hash, k, MappedArgs<Args...>{
+            std::forward_as_tuple(std::forward<Args>(args)...) });
+    }
+
+    bool
+    empty()
+    const noexcept
+    {
+        return 0 == mSize;
+    }
+
+    iterator
+    end()
+    noexcept
+    {
+        return iterator{ mBlock, mLen, mLen };
+    }
+
+    const_iterator
+    end()
+    const noexcept
+    {
+        return cend();
+    }
+
+    std::pair<iterator, iterator>
+    equal_range(const key_type& k)
+    {
+        size_type index = find_index(k);
+        if (index != mLen)
+        {
+            return { iterator{ mBlock, index, mLen },
+                     iterator{ mBlock, index + 1, mLen, IteratorLeap{} } };
+        }
+        else
+        {
+            return { end(), end() };
+        }
+    }
+
+    std::pair<const_iterator, const_iterator>
+    equal_range(const key_type& k)
+    const
+    {
+        size_type index = find_index(k);
+        if (index != mLen)
+        {
+            return { const_iterator{ mBlock, index, mLen },
+                     const_iterator{ mBlock, index + 1, mLen,
+                                     IteratorLeap{} } };
+        }
+        else
+        {
+            return { cend(), cend() };
+        }
+    }
+
+    iterator
+    erase(const_iterator position)
+    {
+        erase_at(position.mIndex);
+        return iterator{ position.mBlock, position.mIndex + 1, mLen,
+                         IteratorLeap{} };
+    }
+
+    size_type
+    erase(const key_type& k)
+    {
+        size_type hash = hash_key(k);
+        HACKMAP_SAMPLE(erase, true, erase_key(hash, k));
+        return erase_key(hash, k);
+    }
+
+private:
+    INLINE
+    size_type
+    erase_key(size_type hash, const key_type& k)
+    {
+        size_type ihead = hash_to_index(hash);
+        auto block = get_block(ihead);
+
+        if (block->is_empty_or_link(ihead))
+        {
+            return 0;
+        }
+
+        hash_type frag = hash_fragment(hash);
+
+        if (frag == block->get_hash(ihead))
+        {
+            if (LIKELY(compare_keys(block->get_value(ihead).first, k)))
+            {
+                allocator_traits::destroy(*this, block->get_value_ptr(ihead));
+                if (LIKELY(block->is_end(ihead)))
+                {
+                    block->set_empty(ihead);
+                    summary_empty(ihead);
+                }
+                else
+                {
+                    unlink_head_of_list(ihead);
+                }
+                --mSize;
+                return 1;
+            }
+        }
+
+        if (block->is_end(ihead))
+        {
+            return 0;
+        }
+
+        size_type index = ihead;
+        frag = block_type::set_link_hash(frag);
+        for (;;)
+        {
+            bool notrust = false;
+            size_type iprev = index;
+            index = leap(ihead, index, notrust);
+            block = get_block(index);
+
+            if (frag == block->get_hash(index) || notrust)
+            {
+                if (LIKELY(compare_keys(block->get_value(index).first, k)))
+                {
+                    unlink(ihead, iprev, index);
+                    block->set_empty(index);
+                    summary_empty(index);
+                    allocator_traits::destroy(*this,
+                        block->get_value_ptr(index));
+                    --mSize;
+                    return 1;
+                }
+            }
+
+            if (block->is_end(index))
+            {
+                return 0;
+            }
+        }
+        
+        return 0;
+    }
+
+public:
+    iterator
+    erase(const_iterator first, const_iterator last)
+    {
+        iterator start = iterator{ first.mBlock, first.mIndex, mLen };
+        while (start != last)
+        {
+            erase((*start).first);
+            ++start;
+        }
+        return start;
+    }
+
+    iterator
+    find(const key_type& k)
+    {
+        const size_type index = find_index(k);
+        return iterator{ mBlock, index, mLen };
+    }
+
+    const_iterator
+    find(const key_type& k)
+    const
+    {
+        const size_type index = find_index(k);
+        return const_iterator{ mBlock, index, mLen };
+    }
+
+    /** @brief find() with hash from hash_of(k), e.g. after prefetch(). */
+    iterator
+    find(const key_type& k, size_type hash)
+    {
+        const size_type index = find_index_hashed(hash, k);
+        return iterator{ mBlock, index, mLen };
+    }
+
+    const_iterator
+    find(const key_type& k, size_type hash)
+    const
+    {
+        const size_type index = find_index_hashed(hash, k);
+        return const_iterator{ mBlock, index, mLen };
+    }
+
+    /**
+     * @return Hash of k as this map uses it.
+     * @note Changes when a hash_guard map reseeds (i.e. on insert).
+     */
+    size_type
+    hash_of(const key_type& k)
+    const
+    {
+        return hash_key(k);
+    }
+
+    /**
+     * @brief Start loading the home block for a hash from hash_of().
+     * @note Only its fragments; also fetching the value measured slower.
+     */
+    void
+    prefetch(size_type hash)
+    const noexcept
+    {
+        __builtin_prefetch(get_block(hash_to_index(hash)));
+    }
+
+    allocator_type
+    get_allocator()
+    const noexcept
+    {
+        return allocator_type{};
+    }
+
+    hasher
+    hash_function()
+    const
+    {
+        return static_cast<const hasher&>(*this);
+    }
+
+    std::pair<iterator, bool>
+    insert(const value_type& val)
+    {
+        return upsert<false, false, false>(val);
+    }
+
+    std::pair<iterator, bool>
+    insert(value_type&& val)
+    {
+        return upsert<false, false, false>(std::move(val));
+    }
+
+    template <typename P>
+    std::pair<iterator, bool>
+    insert(P&& val)
+    {
+        return upsert<false, false, false>(std::move(val));
+    }
+
+    iterator
+    insert(const_iterator UNUSED(hint), const value_type& val)
+    {
+        return upsert<false, false, false>(val).first;
+    }
+
+    template <typename P,
+              typename =
+                  typename std::enable_if<typeid(P) == typeid(const_iterator)
+                                          && typeid(P) == typeid(iterator)>
+                                          ::type
+              >
+    iterator
+    insert(const_iterator UNUSED(hint), P&& val)
+    {
+        return upsert<false, false, false>(std::move(val)).first;
+    }
+
+    template <typename InputIterator>
+    void
+    insert(InputIterator first, InputIterator last)
+    {
+        while (first != last)
+        {
+            upsert<false, false, false>(value_type(*first));
+            ++first;
+        }
+    }
+
+    void
+    insert(std::initializer_list<value_type> il)
+    {
+        insert(il.begin(), il.end());
+    }
+
+    /**
+     * @brief Insert a range of key/value pairs, existing keys are kept.
+     *
+     * For forward ranges the map is reserved once, every key is hashed
+     * up front, and the pairs are radix sorted by home index so the
+     * table is filled in address order.
+     * Input ranges fall back to insert.
+     */
+    template <typename InputIterator>
+    void
+    bulk_insert(InputIterator first, InputIterator last)
+    {
+        bulk_insert(first, last,
+                    typename std::iterator_traits<InputIterator>
+                                ::iterator_category{});
+    }
+
+    key_equal
+    key_eq()
+    const
+    {
+        return static_cast<const key_equal&>(*this);
+    }
+
+    /**
+     * @return Times a degenerate hash was detected and the map reseeded.
+     *         Always 0 unless the policy sets hash_guard.
+     */
+    size_type
+    reseed_count()
+    const noexcept
+    {
+        return guard_type::get_reseeds();
+    }
+
+    /**
+     * @brief Tell l (or no one, if null) about every later resize.
+     * @note Needs a policy that sets resize_listener; l must outlive
+     *       the map or be uninstalled first.
+     */
+    template <bool HasListener = policy_type::resize_listener>
+    void
+    set_resize_listener(resize_listener* l)
+    noexcept
+    {
+        static_assert(HasListener,
+                      "set_resize_listener needs policy resize_listener");
+        hook_type::set_listener(l);
+    }
+
+    /** @return Installed listener; always null without the policy. */
+    resize_listener*
+    get_resize_listener()
+    const noexcept
+    {
+        return hook_type::get_listener();
+    }
+
+    /**
+     * @return Operation counters; the calling thread's (across maps)
+     *         with HACKMAP_COUNTERS_THREAD, zeros unless enabled.
+     */
+    unordered_map_counters
+    counters()
+    const noexcept
+    {
+#if defined(HACKMAP_COUNTERS_THREAD)
+        return thread_counters();
+#elif defined(HACKMAP_COUNTERS)
+        return mCounters.snapshot();
+#else
+        return unordered_map_counters{};
+#endif
+    }
+
+    void
+    reset_counters()
+    noexcept
+    {
+#if defined(HACKMAP_COUNTERS_THREAD)
+        thread_counters() = unordered_map_counters{};
+#elif defined(HACKMAP_COUNTERS)
+        mCounters.reset();
+#endif
+    }
+
+    /** @return Sampled latency histograms, empty unless HACKMAP_LATENCY. */
+    unordered_map_latency
+    latency()
+    const
+    {
+#ifdef HACKMAP_LATENCY
+        return mLatency.snapshot();
+#else
+        return unordered_map_latency{};
+#endif
+    }
+
+    void
+    reset_latency()
+    noexcept
+    {
+#ifdef HACKMAP_LATENCY
+        mLatency.reset();
+#endif
+    }
+
+    float
+    load_factor()
+    const
+    {
+        return static_cast<float>(mSize) / static_cast<float>(mLen);
+    }
+
+    /** @return Fraction of the miss filter's bits set (0 without one). */
+    float
+    filter_fill()
+    const noexcept
+    {
+        if (!policy_type::miss_filter
+            || reinterpret_cast<block_type*>(&NULL_BLOCK<policy_type>)
+               == mBlock)
+        {
+            return 0;
+        }
+        const uint64_t* filter = get_filter(mBlock, mLen);
+        size_type bits = 0;
+        for (size_type iblock = 0; iblock < mLen / BLOCK_LEN; ++iblock)
+        {
+            bits += size_type(__builtin_popcountll(filter[iblock]));
+        }
+        return static_cast<float>(bits) / static_cast<float>(mLen * 4);
+    }
+
+    /**
+     * @return Bytes of heap the table holds: entries, sentinel, and any
+     *         summaries (not sizeof(*this), nor memory values own).
+     */
+    size_type
+    memory_usage()
+    const noexcept
+    {
+        if (reinterpret_cast<block_type*>(&NULL_BLOCK<policy_type>) == mBlock)
+        {
+            return 0;
+        }
+        return total_memory_size(mLen);
+    }
+
+    /**
+     * @return memory_usage() plus size(v) for every value, for values
+     *         that own heap memory (e.g. the capacity of a string).
+     */
+    template <typename ValueSize>
+    size_type
+    memory_usage(ValueSize size)
+    const
+    {
+        size_type bytes = memory_usage();
+        const_iterator start = cbegin();
+        const_iterator stop = cend();
+
+        while (start != stop)
+        {
+            bytes += size(*start);
+            ++start;
+        }
+        return bytes;
+    }
+
+    /** @return memory_usage() per element; 0 if empty. */
+    double
+    bytes_per_element()
+    const noexcept
+    {
+        return mSize ? double(memory_usage()) / double(mSize) : 0.0;
+    }
+
+    /** @return True if save(os) can write the table as raw bytes. */
+    static constexpr bool
+    raw_snapshot()
+    noexcept
+    {
+        return std::is_trivially_copyable<key_type>::value
+               && std::is_trivially_copyable<mapped_type>::value;
+    }
+
+    /**
+     * @brief Write a snapshot_header, then the whole table (entries,
+     *        sentinel, and summaries) in one write.
+     * @throw std::runtime_error if the stream fails.
+     */
+    void
+    save(std::ostream& os)
+    const
+    {
+        static_assert(raw_snapshot(), "hackmap: save(os) needs trivially "
+                      "copyable keys and values, use save(os, write_value)");
+        snapshot_header head = snapshot_head(true);
+        head.bytes = memory_usage();
+        write_snapshot(os, &head, sizeof(head));
+        write_snapshot(os, mBlock, head.bytes);
+    }
+
+    /**
+     * @brief Write a snapshot_header, then write_value(os, value) for
+     *        every value (for any type; load with load(is, read_value)).
+     * @throw std::runtime_error if the stream fails.
+     */
+    template <typename WriteValue>
+    void
+    save(std::ostream& os, WriteValue write_value)
+    const
+    {
+        snapshot_header head = snapshot_head(false);
+        write_snapshot(os, &head, sizeof(head));
+        for (const auto& kv : *this)
+        {
+            write_value(os, kv);
+        }
+        if (!os)
+        {
+            throw std::runtime_error("hackmap::unordered_map snapshot write");
+        }
+    }
+
+    /**
+     * @brief Replace the contents with a save(os) snapshot, reading the
+     *        table straight into place. If the first keys no longer hash
+     *        as they did when saved (e.g. a seeded hasher) the table is
+     *        rebuilt in place instead.
+     *
+     * The header must match this map's layout and load factor, and the
+     * hash and leap bytes, sentinel, and summaries must agree, else the
+     * map is left as it was. Keys, values, extended leaps, and the miss
+     * filter are taken as written, so only load snapshots you trust: a
+     * file corrupt there is undefined behaviour.
+     * @throw std::runtime_error on a bad stream, header, layout, or table.
+     */
+    void
+    load(std::istream& is)
+    {
+        static_assert(raw_snapshot(), "hackmap: load(is) needs trivially "
+                      "copyable keys and values, use load(is, read_value)");
+        snapshot_header head = read_snapshot_head(is, true);
+        if (!head.len)
+        {
+            clear();
+            return;
+        }
+        if (head.len != to_power_2(head.len) || head.len < BLOCK_LEN
+            || head.bytes != total_memory_size(head.len)
+            || head.load_factor != MaxLoadFactor
+            || head.size > load_for(head.len))
+        {
+            throw std::runtime_error("hackmap::unordered_map bad snapshot");
+        }
+
+        block_type* block = allocate_blocks(head.len);
+        read_snapshot_table(is, block, head);
+
+        destroy_values();
+        deallocate_blocks(mBlock, mLen);
+        mBlock = block;
+        mSize = head.size;
+        mLen = head.len;
+        mMask = head.len - 1;
+        update_load(mLen);
+
+        if (head.fingerprint != snapshot_fingerprint())
+        {
+            resize_to(mLen, true, resize_reason::rehash);
+        }
+    }
+
+    /**
+     * @brief Replace the contents with a save(os, write_value) snapshot:
+     *        reserve once, then read_value(is) size() times into a buffer
+     *        of up to 64K values, bulk_insert()ing each one.
+     * @throw std::runtime_error on a bad stream or header (the map is
+     *        then left empty).
+     */
+    template <typename ReadValue>
+    void
+    load(std::istream& is, ReadValue read_value)
+    {
+        static constexpr uint64_t CHUNK = 1 << 16;
+        snapshot_header head = read_snapshot_head(is, false);
+        clear();
+        reserve(head.size);
+        std::vector<value_type> buffer;
+        buffer.reserve(head.size < CHUNK ? head.size : CHUNK);
+        for (uint64_t i = 0; i < head.size; ++i)
+        {
+            buffer.emplace_back(read_value(is));
+            if (!is)
+            {
+                clear();
+                throw std::runtime_error(
+                    "hackmap::unordered_map snapshot read");
+            }
+            if (buffer.size() == CHUNK || i + 1 == head.size)
+            {
+                bulk_insert(buffer.cbegin(), buffer.cend());
+                buffer.clear();
+            }
+        }
+    }
+
+    /**
+     * @brief Copy the entries into a read-only perfect_map, where every
+     *        lookup reads one slot and compares one key.
+     * @throw std::runtime_error if two keys hash alike in all 64 bits.
+     */
+    hackmap::perfect_map<key_type, mapped_type, hasher, key_equal>
+    freeze()
+    const
+    {
+        return hackmap::perfect_map<key_type, mapped_type, hasher, key_equal>(
+            cbegin(), cend(), hash_function(), key_eq());
+    }
+
+    size_type
+    max_bucket_count()
+    const noexcept
+    {
+        return max_size();
+    }
+
+    float
+    max_load_factor()
+    const
+    {
+        return static_cast<float>(MaxLoadFactor) / 100.0F;
+    }
+
+    size_type
+    max_size()
+    const noexcept
+    {
+        return MAX_SIZE;
+    }
+
+    unordered_map&
+    operator=(const unordered_map& o)
+    {
+        if (this == &o)
+        {
+            return *this;
+        }
+
+        if (mLen != o.mLen)
+        {
+            reset();
+            reserve(o.mSize);
+        }
+        else
+        {
+            clear();
+        }
+
+        hasher::operator=(static_cast<const hasher&>(o));
+        key_equal::operator=(static_cast<const key_equal&>(o));
+        allocator_type::operator=(static_cast<const allocator_type&>(o));
+
+        insert(o.cbegin(), o.cend());
+
+        return *this;
+    }
+
+    unordered_map&
+    operator=(unordered_map&& o)
+    noexcept
+    {
+        if (this == &o)
+        {
+            return *this;
+        }
+
+        if (o.mSize)
+        {
+            deallocate_blocks(mBlock, mLen);
+            mBlock = std::move(o.mBlock);
+            mSize = std::move(o.mSize);
+            mLoad = std::move(o.mLoad);
+            mLen = std::move(o.mLen);
+            mMask = std::move(o.mMask);
+            o.set_moved_from();
+        }
+        else
+        {
+            clear();
+            o.reset();
+        }
+
+        hasher::operator=(static_cast<const hasher&>(o));
+        key_equal::operator=(static_cast<const key_equal&>(o));
+        allocator_type::operator=(static_cast<const allocator_type&>(o));
+        guard_type::operator=(static_cast<const guard_type&>(o));
+        hook_type::operator=(static_cast<const hook_type&>(o));
+
+        return *this;
+    }
+
+    unordered_map&
+    operator=(std::initializer_list<value_type> il)
+    {
+        clear();
+        insert(il.begin(), il.end());
+        return *this;
+    }
+
+    template <typename OtherMap>
+    bool
+    operator==(const OtherMap& o)
+    const
+    {
+        if (size() != o.size())
+        {
+            return false;
+        }
+
+        iterator start{ mBlock, 0, mLen, IteratorLeap{} };
+        const_iterator stop = cend();
+
+        while (start != stop)
+        {
+            if (0 == o.count((*start).first))
+            {
+                return false;
+            }
+            ++start;
+        }
+        
+        return true;
+    }
+
+    template <typename OtherMap>
+    bool
+    operator!=(const OtherMap& o)
+    const
+    {
+        return !operator==(o);
+    }
+
+    mapped_type&
+    operator[](const key_type& k)
+    {
+        return try_emplace(k).first->second;
+    }
+
+    mapped_type&
+    operator[](key_type&& k)
+    {
+        return try_emplace(std::move(k)).first->second;
+    }
+
+    void
+    rehash(size_type n)
+    {
+        if (mSize <= n && n < mLen)
+        {
+            resize_to(n, false, resize_reason::rehash);
+        }
+    }
+
+    void
+    reset()
+    noexcept
+    {
+        destroy_values();
+        deallocate_blocks(mBlock, mLen);
+        set_moved_from();
+    }
+
+    void
+    reserve(size_type count)
+    {
+        if (mLoad < count)
+        {
+            size_type lenFor = len_by_force_load(count);
+            resize_to(lenFor, false, resize_reason::reserve);
+        }
+    }
+
+    size_type
+    size()
+    const noexcept
+    {
+        return mSize;
+    }
+
+    void
+    swap(unordered_map& o)
+    {
+        if (this == &o)
+        {
+            return;
+        }
+
+        using std::swap;
+        swap(static_cast<hasher&>(*this), static_cast<hasher&>(o));
+        swap(static_cast<key_equal&>(*this), static_cast<key_equal&>(o));
+        std::swap(static_cast<guard_type&>(*this), static_cast<guard_type&>(o));
+        std::swap(static_cast<hook_type&>(*this), static_cast<hook_type&>(o));
+        std::swap(mBlock, o.mBlock);
+        std::swap(mSize, o.mSize);
+        std::swap(mLen, o.mLen);
+        std::swap(mLoad, o.mLoad);
+        std::swap(mMask, o.mMask);
+    }
+
+#ifdef DEBUG
+    bool
+    invariant_head(std::ostream* os,
+                   size_type& size_lists,
+                   block_type* block,
+                   size_type ihead)
+    const noexcept
+    {
+        size_type index = ihead;
+
+        bool notrust = false;
+        hash_type prevfrag = 0;
+        size_type i = 0;
+        for (; i < mLen; ++i)
+        {
+            ++size_lists;
+            if (index != ihead)
+            {
+                if (block->is_head(index))
+                {
+                    if (nullptr != os)
+                    {
+                        (*os) << "Link leaped to is flagged as head: "
+                              << index << std::endl;
+                    }
+                    return false;
+                }
+            }
+            else
+            {
+                if (block->is_link(index))
+                {
+                    if (nullptr != os)
+                    {
+                        (*os) << "Head index is flagged as link: "
+                              << index << std::endl;
+                    }
+                    return false;
+                }
+            }
+
+            size_type hash = hash_key(block->get_value(index).first);
+            hash_type frag = hash_fragment(hash);
+            if (index != ihead)
+            {
+                frag = block_type::set_link_hash(frag);
+            }
+            hash_type myfrag = block->get_hash(index);
+            if (notrust)
+            {
+                frag = block_type::set_link_hash(prevfrag);
+            }
+            if (myfrag != frag)
+            {
+                if (nullptr != os)
+                {
+                    (*os) << "Incorrect hash at [" << index
+                          << "] expecting [" << unsigned(frag)
+                          << "] found [" << unsigned(myfrag)
+                          << "]" << std::endl;
+                }
+                return false;
+            }
+
+            size_type myhead = hash_to_index(hash);
+            if (myhead != ihead)
+            {
+                if (nullptr != os)
+                {
+                    (*os) << "Link leaped to [" << index
+                          << "] not part of list at [" << ihead
+                          << "] head index reported as [" << myhead
+                          << "]" << std::endl;
+                }
+                return false;
+            }
+
+            if (block->is_end(index))
+            {
+                break;
+            }
+
+            prevfrag = frag;
+            index = leap(ihead, index, notrust);
+            block = get_block(index);
+        }
+
+        if (i == mLen)
+        {
+            if (nullptr != os)
+            {
+                (*os) << "Too many leaps starting at: "
+                      << ihead << std::endl;
+            }
+            return false;
+        }
+
+        return true;
+    }
+
+    bool
+    invariant()
+    const noexcept
+    {
+        return invariant(nullptr);
+    }
+
+    bool
+    invariant(std::ostream* os)
+    const noexcept
+    {
+        if (reinterpret_cast<block_type*>(&NULL_BLOCK<policy_type>) == mBlock)
+        {
+            if (mSize != 0 || mLen != 0 || mLoad != 0 || mMask != 0)
+            {
+                if (nullptr != os)
+                {
+                    (*os) << "Invalid size/len/load/mask: "
+                          << mSize << '/'
+                          << mLen << '/'
+                          << mLoad << '/'
+                          << mMask << std::endl;
+                }
+                return false;
+            }
+            return true;
+        }
+
+        size_type size_count = 0;
+        size_type size_lists = 0;
+
+        size_type index = 0;
+        while (index < mLen)
+        {
+            auto block = get_block(index);
+            for (int sub = 0; sub < BLOCK_LEN; ++sub)
+            {
+                if (block->is_empty_by_subindex(sub))
+                {
+                    continue;
+                }
+
+                if (block->is_special_by_subindex(sub))
+                {
+                    if (nullptr != os)
+                    {
+                        (*os) << "Special hash value at: "
+                              << combine_index(index, sub) << std::endl;
+                    }
+                    return false;
+                }
+
+                if (block->is_head_by_subindex(sub))
+                {
+                    bool pass = invariant_head(os, size_lists, block,
+                                               combine_index(index, sub));
+                    if (!pass)
+                    {
+                        if (nullptr != os)
+                        {
+                            (*os) << "Invalid linked list at: "
+                                  << combine_index(index, sub) << std::endl;
+                        }
+                        return false;
+                    }
+                }
+
+                ++size_count;
+            }
+            index += BLOCK_LEN;
+        }
+
+        if (size_count != size())
+        {
+            if (nullptr != os)
+            {
+                (*os) << "Invalid size by counting full entries" << std::endl;
+            }
+            return false;
+        }
+
+        if (size_lists != size())
+        {
+            if (nullptr != os)
+            {
+                (*os) << "Invalid size by counting lists" << std::endl;
+            }
+            return false;
+        }
+
+        if (policy_type::free_summary)
+        {
+            const uint64_t* words = get_summary(mBlock, mLen);
+            for (index = 0; index < mLen; index += BLOCK_LEN)
+            {
+                size_type iblock = index / BLOCK_LEN;
+                bool flagged = (words[iblock / 64] >> (iblock % 64)) & 1;
+                if (flagged != get_block(index)->find_empty().has())
+                {
+                    if (nullptr != os)
+                    {
+                        (*os) << "Invalid free summary at block: "
+                              << iblock << std::endl;
+                    }
+                    return false;
+                }
+            }
+        }
+
+        if (policy_type::full_summary)
+        {
+            const uint64_t* words = get_full_summary(mBlock, mLen);
+            const uint64_t* tops = words + summary_words(mLen);
+            for (index = 0; index < mLen; index += BLOCK_LEN)
+            {
+                size_type iblock = index / BLOCK_LEN;
+                size_type iword = iblock / 64;
+                bool flagged = (words[iword] >> (iblock % 64)) & 1;
+                bool topflagged = (tops[iword / 64] >> (iword % 64)) & 1;
+                if (flagged != get_block(index)->find_full().has()
+                    || topflagged != (0 != words[iword]))
+                {
+                    if (nullptr != os)
+                    {
+                        (*os) << "Invalid full summary at block: "
+                              << iblock << std::endl;
+                    }
+                    return false;
+                }
+            }
+        }
+
+        if (policy_type::miss_filter)
+        {
+            std::vector<uint64_t> words(mLen / BLOCK_LEN, 0);
+            for (auto it = cbegin(); it != cend(); ++it)
+            {
+                size_type hash = hash_key(it->first);
+                words[hash_to_index(hash) / BLOCK_LEN] |= filter_bits(hash);
+            }
+            // Erases leave stale bits, so a word need only cover its keys.
+            const uint64_t* filter = get_filter(mBlock, mLen);
+            for (size_type iblock = 0; iblock < words.size(); ++iblock)
+            {
+                if (words[iblock] & ~filter[iblock])
+                {
+                    if (nullptr != os)
+                    {
+                        (*os) << "Invalid miss filter at block: "
+                              << iblock << std::endl;
+                    }
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+#endif
+
+#ifdef DEBUG
+    void
+    print_block(std::ostream& os, size_type index)
+    const
+    {
+        os << "BLOCK: " << (index / BLOCK_LEN) << std::endl;
+
+        auto block = get_block(index);
+        for (int i = 0; i < BLOCK_LEN; ++i)
+        {
+            if (i == (BLOCK_LEN / 2))
+            {
+                os << std::endl;
+            }
+            else if (i)
+            {
+                os << " | ";
+            }
+
+            std::ios_base::fmtflags flags = os.flags();
+            hash_type hash = block->get_hash_by_subindex(i);
+            leap_type leap = block->get_leap_by_subindex(i);
+            os << "0x";
+            os << std::setfill('0') << std::setw(2 * sizeof(hash)) << std::hex
+               << std::uppercase
+               << unsigned(hash);
+            os.flags(flags);
+            os << " 0x";
+            os << std::setfill('0') << std::setw(2 * sizeof(leap)) << std::hex
+               << std::uppercase
+               << unsigned(leap);
+            os.flags(flags);
+            if (!block->is_empty_by_subindex(i))
+            {
+                auto ref = block->get_value_by_subindex(i);
+                os << ": ";
+                os << ref.first << ' ' << ref.second
+                   << " @[" << key_to_index(ref.first) << ']';
+            }
+        }
+        os << std::endl;
+    }
+
+    void
+    print()
+    const
+    {
+        print(std::cout);
+    }
+
+    void
+    print(std::ostream& os)
+    const
+    {
+        if (mSize)
+        {
+            os << "TABLE START" << std::endl;
+            size_type index = 0;
+            while (index < mLen)
+            {
+                print_block(os, index);
+                index = index + BLOCK_LEN;
+            }
+            os << "TABLE END" << std::endl;
+        }
+        else
+        {
+            os << "TABLE EMPTY" << std::endl;
+        }
+    }
+#endif
+
+    void
+    gather_stats_list(unordered_map_stats &stats, size_type ihead)
+    const noexcept
+    {
+        size_type iprev = ihead;
+        size_type index = ihead;
+        size_type list_index = 0;
+
+        bool notrust = false;
+        for (;;)
+        {
+            stats.link_distance(list_index);
+
+            if (list_index)
+            {
+                size_type leap_dist = ((index + mLen) - iprev) & mMask;
+                size_type home_dist = ((index + mLen) - ihead) & mMask;
+                stats.leap_distance(list_index, leap_dist);
+                stats.home_distance(list_index, home_dist);
+            }
+
+            auto block = get_block(index);
+
+            if (block->is_end(index))
+            {
+                stats.chain_length(list_index + 1);
+                break;
+            }
+
+            bool foreign = block->is_foreign(index);
+
+            iprev = index;
+            index = leap(ihead, index, notrust);
+            ++list_index;
+
+            if (foreign)
+            {
+                stats.find_leap(((index + mLen) - iprev) & mMask);
+            }
+        }
+    }
+
+    void
+    gather_stats(unordered_map_stats &stats)
+    const noexcept
+    {
+        if (mSize)
+        {
+            stats.start(mLen, mSize);
+            size_type used = 0;
+            for (size_type index = 0; index < mLen; ++index)
+            {
+                auto block = get_block(index);
+
+                if (block->is_empty(index))
+                {
+                    stats.is_next_empty(true);
+                }
+                else
+                {
+                    ++used;
+                    if (block->is_head(index))
+                    {
+                        stats.is_next_empty(false);
+                        gather_stats_list(stats, index);
+                    }
+                }
+
+                if ((index % detail::BLOCK_LEN) == (detail::BLOCK_LEN - 1)
+                    || index + 1 == mLen)
+                {
+                    stats.block_fill(used);
+                    used = 0;
+                }
+            }
+            stats.stop();
+        }
+    }
+
+    /**
+     * @brief Find the k longest chains and the k with the most extended
+     *        leap distance, with up to samples member keys of each.
+     * @param format Turns a key_type into a std::string for the sample.
+     */
+    template <typename Format>
+    unordered_map_hotspots
+    hotspots(size_type k, size_type samples, Format format)
+    const
+    {
+        unordered_map_hotspots spots;
+        if (!mSize || !k)
+        {
+            return spots;
+        }
+
+        auto longer = [](const unordered_map_hotspot& a,
+                         const unordered_map_hotspot& b)
+        {
+            return a.length != b.length ? a.length > b.length
+                                        : a.home < b.home;
+        };
+        auto costlier = [](const unordered_map_hotspot& a,
+                           const unordered_map_hotspot& b)
+        {
+            return a.extended_distance != b.extended_distance
+                ? a.extended_distance > b.extended_distance
+                : a.home < b.home;
+        };
+
+        // Keep the k worst as heaps with the least bad on top.
+        for (size_type index = 0; index < mLen; ++index)
+        {
+            auto block = get_block(index);
+            if (block->is_empty(index) || !block->is_head(index))
+            {
+                continue;
+            }
+
+            unordered_map_hotspot h;
+            hotspot_list(h, index, 0, format);
+            hotspot_keep(spots.by_length, h, k, longer);
+            if (h.find_leaps)
+            {
+                hotspot_keep(spots.by_extended, h, k, costlier);
+            }
+        }
+
+        std::sort_heap(spots.by_length.begin(), spots.by_length.end(), longer);
+        std::sort_heap(spots.by_extended.begin(), spots.by_extended.end(),
+                       costlier);
+
+        if (samples)
+        {
+            for (auto& h : spots.by_length)
+            {
+                hotspot_list(h, h.home, samples, format);
+            }
+            for (auto& h : spots.by_extended)
+            {
+                hotspot_list(h, h.home, samples, format);
+            }
+        }
+
+        return spots;
+    }
+
+    /** @brief hotspots() without key samples. */
+    unordered_map_hotspots
+    hotspots(size_type k)
+    const
+    {
+        return hotspots(k, 0, [](const key_type&) { return std::string(); });
+    }
+
+private:
+    /** @brief Measure the chain headed at ihead into h, sampling keys. */
+    template <typename Format>
+    void
+    hotspot_list(unordered_map_hotspot& h, size_type ihead,
+                 size_type samples, Format& format)
+    const
+    {
+        h = unordered_map_hotspot{};
+        h.home = ihead;
+
+        size_type index = ihead;
+        bool notrust = false;
+        for (;;)
+        {
+            auto block = get_block(index);
+            ++h.length;
+            if (h.keys.size() < samples)
+            {
+                h.keys.push_back(format(block->get_value(index).first));
+            }
+
+            if (block->is_end(index))
+            {
+                break;
+            }
+
+            bool foreign = block->is_foreign(index);
+            size_type iprev = index;
+            index = leap(ihead, index, notrust);
+
+            if (foreign)
+            {
+                ++h.find_leaps;
+                h.extended_distance += ((index + mLen) - iprev) & mMask;
+            }
+        }
+    }
+
+    /** @brief Add h to the k worst (by worse) kept as a heap. */
+    template <typename Worse>
+    static void
+    hotspot_keep(std::vector<unordered_map_hotspot>& heap,
+                 const unordered_map_hotspot& h, size_type k, Worse worse)
+    {
+        if (heap.size() < k)
+        {
+            heap.push_back(h);
+            std::push_heap(heap.begin(), heap.end(), worse);
+        }
+        else if (worse(h, heap.front()))
+        {
+            std::pop_heap(heap.begin(), heap.end(), worse);
+            heap.back() = h;
+            std::push_heap(heap.begin(), heap.end(), worse);
+        }
+    }
+
+    template <typename FindKey>
+    size_type
+    find_index(const FindKey& k)
+    const
+    {
+        size_type hash = hash_key(k);
+        HACKMAP_SAMPLE(find, true, find_index_hashed(hash, k));
+        return find_index_hashed(hash, k);
+    }
+
+    template <typename FindKey>
+    size_type
+    find_index_hashed(size_type hash, const FindKey& k)
+    const
+    {
+        size_type ihead = hash_to_index(hash);
+        auto block = get_block(ihead);
+
+        if (block->is_empty_or_link(ihead))
+        {
+            HACKMAP_COUNT(misses, 1);
+            return mLen;
+        }
+
+        hash_type frag = hash_fragment(hash);
+
+        if (frag == block->get_hash(ihead))
+        {
+            if (compare_keys(block->get_value(ihead).first, k))
+            {
+                HACKMAP_COUNT(hits, 1);
+                return ihead;
+            }
+        }
+
+        if (block->is_end(ihead)
+            || (policy_type::miss_filter && !filter_test(ihead, hash)))
+        {
+            HACKMAP_COUNT(misses, 1);
+            return mLen;
+        }
+        
+        size_type index = ihead;
+        frag = block_type::set_link_hash(frag);
+        for (;;)
+        {
+            bool notrust = false;
+            index = leap(ihead, index, notrust);
+            block = get_block(index);
+
+            if (frag == block->get_hash(index) || notrust)
+            {
+                if (compare_keys(block->get_value(index).first, k))
+                {
+                    HACKMAP_COUNT(hits, 1);
+                    return index;
+                }
+            }
+
+            if (block->is_end(index))
+            {
+                HACKMAP_COUNT(misses, 1);
+                return mLen;
+            }
+        }
+
+        return mLen;
+    }
+
+    template <typename InputIterator>
+    void
+    bulk_insert(InputIterator first, InputIterator last,
+                std::input_iterator_tag UNUSED(tag))
+    {
+        insert(first, last);
+    }
+
+    template <typename ForwardIterator>
+    void
+    bulk_insert(ForwardIterator first, ForwardIterator last,
+                std::forward_iterator_tag UNUSED(tag))
+    {
+        size_type count = size_type(std::distance(first, last));
+        if (!count)
+        {
+            return;
+        }
+
+        reserve(mSize + count);
+
+        std::vector<size_type> hashes;
+        hashes.reserve(count);
+        for (ForwardIterator it = first; it != last; ++it)
+        {
+            hashes.push_back(hash_key((*it).first));
+        }
+
+        // One counting sort pass on the top (up to 12) bits of the
+        // home index, so each bucket spans a cache friendly region and
+        // the scatter writes stay in cache.
+        int bits = __builtin_ctzll(mLen);
+        int shift = bits > 12 ? bits - 12 : 0;
+        size_type nbuckets = mLen >> shift;
+        std::vector<size_type> offsets(nbuckets + 1, 0);
+        for (size_type h : hashes)
+        {
+            ++offsets[(hash_to_index(h) >> shift) + 1];
+        }
+        for (size_type i = 1; i <= nbuckets; ++i)
+        {
+            offsets[i] += offsets[i - 1];
+        }
+
+        std::vector<std::pair<size_type, ForwardIterator>> sorted(count);
+        size_type i = 0;
+        for (ForwardIterator it = first; it != last; ++it, ++i)
+        {
+            size_type h = hashes[i];
+            sorted[offsets[hash_to_index(h) >> shift]++] = { h, it };
+        }
+        std::vector<size_type>().swap(hashes);
+
+        // Pairs are read out of order, so fetch them ahead of time.
+        static constexpr size_type AHEAD = 8;
+        size_type reseeds = reseed_count();
+        for (i = 0; i < count; ++i)
+        {
+            if (i + AHEAD < count)
+            {
+                __builtin_prefetch(&*sorted[i + AHEAD].second);
+            }
+            auto& hit = sorted[i];
+            if (UNLIKELY(reseeds != reseed_count()))
+            {
+                hit.first = hash_key((*hit.second).first);
+            }
+            upsert_hashed<false, false, false>(hit.first,
+                                               (*hit.second).first,
+                                               (*hit.second).second);
+        }
+    }
+
+    void
+    unlink_head_of_list(size_type ihead)
+    {
+        bool noTrustFirst = false;
+        size_type iprev = ihead;
+        size_type itail = leap(ihead, iprev, noTrustFirst);
+        auto blocktail = get_block(itail);
+
+        bool noTrustFinal = noTrustFirst;
+        while (!blocktail->is_end(itail))
+        {
+            iprev = itail;
+            itail = leap(ihead, iprev, noTrustFinal);
+            blocktail = get_block(itail);
+        }
+
+        auto blockhead = get_block(ihead);
+        allocator_traits::construct(*this, blockhead->get_value_ptr(ihead),
+                                    std::move(blocktail->get_value(itail)));
+
+        block_type* blockprev;
+        if (LIKELY(iprev == ihead))
+        {
+            blockprev = blockhead;
+        }
+        else
+        {
+            blockprev = get_block(iprev);
+        }
+
+        hash_type frag;
+        if (UNLIKELY(noTrustFinal))
+        {
+            frag = hash_fragment(hash_key(blockhead->get_value(ihead).first));
+        }
+        else
+        {
+            frag = blocktail->get_hash_only(itail);
+        }
+
+        blockprev->set_end(iprev);
+        blocktail->set_empty(itail);
+        summary_empty(itail);
+
+        if (UNLIKELY(noTrustFirst && iprev != ihead))
+        {
+            cascade(ihead, ihead, block_type::set_link_hash(frag));
+        }
+
+        blockhead->set_hash(ihead, frag);
+    }
+
+    void
+    unlink_link_at(size_type index)
+    {
+        auto block = get_block(index);
+        size_type ihead = key_to_index(block->get_value(index).first);
+        size_type iprev = ihead;
+        bool notrust;
+        size_type inext = leap(ihead, iprev, notrust);
+
+        while (inext != index)
+        {
+            iprev = inext;
+            inext = leap(ihead, iprev, notrust);
+        }
+
+        unlink(ihead, iprev, index);
+    }
+
+    template <bool DoUpsert,
+              bool IsUnique,
+              bool IsListInsert,
+              typename UpsertKey,
+              typename... Args>
+    std::pair<iterator, bool>
+    upsert(UpsertKey&& k, Args&&... args)
+    {
+        size_type hash = hash_key(k);
+        HACKMAP_SAMPLE(insert, !IsUnique,
+            (upsert_hashed<DoUpsert, IsUnique, IsListInsert>(
+                hash, std::forward<UpsertKey>(k),
+                std::forward<Args>(args)...)));
+        return upsert_hashed<DoUpsert, IsUnique, IsListInsert>(
+            hash, std::forward<UpsertKey>(k), std::forward<Args>(args)...);
+    }
+
+    /** @brief Same as upsert, but with the key's hash already computed. */
+    template <bool DoUpsert,
+              bool IsUnique,
+              bool IsListInsert,
+              typename UpsertKey,
+              typename... Args>
+    std::pair<iterator, bool>
+    upsert_hashed(size_type hash, UpsertKey&& k, Args&&... args)
+    {
+        hash_type frag = hash_fragment(hash);
+
+        for (;;)
+        {
+            size_type ihead = hash_to_index(hash);
+            auto block = get_block(ihead);
+            size_type index = ihead;
+            size_type cost = 0;
+
+            if (IsListInsert || block->is_full(ihead))
+            {
+                if (!IsListInsert)
+                {
+                    if (UNLIKELY(needToGrow()))
+                    {
+                        grow();
+                        continue;
+                    }
+                }
+
+                if (IsListInsert || LIKELY(block->is_head(ihead)))
+                {
+                    do
+                    {
+                        if (!IsUnique && (frag == block->get_hash(index)))
+                        {
+                            if (LIKELY(compare_keys(
+                                            block->get_value(index).first, k)))
+                            {
+                                if (DoUpsert)
+                                {
+                                    allocator_traits::destroy(*this,
+                                        block->get_value_ptr(index));
+                                    construct_value(
+                                        block->get_value_ptr(index),
+                                        std::forward<UpsertKey>(k),
+                                        std::forward<Args>(args)...);
+                                }
+
+                                return std::make_pair<iterator, bool>(
+                                    {mBlock, index, mLen}, false);
+                            }
+                        }
+
+                        frag = block_type::set_link_hash(frag);
+
+                        if (block->is_end(index))
+                        {
+                            break;
+                        }
+
+                        for (;;)
+                        {
+                            bool notrust = false;
+                            index = leap(ihead, index, notrust);
+                            block = get_block(index);
+
+                            if (policy_type::hash_guard)
+                            {
+                                cost += notrust ? BLOCK_LEN : 1;
+                            }
+
+                            if (!IsUnique
+                                && (frag == block->get_hash(index)
+                                    || notrust))
+                            {
+                                if (LIKELY(compare_keys(
+                                                block->get_value(index).first,
+                                                k)))
+                                {
+                                    if (DoUpsert)
+                                    {
+                                        allocator_traits::destroy(*this,
+                                            block->get_value_ptr(index));
+                                        construct_value(
+                                            block->get_value_ptr(index),
+                                            std::forward<UpsertKey>(k),
+                                            std::forward<Args>(args)...);
+                                    }
+
+                                    return std::make_pair<iterator, bool>(
+                                        {mBlock, index, mLen}, false);
+                                }
+                            }
+
+                            if (block->is_end(index))
+                            {
+                                break;
+                            }
+                        }
+                    }
+                    while (false);
+
+                    if (policy_type::hash_guard && !IsUnique
+                        && cost <= guard_cost())
+                    {
+                        guard_type::guard_pass();
+                    }
+                    else if (policy_type::hash_guard && !IsUnique
+                             && guard_type::guard_strike(mSize))
+                    {
+                        reseed();
+                        hash = hash_key(k);
+                        frag = hash_fragment(hash);
+                        continue;
+                    }
+
+                    index = link_empty(ihead, index, frag);
+                    block = get_block(index);
+                }
+                //if (!IsListInsert && UNLIKELY(block->is_link(ihead)))
+                else
+                {
+                    unlink_link_at(ihead);
+                    block->set_nofind(ihead);
+                    --mSize;
+                    upsert<true, true, true>(
+                        std::move(block->get_value(ihead)));
+                    block->set_end(ihead);
+                }
+            }
+            else
+            {
+                block->set_end(index);
+            }
+
+            block->set_hash(index, frag);
+            summary_fill(index);
+            construct_value(block->get_value_ptr(index),
+                            std::forward<UpsertKey>(k),
+                            std::forward<Args>(args)...);
+            filter_add(ihead, hash);
+            ++mSize;
+            return std::make_pair<iterator, bool>({mBlock, index, mLen}, true);
+        }
+    }
+
+    template <typename... Args>
+    void
+    construct_value(value_type* p, Args&&... args)
+    {
+        allocator_traits::construct(*this, p, std::forward<Args>(args)...);
+    }
+
+    /** @brief Build the mapped_type from a factory now it is needed. */
+    template <typename UpsertKey, typename Factory>
+    void
+    construct_value(value_type* p, UpsertKey&& k, MappedFactory<Factory>&& m)
+    {
+        allocator_traits::construct(*this, p, std::forward<UpsertKey>(k),
+                                    m.factory());
+    }
+
+    /** @return What fn(value) asked for; keep if fn returns nothing. */
+    template <typename Fn>
+    static compute_action
+    call_update(Fn& fn, iterator it)
+    {
+        return call_update(fn, it->second,
+                           std::is_void<decltype(fn(it->second))>{});
+    }
+
+    template <typename Fn>
+    static compute_action
+    call_update(Fn& fn, mapped_type& value, std::true_type)
+    {
+        fn(value);
+        return compute_action::keep;
+    }
+
+    template <typename Fn>
+    static compute_action
+    call_update(Fn& fn, mapped_type& value, std::false_type)
+    {
+        return fn(value);
+    }
+
+    /**
+     * @brief Erase the entry at index without comparing keys; the walk
+     *        from its head only follows leaps to find the entry before it.
+     */
+    void
+    erase_at(size_type index)
+    {
+        auto block = get_block(index);
+        size_type ihead = key_to_index(block->get_value(index).first);
+
+        if (index == ihead)
+        {
+            allocator_traits::destroy(*this, block->get_value_ptr(ihead));
+            if (LIKELY(block->is_end(ihead)))
+            {
+                block->set_empty(ihead);
+                summary_empty(ihead);
+            }
+            else
+            {
+                unlink_head_of_list(ihead);
+            }
+        }
+        else
+        {
+            size_type iprev = ihead;
+            bool notrust;
+            size_type inext = leap(ihead, iprev, notrust);
+            while (inext != index)
+            {
+                iprev = inext;
+                inext = leap(ihead, iprev, notrust);
+            }
+
+            unlink(ihead, iprev, index);
+            block->set_empty(index);
+            summary_empty(index);
+            allocator_traits::destroy(*this, block->get_value_ptr(index));
+        }
+        --mSize;
+    }
+
+    /** @brief Build the mapped_type from its arguments now it is needed. */
+    template <typename UpsertKey, typename... Args>
+    void
+    construct_value(value_type* p, UpsertKey&& k, MappedArgs<Args...>&& m)
+    {
+        allocator_traits::construct(*this, p, std::piecewise_construct,
+            std::forward_as_tuple(std::forward<UpsertKey>(k)),
+            std::move(m.args));
+    }
+
+    size_type
+    find_empty(size_type isearch)
+    const noexcept
+    {
+        auto block = get_block(isearch);
+
+#if 0
+        // No apparent speedup.
+        if (UNLIKELY(block->is_empty(isearch)))
+        {
+            return isearch;
+        }
+#endif
+
+        int isub;
+
+        // Using SSE has been fastest so far.
+        // Loop or switch statement appear to be significantly slower.
+        search_map map = block->find_empty(isearch);
+        HACKMAP_COUNT(empty_blocks, 1);
+#if 1
+        // Possible minor speedup, no apparent loss of speed.
+        // Statistics support this being likely.
+        if (LIKELY(map.has()))
+#else
+        if (map.has())
+#endif
+        {
+            isub = map.next();
+            return combine_index(isearch, isub);
+        }
+
+        if (policy_type::free_summary)
+        {
+            return find_empty_by_summary(isearch);
+        }
+
+        for (;;)
+        {
+            isearch = (isearch + BLOCK_LEN) & mMask;
+            block = get_block(isearch);
+            map = block->find_empty();
+            HACKMAP_COUNT(empty_blocks, 1);
+            if (map.has())
+            {
+                isub = map.next();
+                return combine_index(isearch, isub);
+            }
+        }
+    }
+
+    /**
+     * @return Index of an empty entry in the first block after isearch's
+     *         block flagged in the free summary.
+     */
+    size_type
+    find_empty_by_summary(size_type isearch)
+    const noexcept
+    {
+        const uint64_t* words = get_summary(mBlock, mLen);
+        size_type nwords = summary_words(mLen);
+        size_type iblock = ((isearch / BLOCK_LEN) + 1) & (mMask / BLOCK_LEN);
+        size_type iword = iblock / 64;
+        uint64_t bits = words[iword] & (~uint64_t(0) << (iblock % 64));
+
+        while (!bits)
+        {
+            iword = (iword + 1 == nwords) ? 0 : iword + 1;
+            bits = words[iword];
+        }
+
+        size_type index = (iword * 64 + __builtin_ctzll(bits)) * BLOCK_LEN;
+        HACKMAP_COUNT(empty_blocks, 1);
+        return combine_index(index, get_block(index)->find_empty().next());
+    }
+
+    /**
+     * @return First block at or after iblock with a full entry,
+     *         or the number of blocks if there is none.
+     */
+    static size_type
+    next_full_block(block_type* b, size_type len, size_type iblock)
+    noexcept
+    {
+        size_type nblocks = len / BLOCK_LEN;
+        if (iblock >= nblocks)
+        {
+            return nblocks;
+        }
+
+        const uint64_t* words = get_full_summary(b, len);
+        size_type iword = iblock / 64;
+        uint64_t bits = words[iword] & (~uint64_t(0) << (iblock % 64));
+        if (bits)
+        {
+            return iword * 64 + __builtin_ctzll(bits);
+        }
+
+        // Find the next non-zero word using the second level.
+        const uint64_t* tops = words + summary_words(len);
+        size_type ntops = summary_top_words(len);
+        size_type inext = iword + 1;
+        size_type itop = inext / 64;
+        if (itop >= ntops)
+        {
+            return nblocks;
+        }
+        uint64_t topbits = tops[itop] & (~uint64_t(0) << (inext % 64));
+        while (!topbits)
+        {
+            if (++itop == ntops)
+            {
+                return nblocks;
+            }
+            topbits = tops[itop];
+        }
+
+        iword = itop * 64 + __builtin_ctzll(topbits);
+        return iword * 64 + __builtin_ctzll(words[iword]);
+    }
+
+    /** @brief Update the summaries after filling the entry at index. */
+    void
+    summary_fill(size_type index)
+    noexcept
+    {
+        size_type iblock = index / BLOCK_LEN;
+
+        if (policy_type::free_summary)
+        {
+            if (!get_block(index)->find_empty().has())
+            {
+                get_summary(mBlock, mLen)[iblock / 64] &=
+                    ~(uint64_t(1) << (iblock % 64));
+            }
+        }
+
+        if (policy_type::full_summary)
+        {
+            uint64_t* words = get_full_summary(mBlock, mLen);
+            uint64_t* tops = words + summary_words(mLen);
+            size_type iword = iblock / 64;
+            words[iword] |= uint64_t(1) << (iblock % 64);
+            tops[iword / 64] |= uint64_t(1) << (iword % 64);
+        }
+    }
+
+    /** @brief Update the summaries after emptying the entry at index. */
+    void
+    summary_empty(size_type index)
+    noexcept
+    {
+        size_type iblock = index / BLOCK_LEN;
+
+        if (policy_type::free_summary)
+        {
+            get_summary(mBlock, mLen)[iblock / 64] |=
+                uint64_t(1) << (iblock % 64);
+        }
+
+        if (policy_type::full_summary)
+        {
+            if (!get_block(index)->find_full().has())
+            {
+                uint64_t* words = get_full_summary(mBlock, mLen);
+                size_type iword = iblock / 64;
+                words[iword] &= ~(uint64_t(1) << (iblock % 64));
+                if (!words[iword])
+                {
+                    uint64_t* tops = words + summary_words(mLen);
+                    tops[iword / 64] &= ~(uint64_t(1) << (iword % 64));
+                }
+            }
+        }
+    }
+
+    /** @return The miss filter bits of hash, from all of its bits. */
+    static uint64_t
+    filter_bits(size_type hash)
+    noexcept
+    {
+        uint64_t mixed = uint64_t(hash) * 0x9E3779B97F4A7C15ULL;
+        return (uint64_t(1) << (mixed >> 58))
+               | (uint64_t(1) << ((mixed >> 52) & 63));
+    }
+
+    /** @return False if no key of hash has a list starting at ihead. */
+    bool
+    filter_test(size_type ihead, size_type hash)
+    const noexcept
+    {
+        uint64_t bits = filter_bits(hash);
+        return bits == (get_filter(mBlock, mLen)[ihead / BLOCK_LEN] & bits);
+    }
+
+    /**
+     * @brief Set hash's bits in ihead's block word, and rebuild the word
+     *        once it passes FILTER_FILL bits.
+     *
+     * Erases leave their bits behind, so under churn a word fills with
+     * stale bits; rebuilding only when one is too full spreads its cost
+     * over many inserts rather than paying it on every erase.
+     */
+    void
+    filter_add(size_type ihead, size_type hash)
+    {
+        if (policy_type::miss_filter)
+        {
+            uint64_t& word = get_filter(mBlock, mLen)[ihead / BLOCK_LEN];
+            uint64_t bits = filter_bits(hash);
+            if (bits != (word & bits))
+            {
+                word |= bits;
+                if (UNLIKELY(__builtin_popcountll(word) > FILTER_FILL))
+                {
+                    filter_rebuild(ihead);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Rebuild the miss filter word of ihead's block from the keys
+     *        of the lists headed in it.
+     */
+    void
+    filter_rebuild(size_type ihead)
+    {
+        size_type first = ihead - ihead % BLOCK_LEN;
+        auto block = get_block(first);
+        uint64_t bits = 0;
+        for (size_type i = first; i < first + BLOCK_LEN; ++i)
+        {
+            if (block->is_empty_or_link(i))
+            {
+                continue;
+            }
+            size_type index = i;
+            for (;;)
+            {
+                auto b = get_block(index);
+                bits |= filter_bits(hash_key(b->get_value(index).first));
+                if (b->is_end(index))
+                {
+                    break;
+                }
+                bool notrust;
+                index = leap(i, index, notrust);
+            }
+        }
+        get_filter(mBlock, mLen)[first / BLOCK_LEN] = bits;
+    }
+
+    size_type
+    link_empty(size_type ihead, size_type itail, hash_type& frag)
+    noexcept
+    {
+        //size_type iempty = find_empty((itail + 1) & mMask);
+        size_type iempty = find_empty((ihead + 1) & mMask);
+        size_type emptyPos = ((iempty + mLen) - ihead) & mMask;
+        size_type nextPos = ((itail + mLen) - ihead) & mMask;
+
+        if (LIKELY(emptyPos > nextPos))
+        {
+            link(itail, iempty, frag);
+            get_block(iempty)->set_end(iempty);
+        }
+        else
+        {
+            // Location of empty between head and tail.
+            size_type iprev = ihead;
+            bool scrap;
+            size_type inext = leap(ihead, ihead, scrap);
+
+            for (;;)
+            {
+                nextPos = ((inext + mLen) - ihead) & mMask;
+                if (emptyPos < nextPos)
+                {
+                    // Found the indices the empty lies between.
+                    break;
+                }
+                iprev = inext;
+                inext = leap(ihead, inext, scrap);
+            }
+
+            auto empty = get_block(iempty);
+            auto next = get_block(inext);
+
+            // Link previous to empty slot.
+            link(iprev, iempty, frag);
+            // Set the empty slot.
+            empty->set_hash(iempty, frag);
+            // Generate hash of next and link empty to next.
+            size_type hash = hash_key(next->get_value(inext).first);
+            hash_type subhashnext = hash_fragment(hash);
+            subhashnext = block_type::set_link_hash(subhashnext);
+            link(iempty, inext, subhashnext);
+            // Check if we need to cascade hashes.
+            if (UNLIKELY(!next->is_local(inext)))
+            {
+                bool scrap;
+                size_type inextnext = leap(ihead, inext, scrap);
+                cascade(ihead, inextnext, subhashnext);
+            }
+            // Set possibly new subhash.
+            next->set_hash(inext, subhashnext);
+        }
+        
+        return iempty;
+    }
+
+    void
+    link(size_type iprev, size_type inext, hash_type& shash)
+    {
+        // We convert dist to leap_type value at end.
+        size_type dist = index_dist(iprev, inext);
+        auto block = get_block(iprev);
+
+        if (LIKELY(block_type::can_leap(dist)))
+        {
+            block->set_leap(iprev, dist);
+        }
+        else
+        {
+            shash = block->get_hash_as_link(iprev);
+            block->set_find(iprev);
+        }
+    }
+
+    NOINLINE
+    void
+    unlink_complex(size_type ihead, size_type iprev, size_type iunlink)
+    {
+        auto un = get_block(iunlink);
+        auto prev = get_block(iprev);
+
+        // If the new leap stays local then we have an efficient solution.
+        if (LIKELY(prev->is_local(iprev) && un->is_local(iunlink)))
+        {
+            // Calculate the distance from prev to next.
+            size_type dist = (size_type)(prev->get_leap(iprev))
+                           + (size_type)(un->get_leap(iunlink));
+            if (LIKELY(block_type::can_leap(dist)))
+            {
+                prev->set_leap(iprev, leap_type(dist));
+                return;
+            }
+        }
+
+        bool scrap;
+        size_type inext = leap(ihead, iunlink, scrap);
+
+        // Propagate the subhash.
+        hash_type subhashprev = prev->get_hash_as_link(iprev);
+        cascade(ihead, inext, subhashprev);
+
+        // Good, we can just replace the previous leap.
+        prev->set_find(iprev);
+    }
+
+    INLINE
+    void
+    unlink(size_type ihead, size_type iprev, size_type iunlink)
+    {
+        // Remove entry from linked list.
+        auto un = get_block(iunlink);
+        auto prev = get_block(iprev);
+
+        if (un->is_end(iunlink))
+        {
+            prev->set_end(iprev);
+        }
+        else
+        {
+            unlink_complex(ihead, iprev, iunlink);
+        }
+    }
+
+    NOINLINE
+    void
+    cascade(size_type ihead, size_type inext, hash_type newsubhash)
+    {
+        auto block = get_block(inext);
+        HACKMAP_COUNT(cascades, 1);
+
+        for (;;)
+        {
+
+            if (block->is_local(inext))
+            {
+                // If we are at the end or next entry isn't search, we're done.
+                break;
+            }
+            
+            // Perform the search BEFORE we change the search hash.
+            size_type ifrom = (inext + block->get_leap(inext)) & mMask;
+            size_type inextnext = extended_leap(ihead, ifrom,
+                                                block->get_hash_as_link(inext));
+
+            // We can change the next's subhash.
+            block->set_hash(inext, newsubhash);
+
+            // Advance the slot pointer.
+            inext = inextnext;
+            block = get_block(inext);
+        }
+
+        // We can change the next's subhash.
+        block->set_hash(inext, newsubhash);
+    }
+
+    /** @return Length whose load (rounded down) holds minLoad elements. */
+    size_type
+    len_by_force_load(size_type minLoad)
+    const noexcept
+    {
+        return (minLoad * 100 + MaxLoadFactor - 1) / MaxLoadFactor;
+    }
+
+    /** @return Entries a table of len holds before it grows. */
+    static size_type
+    load_for(size_type len)
+    noexcept
+    {
+        size_type load = size_type(((double)MaxLoadFactor / 100.0)
+                                   * (double)len);
+        if (load > len)
+        {
+            load = len;
+        }
+        else if (load < (len / 2))
+        {
+            load = (len / 2);
+        }
+        return load;
+    }
+
+    void
+    update_load(size_type len)
+    {
+        mLoad = load_for(len);
+    }
+
+    size_type
+    hash_key(const value_type& kv)
+    const
+    {
+        return hash_key(kv.first);
+    }
+
+    template <typename HashKey>
+    size_type
+    hash_key(const HashKey& k)
+    const
+    {
+        return hash_key(k, std::integral_constant<bool,
+                                                  policy_type::hash_guard>{});
+    }
+
+    template <typename HashKey>
+    size_type
+    hash_key(const HashKey& k, std::false_type UNUSED(guard))
+    const
+    {
+        return hasher::operator()(k);
+        //return static_cast<const hasher&>(*this)(k);
+    }
+
+    /** @brief Once reseeded, a guarded map hashes with the seeded family. */
+    template <typename HashKey>
+    size_type
+    hash_key(const HashKey& k, std::true_type UNUSED(guard))
+    const
+    {
+        uint64_t seed = guard_type::get_guard_seed();
+        if (UNLIKELY(seed))
+        {
+            return hackmap::hash<key_type>{}(k, seed);
+        }
+        return hasher::operator()(k);
+    }
+
+    template <typename LeftKey>
+    bool
+    compare_keys(const LeftKey& l, const value_type& r)
+    const noexcept
+    {
+        return compare_keys(l, r.first);
+    }
+
+    template <typename LeftKey, typename RightKey>
+    bool
+    compare_keys(const LeftKey& l, const RightKey& r)
+    const noexcept
+    {
+        bool equal = key_equal::operator()(l, r);
+        //bool equal = static_cast<key_equal&>(*this)(l, r);
+        HACKMAP_COUNT(compares, 1);
+        HACKMAP_COUNT(false_positives, !equal);
+        return equal;
+    }
+
+    size_type
+    hash_to_index(size_type hash)
+    const noexcept
+    {
+        return hash & mMask;
+    }
+
+    template <typename IndexKey>
+    size_type
+    key_to_index(IndexKey&& k)
+    const noexcept
+    {
+        return hash_to_index(hash_key(k));
+    }
+
+    size_type
+    index_dist(size_type istart, size_type iend)
+    {
+        return ((iend + mLen) - istart) & mMask;
+    }
+
+    block_type*
+    get_block(size_type index)
+    const noexcept
+    {
+        return block_type::get(mBlock, index);
+    }
+
+    size_type
+    combine_index(size_type index, int isub)
+    const noexcept
+    {
+        return block_type::construct_index(index, isub);
+    }
+
+    hash_type
+    hash_fragment(size_type hash)
+    const noexcept
+    {
+        return hash >> ((sizeof(size_type)*8) - block_type::HASH_BITS);
+    }
+
+    INLINE
+    size_type
+    leap(size_type ihead, size_type ifrom, bool& notrust)
+    const noexcept
+    {
+        auto block = get_block(ifrom);
+        size_type index = (ifrom + block->get_leap(ifrom)) & mMask;
+        HACKMAP_COUNT(leaps, 1);
+        if (LIKELY(block->is_local(ifrom)))
+        {
+            notrust = false;
+            return index;
+        }
+        else
+        {
+            notrust = true;
+            return extended_leap(ihead, index, block->get_hash_as_link(ifrom));
+        }
+    }
+
+    /**
+     * @note Cannot compare subhash with "leap'd to" entry.
+     * @warn The reason this function works is because the maximum FIND
+     *       or leap value is >=16. This ensures that we start searching
+     *       outside the block of the leaped from entry and do not encounter
+     *       an infinite loop.
+     */
+    size_type
+    extended_leap(size_type ihead, size_type ifrom, hash_type findhash)
+    const noexcept
+    {
+        // Linear search through hashes.
+        // Use same subhash as leap entry for search efficiency.
+        findhash = block_type::set_link_hash(findhash);
+        HACKMAP_COUNT(extended_leaps, 1);
+
+        // Iterate through every slot in the table starting at the leap point.
+        for (;;)
+        {
+            auto block = get_block(ifrom);
+            search_map map = block->find(findhash);
+            HACKMAP_COUNT(extended_blocks, 1);
+            // For each entry in the map.
+            while (map.has())
+            {
+                // Discover the index that we're jumping to and test it
+                // to see if it is part of the same linked list.
+                int isub = map.next();
+                size_type iheadtest =
+                    key_to_index(block->get_value(isub).first);
+                if (ihead == iheadtest)
+                {
+                    return combine_index(ifrom, isub);
+                }
+                map.clear(isub);
+            }
+
+            ifrom = (ifrom + BLOCK_LEN) & mMask;
+        }
+    }
+
+    static constexpr size_type
+    guard_cost()
+    noexcept
+    {
+        return policy_type::hash_guard ? HashGuard<true>::GUARD_COST : 0;
+    }
+
+    /** @brief Switch to a freshly seeded hash and rehash every entry. */
+    NOINLINE
+    void
+    reseed()
+    {
+        guard_type::guard_reseed();
+        resize_to(mLen, true, resize_reason::reseed);
+    }
+
+    /** @return True if we need to grow; false otherwise. */
+    bool
+    needToGrow()
+    const noexcept
+    {
+        return mSize >= mLoad;
+    }
+
+    /** @brief Grow the map. */
+    void
+    grow()
+    {
+        size_type newLen = mLen * 2;
+
+        if (UNLIKELY(newLen < mLen))
+        {
+            throw std::overflow_error("hackmap::unordered_map size overflow");
+        }
+
+        resize_to(newLen);
+        guard_type::guard_forgive();
+    }
+
+    /** @return Smallest power of 2 >= n. */
+    size_type
+    to_power_2(size_type n)
+    {
+        if (!n)
+        {
+            return 1;
+        }
+
+        if (!(n & (n - 1)))
+        {
+            return n;
+        }
+
+        if (n > MAX_SIZE)
+        {
+            return MAX_SIZE;
+        }
+
+        size_type p = 1;
+
+        while (p < n)
+        {
+            p <<= 1;
+        }
+
+        return p;
+    }
+
+    template <bool IsMostlyFull>
+    void
+    insert_move_from(block_type* b, size_type len)
+    {
+        size_type blen = len / BLOCK_LEN;
+
+        for (size_type i = 0; i < blen; ++i)
+        {
+            block_type* block = b + i;
+
+            if (IsMostlyFull)
+            {
+                // Gets us 1-2 nanoseconds off on map growth.
+                // Probably due to loop unrolling.
+                for (int sub = 0; sub < BLOCK_LEN; ++sub)
+                {
+                    if (LIKELY(!block->is_empty_by_subindex(sub)))
+                    {
+                        upsert<false, true, false>(
+                            std::move(block->get_value_by_subindex(sub)));
+                    }
+                }
+            }
+            else
+            {
+                // Not performance tested yet, but should give better
+                // performance when shrinking the map.
+                search_map m = block->find_full();
+                while (m.has())
+                {
+                    int sub = m.next();
+                    upsert<false, true, false>(
+                        std::move(block->get_value_by_subindex(sub)));
+                    m.clear(sub);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Resize the map (bigger/smaller).
+     * @param force Rebuild even if the length is unchanged.
+     * @param reason Reported to a resize_listener.
+     */
+    NOINLINE
+    void
+    resize_to(size_type minLen, bool force = false,
+              resize_reason reason = resize_reason::grow)
+    {
+        HACKMAP_TIME(resize);
+        size_type lenPwr2 = to_power_2(minLen);
+
+        if (lenPwr2 < BLOCK_LEN)
+        {
+            lenPwr2 = BLOCK_LEN;
+        }
+
+        if (lenPwr2 == mLen && !force)
+        {
+            return;
+        }
+
+        if (lenPwr2 < minLen || lenPwr2 < mSize)
+        {
+            throw std::overflow_error("hackmap::unordered_map size overflow");
+        }
+
+        uint64_t start = hook_type::resize_start();
+        block_type* oldBlock = mBlock;
+        size_type oldLen = mLen;
+
+        mBlock = allocate_blocks(lenPwr2);
+        mLen = lenPwr2;
+        mMask = lenPwr2 - 1;
+        update_load(mLen);
+
+        if (reinterpret_cast<block_type*>(&NULL_BLOCK<policy_type>) == oldBlock)
+        {
+            notify_resize(reason, 0, 0, start);
+            return;
+        }
+
+        if (mSize)
+        {
+            size_type oldSize = mSize;
+            HACKMAP_COUNT(resizes, 1);
+            HACKMAP_COUNT(bytes_moved, oldSize * sizeof(value_type));
+            mSize = 0;
+            if (double(oldSize) > (double(oldLen)/2.0))
+            {
+                insert_move_from<true>(oldBlock, oldLen);
+            }
+            else
+            {
+                insert_move_from<false>(oldBlock, oldLen);
+            }
+        }
+
+        deallocate_blocks(oldBlock, oldLen);
+        notify_resize(reason, oldLen, mSize, start);
+    }
+
+    /** @brief Report a rebuild from oldLen to mLen to the listener. */
+    void
+    notify_resize(resize_reason reason, size_type oldLen, size_type size,
+                  uint64_t start)
+    const noexcept
+    {
+        if (policy_type::resize_listener)
+        {
+            size_type freed = 0;
+            size_type allocated = 0;
+            if (resize_reason::clear != reason)
+            {
+                freed = oldLen ? total_memory_size(oldLen) : 0;
+                allocated = total_memory_size(mLen);
+            }
+            hook_type::resize_notify(resize_event{ reason, oldLen, mLen, size,
+                                                   allocated, freed, 0 },
+                                     start);
+        }
+    }
+
+    /** @return Needed bytes for table (not sentinel). */
+    static size_type
+    memory_size(size_type len)
+    noexcept
+    {
+        return sizeof(block_type) * (len / BLOCK_LEN);
+    }
+
+    /** @return Total memory size for deallocation. */
+    static size_type
+    total_memory_size(size_type len)
+    noexcept
+    {
+        if (policy_type::free_summary || policy_type::full_summary
+            || policy_type::miss_filter)
+        {
+            size_type words = 0;
+            if (policy_type::free_summary)
+            {
+                words += summary_words(len);
+            }
+            if (policy_type::full_summary)
+            {
+                words += summary_words(len) + summary_top_words(len);
+            }
+            if (policy_type::miss_filter)
+            {
+                words += len / BLOCK_LEN;
+            }
+            return summary_offset(len) + words * sizeof(uint64_t);
+        }
+        return memory_size(len) + block_type::sentinel_memory_size();
+    }
+
+    /** @return Number of words for one bit per block. */
+    static size_type
+    summary_words(size_type len)
+    noexcept
+    {
+        return ((len / BLOCK_LEN) + 63) / 64;
+    }
+
+    /** @return Number of words for one bit per full summary word. */
+    static size_type
+    summary_top_words(size_type len)
+    noexcept
+    {
+        return (summary_words(len) + 63) / 64;
+    }
+
+    /** @return Offset of the summaries, aligned past the sentinel. */
+    static size_type
+    summary_offset(size_type len)
+    noexcept
+    {
+        size_type offset = memory_size(len)
+                           + block_type::sentinel_memory_size();
+        return (offset + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    }
+
+    /** @return Free summary stored after the table and sentinel. */
+    static uint64_t*
+    get_summary(block_type* b, size_type len)
+    noexcept
+    {
+        return reinterpret_cast<uint64_t*>(
+            reinterpret_cast<unsigned char*>(b) + summary_offset(len));
+    }
+
+    /** @return Full summary (then its second level) after the free summary. */
+    static uint64_t*
+    get_full_summary(block_type* b, size_type len)
+    noexcept
+    {
+        return get_summary(b, len)
+               + (policy_type::free_summary ? summary_words(len) : 0);
+    }
+
+    /** @return Miss filter, a word per block, after the full summary. */
+    static uint64_t*
+    get_filter(block_type* b, size_type len)
+    noexcept
+    {
+        return get_full_summary(b, len)
+               + (policy_type::full_summary
+                  ? summary_words(len) + summary_top_words(len) : 0);
+    }
+
+    /** @brief Flag every block as having only empty entries. */
+    void
+    fill_summary(block_type* b, size_type len)
+    noexcept
+    {
+        if (policy_type::free_summary)
+        {
+            uint64_t* words = get_summary(b, len);
+            size_type nblocks = len / BLOCK_LEN;
+            size_type nwords = summary_words(len);
+            for (size_type i = 0; i < nwords; ++i)
+            {
+                words[i] = ~uint64_t(0);
+            }
+            if (nblocks % 64)
+            {
+                words[nwords - 1] = (uint64_t(1) << (nblocks % 64)) - 1;
+            }
+        }
+
+        if (policy_type::full_summary)
+        {
+            std::memset(get_full_summary(b, len), 0,
+                        (summary_words(len) + summary_top_words(len))
+                        * sizeof(uint64_t));
+        }
+
+        if (policy_type::miss_filter)
+        {
+            std::memset(get_filter(b, len), 0,
+                        (len / BLOCK_LEN) * sizeof(uint64_t));
+        }
+    }
+
+    /** @brief Allocate and initialize memory. */
+    block_type*
+    allocate_blocks(size_type len)
+    {
+        size_type memory = memory_size(len);
+        unsigned char *p = allocator_traits::allocate(*this,
+                                                      total_memory_size(len));
+        block_type::fill_empty(p, memory);
+        block_type::fill_sentinel(p + memory);
+        block_type* b = reinterpret_cast<block_type*>(p);
+        fill_summary(b, len);
+        return b;
+    }
+
+    /** @brief Free our memory. */
+    void
+    deallocate_blocks(block_type* b, size_type len)
+    {
+        if (reinterpret_cast<block_type*>(&NULL_BLOCK<policy_type>) != b)
+        {
+            size_type memory = total_memory_size(len);
+            allocator_traits::deallocate(*this,
+                 reinterpret_cast<typename allocator_traits::pointer>(b),
+                 memory);
+        }
+    }
+
+    /** @brief Call destructor on every value. */
+    void
+    destroy_values()
+    noexcept
+    {
+        iterator start = begin();
+        const_iterator stop = cend();
+
+        while (start != stop)
         {
-            return;
+            allocator_traits::destroy(*this, &(*start));
+            ++start;
         }
+    }
 
-        std::swap(mBlock, o.mBlock);
-        std::swap(mSize, o.mSize);
-        std::swap(mLen, o.mLen);
-        std::swap(mLoad, o.mLoad);
-        std::swap(mMask, o.mMask);
+    /** @brief Set every entry to empty. */
+    void
+    clear_data()
+    noexcept
+    {
+        size_type memory = memory_size(mLen);
+        block_type::fill_empty(reinterpret_cast<unsigned char *>(mBlock),
+                               memory);
+        fill_summary(mBlock, mLen);
     }
 
-#ifdef DEBUG
-    bool
-    invariant_head(std::ostream* os,
-                   size_type& size_lists,
-                   block_type* block,
-                   size_type ihead)
-    const noexcept
+    /** @return Block, value, and policy sizes a raw snapshot relies on. */
+    static constexpr uint64_t
+    snapshot_layout()
+    noexcept
     {
-        size_type index = ihead;
+        return uint64_t(sizeof(block_type))
+               | (uint64_t(sizeof(value_type)) << 24)
+               | (uint64_t(BLOCK_LEN) << 40)
+               | (uint64_t(policy_type::free_summary) << 48)
+               | (uint64_t(policy_type::full_summary) << 49)
+               | (uint64_t(policy_type::miss_filter) << 50)
+               | (uint64_t(sizeof(typename policy_type::hash_type)) << 52)
+               | (uint64_t(sizeof(typename policy_type::leap_type)) << 56);
+    }
 
-        bool notrust = false;
-        uint8_t prevfrag = 0;
-        size_type i = 0;
-        for (; i < mLen; ++i)
+    /** @return Mix of the first 64 keys' hashes, in bucket order. */
+    uint64_t
+    snapshot_fingerprint()
+    const
+    {
+        uint64_t mix = mSize;
+        size_type n = 0;
+        for (auto it = cbegin(); it != cend() && n < 64; ++it, ++n)
         {
-            ++size_lists;
-            if (index != ihead)
-            {
-                if (block->is_head(index))
-                {
-                    if (nullptr != os)
-                    {
-                        (*os) << "Link leaped to is flagged as head: "
-                              << index << std::endl;
-                    }
-                    return false;
-                }
-            }
-            else
-            {
-                if (block->is_link(index))
-                {
-                    if (nullptr != os)
-                    {
-                        (*os) << "Head index is flagged as link: "
-                              << index << std::endl;
-                    }
-                    return false;
-                }
-            }
+            mix = (mix ^ uint64_t(hash_key(it->first)))
+                  * 0x9E3779B97F4A7C15ULL;
+        }
+        return mix;
+    }
 
-            size_type hash = hash_key(block->get_value(index).first);
-            uint8_t frag = hash_fragment(hash);
-            if (index != ihead)
-            {
-                frag = block_type::set_link_hash(frag);
-            }
-            uint8_t myfrag = block->get_hash(index);
-            if (notrust)
-            {
-                frag = block_type::set_link_hash(prevfrag);
-            }
-            if (myfrag != frag)
+    snapshot_header
+    snapshot_head(bool raw)
+    const
+    {
+        snapshot_header head = {};
+        std::memcpy(head.magic, "hackmap", 8);
+        head.version = 1;
+        head.raw = raw ? 1 : 0;
+        head.layout = snapshot_layout();
+        head.len = mLen;
+        head.size = mSize;
+        head.load_factor = MaxLoadFactor;
+        head.fingerprint = snapshot_fingerprint();
+        return head;
+    }
+
+    /**
+     * @brief Check blocks [from, upto) of the raw table b: no special
+     *        hashes, and local leaps landing on links. Adds their entries
+     *        to count, and marks blocks with a free or full entry in frees
+     *        and fulls for check_snapshot_tail().
+     * @return True if a block is bad.
+     */
+    static bool
+    check_snapshot_blocks(block_type* b, size_type len, size_type from,
+                          size_type upto, size_type& count,
+                          std::vector<uint64_t>& frees,
+                          std::vector<uint64_t>& fulls)
+    noexcept
+    {
+        // Accumulate failures without branching, as leaps are random.
+        bool bad = false;
+        for (size_type iblock = from; iblock < upto; ++iblock)
+        {
+            size_type index = iblock * BLOCK_LEN;
+            block_type* block = block_type::get(b, index);
+            search_map full = block->find_full();
+            count += size_type(__builtin_popcount(full.value()));
+            frees[iblock / 64] |= uint64_t(block->find_empty().has())
+                                  << (iblock % 64);
+            fulls[iblock / 64] |= uint64_t(full.has()) << (iblock % 64);
+            while (full.has())
             {
-                if (nullptr != os)
-                {
-                    (*os) << "Incorrect hash at [" << index
-                          << "] expecting [" << unsigned(frag)
-                          << "] found [" << unsigned(myfrag)
-                          << "]" << std::endl;
-                }
-                return false;
+                int sub = full.next();
+                full.clear(sub);
+                size_type i = index + size_type(sub);
+                size_type next = (i + block->get_leap(i)) & (len - 1);
+                block_type* nblock = block_type::get(b, next);
+                bool leaps = !block->is_end(i) & block->is_local(i);
+                bad |= block->is_special_by_subindex(sub)
+                       | (leaps & (nblock->is_empty(next)
+                                   | !nblock->is_link(next)));
             }
+        }
+        return bad;
+    }
 
-            size_type myhead = hash_to_index(hash);
-            if (myhead != ihead)
+    /**
+     * @return True unless the raw table b's sentinel and summaries match
+     *         the frees and fulls check_snapshot_blocks() found.
+     */
+    static bool
+    check_snapshot_tail(block_type* b, size_type len,
+                        const std::vector<uint64_t>& frees,
+                        const std::vector<uint64_t>& fulls)
+    noexcept
+    {
+        unsigned char sentinel[2 * BLOCK_LEN] = {};
+        block_type::fill_sentinel(sentinel);
+        bool bad = 0 != std::memcmp(
+            reinterpret_cast<char*>(b) + memory_size(len), sentinel,
+            block_type::sentinel_memory_size());
+        size_type bytes = frees.size() * sizeof(uint64_t);
+        if (policy_type::free_summary)
+        {
+            bad |= 0 != std::memcmp(get_summary(b, len), frees.data(), bytes);
+        }
+        if (policy_type::full_summary)
+        {
+            const uint64_t* words = get_full_summary(b, len);
+            const uint64_t* tops = words + summary_words(len);
+            bad |= 0 != std::memcmp(words, fulls.data(), bytes);
+            for (size_type iword = 0; iword < fulls.size(); ++iword)
             {
-                if (nullptr != os)
-                {
-                    (*os) << "Link leaped to [" << index
-                          << "] not part of list at [" << ihead
-                          << "] head index reported as [" << myhead
-                          << "]" << std::endl;
-                }
-                return false;
+                bad |= ((tops[iword / 64] >> (iword % 64)) & 1)
+                       != (0 != fulls[iword]);
             }
+        }
+        return bad;
+    }
 
-            if (block->is_end(index))
+    /**
+     * @brief Read a save(os) table into b, a chunk of blocks at a time,
+     *        checking each while it is in cache: no special hashes, size
+     *        entries, local leaps landing on links, then the sentinel and
+     *        summaries matching the entries.
+     * @throw std::runtime_error on a short read or a bad table (b is then
+     *        freed).
+     */
+    void
+    read_snapshot_table(std::istream& is, block_type* b,
+                        const snapshot_header& head)
+    {
+        static constexpr size_type CHUNK = 1024;
+        // Blocks past its own that a local leap may land in.
+        static constexpr size_type REACH =
+            (size_type(leap_type(~leap_type(0))) + 2 * BLOCK_LEN - 1)
+            / BLOCK_LEN;
+
+        size_type len = head.len;
+        size_type nblocks = len / BLOCK_LEN;
+        std::vector<uint64_t> frees(summary_words(len), 0);
+        std::vector<uint64_t> fulls(summary_words(len), 0);
+        char* p = reinterpret_cast<char*>(b);
+        size_type count = 0;
+        size_type read = 0;
+        size_type checked = 0;
+        bool bad = false;
+        while (checked < nblocks)
+        {
+            size_type upto = std::min(read + CHUNK, nblocks);
+            if (!is.read(p + read * sizeof(block_type),
+                         (upto - read) * sizeof(block_type)))
             {
-                break;
+                deallocate_blocks(b, len);
+                throw std::runtime_error(
+                    "hackmap::unordered_map snapshot read");
             }
+            read = upto;
+
+            size_type last = read == nblocks ? nblocks
+                             : read > REACH ? read - REACH : 0;
+            bad |= check_snapshot_blocks(b, len, checked, last, count,
+                                         frees, fulls);
+            checked = last;
+        }
+
+        size_type tail = head.bytes - memory_size(len);
+        if (!is.read(p + memory_size(len), tail))
+        {
+            deallocate_blocks(b, len);
+            throw std::runtime_error("hackmap::unordered_map snapshot read");
+        }
+
+        bad |= count != head.size
+               || check_snapshot_tail(b, len, frees, fulls);
+        if (bad)
+        {
+            deallocate_blocks(b, len);
+            throw std::runtime_error("hackmap::unordered_map bad snapshot");
+        }
+    }
+
+    static void
+    write_snapshot(std::ostream& os, const void* p, size_type bytes)
+    {
+        if (!os.write(reinterpret_cast<const char*>(p), bytes))
+        {
+            throw std::runtime_error("hackmap::unordered_map snapshot write");
+        }
+    }
+
+    static snapshot_header
+    read_snapshot_head(std::istream& is, bool raw)
+    {
+        snapshot_header head;
+        if (!is.read(reinterpret_cast<char*>(&head), sizeof(head))
+            || std::memcmp(head.magic, "hackmap", 8) || 1 != head.version)
+        {
+            throw std::runtime_error("hackmap::unordered_map bad snapshot");
+        }
+        if (head.raw != (raw ? 1u : 0u)
+            || (raw && head.layout != snapshot_layout()))
+        {
+            throw std::runtime_error(
+                "hackmap::unordered_map snapshot layout mismatch");
+        }
+        return head;
+    }
+
+    /** @brief Set the state for the moved-from object. */
+    void
+    set_moved_from()
+    noexcept
+    {
+        mBlock = reinterpret_cast<block_type*>(&NULL_BLOCK<policy_type>);
+        mSize = 0;
+        mLoad = 0;
+        mLen = 0;
+        mMask = 0;
+    }
+};
+
+
+} /* namespace detail */
+
+template <typename Key,
+          typename T,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>,
+          typename Alloc = std::allocator<std::pair<Key, T> >,
+          typename Policy = default_policy
+          >
+class unordered_map
+    : public detail::unordered_map 
+             <97,
+              Key,
+              T,
+              Hash,
+              Pred,
+              typename std::allocator_traits<Alloc>::template
+                       rebind_alloc<unsigned char>,
+              Policy
+              >
+{
+    using base_type =
+        detail::unordered_map<97,
+                              Key,
+                              T,
+                              Hash,
+                              Pred,
+                              typename std::allocator_traits<Alloc>::template
+                                       rebind_alloc<unsigned char>,
+                              Policy>;
+
+public:
+    using base_type::base_type;
+    unordered_map() = default;
+};
+
+/**
+ * @brief Fixed capacity cache evicting with CLOCK (second chance).
+ *
+ * The index is a map reserved for capacity up front, so it never grows.
+ * A reference bit per bucket lives in a side bitmap, set by get() and
+ * by put() of a present key; a new key starts unreferenced, so keys used
+ * once go before keys used again. To evict, the hand sweeps 64 buckets
+ * a step: the SSE2 block masks give the occupied buckets, the first one
+ * without its reference bit is evicted, otherwise their bits are cleared
+ * and the hand moves on. Each bit is cleared at most once per sweep, so
+ * eviction is amortized O(1). The map may move an entry to another
+ * bucket on insert or erase (leaving its bit behind), which only blurs
+ * recency.
+ */
+template <typename Key,
+          typename T,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>
+          >
+class clock_cache
+{
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using map_type = detail::unordered_map<97, Key, T, Hash, Pred>;
+
+    explicit
+    clock_cache(size_type capacity)
+        : mCapacity(capacity ? capacity : 1)
+    {
+        mMap.reserve(mCapacity);
+        mRef.assign(mMap.bucket_count() / WORD_BITS + 1, 0);
+    }
+
+    /** @return k's value, marked recently used, or nullptr. */
+    mapped_type*
+    get(const key_type& k)
+    {
+        auto it = mMap.find(k);
+        if (it == mMap.end())
+        {
+            ++mMisses;
+            return nullptr;
+        }
+        ++mHits;
+        reference(mMap.bucket_of(it));
+        return &it->second;
+    }
+
+    /**
+     * @brief Set k's value, evicting an entry first if the cache is full.
+     * @return True if k was inserted, false if its value was replaced.
+     */
+    bool
+    put(const key_type& k, mapped_type value)
+    {
+        auto it = mMap.find(k);
+        if (it != mMap.end())
+        {
+            it->second = std::move(value);
+            reference(mMap.bucket_of(it));
+            return false;
+        }
+
+        if (mMap.size() >= mCapacity)
+        {
+            evict();
+        }
+        it = mMap.emplace(k, std::move(value)).first;
+        unreference(mMap.bucket_of(it));
+        return true;
+    }
+
+    /** @return Erased entries (0 or 1). */
+    size_type
+    erase(const key_type& k)
+    {
+        return mMap.erase(k);
+    }
+
+    void
+    clear()
+    noexcept
+    {
+        mMap.clear();
+        std::fill(mRef.begin(), mRef.end(), 0);
+        mHand = 0;
+    }
+
+    size_type
+    size()
+    const noexcept
+    {
+        return mMap.size();
+    }
+
+    size_type
+    capacity()
+    const noexcept
+    {
+        return mCapacity;
+    }
+
+    size_type
+    hits()
+    const noexcept
+    {
+        return mHits;
+    }
+
+    size_type
+    misses()
+    const noexcept
+    {
+        return mMisses;
+    }
+
+    size_type
+    evictions()
+    const noexcept
+    {
+        return mEvictions;
+    }
+
+    size_type
+    memory_usage()
+    const noexcept
+    {
+        return mMap.memory_usage() + mRef.capacity() * sizeof(uint64_t);
+    }
 
-            prevfrag = frag;
-            index = leap(ihead, index, notrust);
-            block = get_block(index);
-        }
+private:
+    static constexpr size_type WORD_BITS = 64;
 
-        if (i == mLen)
-        {
-            if (nullptr != os)
-            {
-                (*os) << "Too many leaps starting at: "
-                      << ihead << std::endl;
-            }
-            return false;
-        }
+    void
+    reference(size_type index)
+    noexcept
+    {
+        mRef[index / WORD_BITS] |= uint64_t(1) << (index % WORD_BITS);
+    }
 
-        return true;
+    void
+    unreference(size_type index)
+    noexcept
+    {
+        mRef[index / WORD_BITS] &= ~(uint64_t(1) << (index % WORD_BITS));
     }
 
-    bool
-    invariant()
+    /** @return Bit per occupied bucket of the word holding index. */
+    uint64_t
+    occupied(size_type index)
     const noexcept
     {
-        return invariant(nullptr);
+        size_type first = index - index % WORD_BITS;
+        size_type last = std::min(first + WORD_BITS, mMap.bucket_count());
+        uint64_t bits = 0;
+        for (size_type i = first; i < last; i += detail::BLOCK_LEN)
+        {
+            bits |= uint64_t(mMap.bucket_block_mask(i)) << (i - first);
+        }
+        return bits;
     }
 
-    bool
-    invariant(std::ostream* os)
-    const noexcept
+    /** @brief Evict the first occupied, unreferenced bucket from the hand. */
+    void
+    evict()
     {
-        if (reinterpret_cast<block_type*>(&NULL_BLOCK) == mBlock)
+        const size_type len = mMap.bucket_count();
+        for (;;)
         {
-            if (mSize != 0 || mLen != 0 || mLoad != 0 || mMask != 0)
+            if (mHand >= len)
             {
-                if (nullptr != os)
-                {
-                    (*os) << "Invalid size/len/load/mask: "
-                          << mSize << '/'
-                          << mLen << '/'
-                          << mLoad << '/'
-                          << mMask << std::endl;
-                }
-                return false;
+                mHand = 0;
             }
-            return true;
+            size_type word = mHand / WORD_BITS;
+            // Only buckets from the hand onwards.
+            uint64_t ahead = ~uint64_t(0) << (mHand % WORD_BITS);
+            uint64_t live = occupied(mHand) & ahead;
+            uint64_t victims = live & ~mRef[word];
+            if (victims)
+            {
+                size_type index = word * WORD_BITS
+                                  + size_type(__builtin_ctzll(victims));
+                mMap.erase_bucket(index);
+                mHand = index + 1;
+                ++mEvictions;
+                return;
+            }
+            mRef[word] &= ~live;
+            mHand = (word + 1) * WORD_BITS;
         }
+    }
 
-        size_type size_count = 0;
-        size_type size_lists = 0;
+    map_type mMap;
+    std::vector<uint64_t> mRef;
+    size_type mCapacity;
+    size_type mHand = 0;
+    size_type mHits = 0;
+    size_type mMisses = 0;
+    size_type mEvictions = 0;
+};
 
-        size_type index = 0;
-        while (index < mLen)
-        {
-            auto block = get_block(index);
-            for (int sub = 0; sub < BLOCK_LEN; ++sub)
-            {
-                if (block->is_empty_by_subindex(sub))
-                {
-                    continue;
-                }
+/**
+ * @brief Map whose entries expire a time to live after they are put.
+ *
+ * Time is whatever tick the caller passes to tick() (e.g. milliseconds),
+ * stored as a 32 bit expiry beside each value and compared wrapping, so
+ * a time to live must stay under 2^31 ticks. find() treats an expired
+ * entry as absent. Each put() sweeps a few blocks ahead of a hand,
+ * erasing expired entries there, and tick() can sweep more, so no call
+ * ever scans the whole table.
+ */
+template <typename Key,
+          typename T,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>
+          >
+class expiring_map
+{
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using time_type = uint32_t;
 
-                if (block->is_special_by_subindex(sub))
-                {
-                    if (nullptr != os)
-                    {
-                        (*os) << "Special hash value at: "
-                              << combine_index(index, sub) << std::endl;
-                    }
-                    return false;
-                }
+    struct entry_type
+    {
+        mapped_type value;
+        time_type expires;
+    };
 
-                if (block->is_head_by_subindex(sub))
-                {
-                    bool pass = invariant_head(os, size_lists, block,
-                                               combine_index(index, sub));
-                    if (!pass)
-                    {
-                        if (nullptr != os)
-                        {
-                            (*os) << "Invalid linked list at: "
-                                  << combine_index(index, sub) << std::endl;
-                        }
-                        return false;
-                    }
-                }
+    using map_type = detail::unordered_map<97, Key, entry_type, Hash, Pred>;
 
-                ++size_count;
-            }
-            index += BLOCK_LEN;
-        }
+    /**
+     * @param ttl Default time to live, in ticks.
+     * @param sweep_blocks Blocks of buckets each put() sweeps.
+     */
+    explicit
+    expiring_map(time_type ttl, size_type sweep_blocks = 1)
+        : mTtl(ttl)
+        , mSweep(sweep_blocks)
+    {}
 
-        if (size_count != size())
+    /** @return k's value, or nullptr if absent or expired. */
+    mapped_type*
+    find(const key_type& k)
+    {
+        auto it = mMap.find(k);
+        if (it == mMap.end() || expired(it->second.expires))
         {
-            if (nullptr != os)
-            {
-                (*os) << "Invalid size by counting full entries" << std::endl;
-            }
-            return false;
+            return nullptr;
         }
+        return &it->second.value;
+    }
 
-        if (size_lists != size())
+    const mapped_type*
+    find(const key_type& k)
+    const
+    {
+        auto it = mMap.find(k);
+        if (it == mMap.cend() || expired(it->second.expires))
         {
-            if (nullptr != os)
-            {
-                (*os) << "Invalid size by counting lists" << std::endl;
-            }
-            return false;
+            return nullptr;
         }
+        return &it->second.value;
+    }
 
-        return true;
+    /**
+     * @brief Set k's value to expire ttl ticks from now.
+     * @return True if k was absent or expired.
+     */
+    bool
+    put(const key_type& k, mapped_type value, time_type ttl)
+    {
+        sweep(mSweep);
+        time_type expires = time_type(mNow + ttl);
+        bool revived = true;
+        mMap.upsert(k,
+                    [&]() { return entry_type{ std::move(value), expires }; },
+                    [&](entry_type& e)
+                    {
+                        revived = expired(e.expires);
+                        e = entry_type{ std::move(value), expires };
+                    });
+        return revived;
     }
-#endif
 
-#ifdef DEBUG
-    void
-    print_block(std::ostream& os, size_type index)
-    const
+    bool
+    put(const key_type& k, mapped_type value)
     {
-        os << "BLOCK: " << (index / BLOCK_LEN) << std::endl;
+        return put(k, std::move(value), mTtl);
+    }
 
-        auto block = get_block(index);
-        for (int i = 0; i < BLOCK_LEN; ++i)
+    /** @return Erased entries (0 or 1, expired ones count as absent). */
+    size_type
+    erase(const key_type& k)
+    {
+        auto it = mMap.find(k);
+        if (it == mMap.end())
         {
-            if (i == (BLOCK_LEN / 2))
-            {
-                os << std::endl;
-            }
-            else if (i)
-            {
-                os << " | ";
-            }
-
-            std::ios_base::fmtflags flags = os.flags();
-            uint8_t hash = block->get_hash_by_subindex(i);
-            uint8_t leap = block->get_leap_by_subindex(i);
-            os << "0x";
-            os << std::setfill('0') << std::setw(2) << std::hex
-               << std::uppercase
-               << unsigned(hash);
-            os.flags(flags);
-            os << " 0x";
-            os << std::setfill('0') << std::setw(2) << std::hex
-               << std::uppercase
-               << unsigned(leap);
-            os.flags(flags);
-            if (!block->is_empty_by_subindex(i))
-            {
-                auto ref = block->get_value_by_subindex(i);
-                os << ": ";
-                os << ref.first << ' ' << ref.second
-                   << " @[" << key_to_index(ref.first) << ']';
-            }
+            return 0;
         }
-        os << std::endl;
+        bool live = !expired(it->second.expires);
+        mMap.erase(it);
+        return live ? 1 : 0;
     }
 
-    void
-    print()
-    const
+    /**
+     * @brief Advance the clock to now and sweep blocks more blocks.
+     * @return Expired entries reclaimed.
+     */
+    size_type
+    tick(time_type now, size_type blocks = 0)
     {
-        print(std::cout);
+        mNow = now;
+        return sweep(blocks);
     }
 
-    void
-    print(std::ostream& os)
-    const
+    /**
+     * @brief Erase the expired entries of the next blocks blocks.
+     * @return Expired entries reclaimed.
+     */
+    size_type
+    sweep(size_type blocks)
     {
-        if (mSize)
+        const size_type len = mMap.bucket_count();
+        size_type reclaimed = 0;
+        for (size_type b = 0; b < blocks && len; ++b)
         {
-            os << "TABLE START" << std::endl;
-            size_type index = 0;
-            while (index < mLen)
+            if (mHand >= len)
             {
-                print_block(os, index);
-                index = index + BLOCK_LEN;
+                mHand = 0;
             }
-            os << "TABLE END" << std::endl;
-        }
-        else
-        {
-            os << "TABLE EMPTY" << std::endl;
+            size_type base = mHand;
+            int full = mMap.bucket_block_mask(base);
+            while (full)
+            {
+                size_type index = base + size_type(__builtin_ctz(full));
+                full &= full - 1;
+                // Erasing a head pulls its chain's tail into the bucket.
+                while (mMap.bucket_size(index)
+                       && expired(mMap.bucket_entry(index)->second.expires))
+                {
+                    mMap.erase_bucket(index);
+                    ++reclaimed;
+                }
+            }
+            mHand = base + detail::BLOCK_LEN;
         }
+        mExpired += reclaimed;
+        return reclaimed;
     }
-#endif
 
-    void
-    gather_stats_list(unordered_map_stats &stats, size_type ihead)
+    time_type
+    now()
     const noexcept
     {
-        size_type iprev = ihead;
-        size_type index = ihead;
-        size_type list_index = 0;
-
-        bool notrust = false;
-        for (;;)
-        {
-            stats.link_distance(list_index);
-
-            if (list_index)
-            {
-                size_type leap_dist = ((index + mLen) - iprev) & mMask;
-                size_type home_dist = ((index + mLen) - ihead) & mMask;
-                stats.leap_distance(list_index, leap_dist);
-                stats.home_distance(list_index, home_dist);
-            }
-
-            auto block = get_block(index);
-
-            if (block->is_end(index))
-            {
-                break;
-            }
+        return mNow;
+    }
 
-            iprev = index;
-            index = leap(ihead, index, notrust);
-            ++list_index;
-        }
+    /** @return Entries held, including expired ones not yet swept. */
+    size_type
+    size()
+    const noexcept
+    {
+        return mMap.size();
     }
 
-    void
-    gather_stats(unordered_map_stats &stats)
+    /** @return Expired entries reclaimed by sweeping so far. */
+    size_type
+    expired_count()
     const noexcept
     {
-        if (mSize)
-        {
-            stats.start(mLen, mSize);
-            for (size_type index = 0; index < mLen; ++index)
-            {
-                auto block = get_block(index);
+        return mExpired;
+    }
 
-                if (block->is_empty(index))
-                {
-                    stats.is_next_empty(true);
-                }
-                else if (block->is_head(index))
-                {
-                    stats.is_next_empty(false);
-                    gather_stats_list(stats, index);
-                }
-            }
-            stats.stop();
-        }
+    void
+    clear()
+    noexcept
+    {
+        mMap.clear();
+        mHand = 0;
     }
 
-private:
-    template <typename FindKey>
     size_type
-    find_index(const FindKey& k)
-    const
+    memory_usage()
+    const noexcept
     {
-        size_type hash = hash_key(k);
-        size_type ihead = hash_to_index(hash);
-        auto block = get_block(ihead);
+        return mMap.memory_usage();
+    }
 
-        if (block->is_empty_or_link(ihead))
-        {
-            return mLen;
-        }
+private:
+    bool
+    expired(time_type expires)
+    const noexcept
+    {
+        return int32_t(expires - mNow) <= 0;
+    }
 
-        uint8_t frag = hash_fragment(hash);
+    map_type mMap;
+    time_type mTtl;
+    time_type mNow = 0;
+    size_type mSweep;
+    size_type mHand = 0;
+    size_type mExpired = 0;
+};
 
-        if (frag == block->get_hash(ihead))
-        {
-            if (compare_keys(block->get_value(ihead).first, k))
-            {
-                return ihead;
-            }
-        }
+/**
+ * @brief Map whose values live in a slab, so references to them are stable.
+ *
+ * The table maps each key to a 32 bit slot index; values are constructed
+ * in place in fixed size chunks of slots (~64KB each) and never move, so
+ * growing or rehashing only moves keys and indices, and values need not
+ * be movable. New slots are taken in allocation order, reusing erased
+ * ones first. Use for large or non-movable values; small values are
+ * faster inline in hackmap::unordered_map.
+ */
+template <typename Key,
+          typename T,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>
+          >
+class node_map
+{
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using slot_index = uint32_t;
+    using map_type = detail::unordered_map<97, Key, slot_index, Hash, Pred>;
 
-        if (block->is_end(ihead))
-        {
-            return mLen;
-        }
-        
-        size_type index = ihead;
-        frag = block_type::set_link_hash(frag);
-        for (;;)
-        {
-            bool notrust = false;
-            index = leap(ihead, index, notrust);
-            block = get_block(index);
+    node_map() = default;
+    node_map(const node_map&) = delete;
+    node_map& operator=(const node_map&) = delete;
 
-            if (frag == block->get_hash(index) || notrust)
-            {
-                if (compare_keys(block->get_value(index).first, k))
-                {
-                    return index;
-                }
-            }
+    node_map(node_map&& o)
+    noexcept
+        : mMap(std::move(o.mMap))
+        , mChunks(std::move(o.mChunks))
+        , mFree(std::move(o.mFree))
+        , mUsed(o.mUsed)
+    {
+        o.mUsed = 0;
+    }
 
-            if (block->is_end(index))
-            {
-                return mLen;
-            }
+    node_map&
+    operator=(node_map&& o)
+    noexcept
+    {
+        if (this != &o)
+        {
+            destroy_values();
+            mMap = std::move(o.mMap);
+            mChunks = std::move(o.mChunks);
+            mFree = std::move(o.mFree);
+            mUsed = o.mUsed;
+            o.mUsed = 0;
         }
-
-        return mLen;
+        return *this;
     }
 
-    void
-    unlink_head_of_list(size_type ihead)
+    ~node_map()
     {
-        bool noTrustFirst = false;
-        size_type iprev = ihead;
-        size_type itail = leap(ihead, iprev, noTrustFirst);
-        auto blocktail = get_block(itail);
+        destroy_values();
+    }
 
-        bool noTrustFinal = noTrustFirst;
-        while (!blocktail->is_end(itail))
+    /**
+     * @brief Construct k's value from args unless k is present.
+     * @return k's value and whether it was inserted.
+     */
+    template <typename... Args>
+    std::pair<mapped_type*, bool>
+    try_emplace(const key_type& k, Args&&... args)
+    {
+        auto p = mMap.try_emplace(k, NONE);
+        if (!p.second)
         {
-            iprev = itail;
-            itail = leap(ihead, iprev, noTrustFinal);
-            blocktail = get_block(itail);
+            return { value_at(p.first->second), false };
         }
 
-        auto blockhead = get_block(ihead);
-        allocator_traits::construct(*this, blockhead->get_value_ptr(ihead),
-                                    std::move(blocktail->get_value(itail)));
-
-        block_type* blockprev;
-        if (LIKELY(iprev == ihead))
+        slot_index slot;
+        try
         {
-            blockprev = blockhead;
+            slot = next_slot();
+            ::new (static_cast<void*>(value_at(slot)))
+                mapped_type(std::forward<Args>(args)...);
         }
-        else
+        catch (...)
         {
-            blockprev = get_block(iprev);
+            mMap.erase(p.first);
+            throw;
         }
-
-        uint8_t frag;
-        if (UNLIKELY(noTrustFinal))
+        if (mFree.empty())
         {
-            frag = hash_fragment(hash_key(blockhead->get_value(ihead).first));
+            ++mUsed;
         }
         else
         {
-            frag = blocktail->get_hash_only(itail);
+            mFree.pop_back();
         }
+        p.first->second = slot;
+        return { value_at(slot), true };
+    }
 
-        blockprev->set_end(iprev);
-        blocktail->set_empty(itail);
+    mapped_type&
+    operator[](const key_type& k)
+    {
+        return *try_emplace(k).first;
+    }
 
-        if (UNLIKELY(noTrustFirst && iprev != ihead))
-        {
-            cascade(ihead, ihead, block_type::set_link_hash(frag));
-        }
+    /** @return k's value or nullptr, valid until k is erased. */
+    mapped_type*
+    find(const key_type& k)
+    {
+        auto it = mMap.find(k);
+        return it == mMap.end() ? nullptr : value_at(it->second);
+    }
 
-        blockhead->set_hash(ihead, frag);
+    const mapped_type*
+    find(const key_type& k)
+    const
+    {
+        auto it = mMap.find(k);
+        return it == mMap.cend() ? nullptr : value_at(it->second);
     }
 
-    void
-    unlink_link_at(size_type index)
+    size_type
+    count(const key_type& k)
+    const
     {
-        auto block = get_block(index);
-        size_type ihead = key_to_index(block->get_value(index).first);
-        size_type iprev = ihead;
-        bool notrust;
-        size_type inext = leap(ihead, iprev, notrust);
+        return mMap.count(k);
+    }
 
-        while (inext != index)
+    /** @return Erased entries (0 or 1); k's slot is reused next. */
+    size_type
+    erase(const key_type& k)
+    {
+        auto it = mMap.find(k);
+        if (it == mMap.end())
         {
-            iprev = inext;
-            inext = leap(ihead, iprev, notrust);
+            return 0;
         }
-
-        unlink(ihead, iprev, index);
+        slot_index slot = it->second;
+        mFree.push_back(slot);
+        mMap.erase(it);
+        value_at(slot)->~mapped_type();
+        return 1;
     }
 
-    template <bool DoUpsert,
-              bool IsUnique,
-              bool IsListInsert,
-              typename UpsertKey,
-              typename... Args>
-    std::pair<iterator, bool>
-    upsert(UpsertKey&& k, Args&&... args)
+    /** @brief Call fn(key, value) for every entry. */
+    template <typename Fn>
+    void
+    for_each(Fn&& fn)
     {
-        size_type hash = hash_key(k);
-        uint8_t frag = hash_fragment(hash);
-
-        for (;;)
+        for (auto& kv : mMap)
         {
-            size_type ihead = hash_to_index(hash);
-            auto block = get_block(ihead);
-            size_type index = ihead;
-
-            if (IsListInsert || block->is_full(ihead))
-            {
-                if (!IsListInsert)
-                {
-                    if (UNLIKELY(needToGrow()))
-                    {
-                        grow();
-                        continue;
-                    }
-                }
-
-                if (IsListInsert || LIKELY(block->is_head(ihead)))
-                {
-                    do
-                    {
-                        if (!IsUnique && (frag == block->get_hash(index)))
-                        {
-                            if (LIKELY(compare_keys(
-                                            block->get_value(index).first, k)))
-                            {
-                                if (DoUpsert)
-                                {
-                                    allocator_traits::destroy(*this,
-                                        block->get_value_ptr(index));
-                                    allocator_traits::construct(*this,
-                                        block->get_value_ptr(index),
-                                        std::forward<UpsertKey>(k),
-                                        std::forward<Args>(args)...);
-                                }
-
-                                return std::make_pair<iterator, bool>(
-                                    {mBlock, index}, false);
-                            }
-                        }
-
-                        frag = block_type::set_link_hash(frag);
-
-                        if (block->is_end(index))
-                        {
-                            break;
-                        }
-
-                        for (;;)
-                        {
-                            bool notrust = false;
-                            index = leap(ihead, index, notrust);
-                            block = get_block(index);
-
-                            if (!IsUnique
-                                && (frag == block->get_hash(index)
-                                    || notrust))
-                            {
-                                if (LIKELY(compare_keys(
-                                                block->get_value(index).first,
-                                                k)))
-                                {
-                                    if (DoUpsert)
-                                    {
-                                        allocator_traits::destroy(*this,
-                                            block->get_value_ptr(index));
-                                        allocator_traits::construct(*this,
-                                            block->get_value_ptr(index),
-                                            std::forward<UpsertKey>(k),
-                                            std::forward<Args>(args)...);
-                                    }
+            fn(kv.first, *value_at(kv.second));
+        }
+    }
 
-                                    return std::make_pair<iterator, bool>(
-                                        {mBlock, index}, false);
-                                }
-                            }
+    /** @brief Destroy every value, keeping the chunks for reuse. */
+    void
+    clear()
+    noexcept
+    {
+        destroy_values();
+        mMap.clear();
+        mFree.clear();
+        mUsed = 0;
+    }
 
-                            if (block->is_end(index))
-                            {
-                                break;
-                            }
-                        }
-                    }
-                    while (false);
+    void
+    reserve(size_type count)
+    {
+        mMap.reserve(count);
+    }
 
-                    index = link_empty(ihead, index, frag);
-                    block = get_block(index);
-                }
-                //if (!IsListInsert && UNLIKELY(block->is_link(ihead)))
-                else
-                {
-                    unlink_link_at(ihead);
-                    block->set_nofind(ihead);
-                    --mSize;
-                    upsert<true, true, true>(
-                        std::move(block->get_value(ihead)));
-                    block->set_end(ihead);
-                }
-            }
-            else
-            {
-                block->set_end(index);
-            }
+    void
+    rehash(size_type n)
+    {
+        mMap.rehash(n);
+    }
 
-            block->set_hash(index, frag);
-            allocator_traits::construct(*this, block->get_value_ptr(index),
-                                        std::forward<UpsertKey>(k),
-                                        std::forward<Args>(args)...);
-            ++mSize;
-            return std::make_pair<iterator, bool>({mBlock, index}, true);
-        }
+    size_type
+    bucket_count()
+    const noexcept
+    {
+        return mMap.bucket_count();
     }
 
     size_type
-    find_empty(size_type isearch)
+    size()
     const noexcept
     {
-        auto block = get_block(isearch);
+        return mMap.size();
+    }
 
-#if 0
-        // No apparent speedup.
-        if (UNLIKELY(block->is_empty(isearch)))
+    bool
+    empty()
+    const noexcept
+    {
+        return mMap.empty();
+    }
+
+    size_type
+    memory_usage()
+    const noexcept
+    {
+        return mMap.memory_usage()
+               + mChunks.size() * CHUNK_LEN * sizeof(slot_type)
+               + mChunks.capacity() * sizeof(chunk_type)
+               + mFree.capacity() * sizeof(slot_index);
+    }
+
+private:
+    struct slot_type
+    {
+        alignas(mapped_type) unsigned char bytes[sizeof(mapped_type)];
+    };
+
+    using chunk_type = std::unique_ptr<slot_type[]>;
+
+    static constexpr slot_index NONE = ~slot_index(0);
+
+    static constexpr size_type
+    chunk_shift()
+    {
+        size_type shift = 0;
+        while ((size_type(2) << shift) * sizeof(slot_type) <= (1 << 16))
         {
-            return isearch;
+            ++shift;
         }
-#endif
+        return shift;
+    }
 
-        int isub;
+    static constexpr size_type CHUNK_SHIFT = chunk_shift();
+    static constexpr size_type CHUNK_LEN = size_type(1) << CHUNK_SHIFT;
 
-        // Using SSE has been fastest so far.
-        // Loop or switch statement appear to be significantly slower.
-        search_map map = block->find_empty(isearch);
-#if 1
-        // Possible minor speedup, no apparent loss of speed.
-        // Statistics support this being likely.
-        if (LIKELY(map.has()))
-#else
-        if (map.has())
-#endif
+    mapped_type*
+    value_at(slot_index slot)
+    const noexcept
+    {
+        slot_type& s = mChunks[slot >> CHUNK_SHIFT][slot & (CHUNK_LEN - 1)];
+        return reinterpret_cast<mapped_type*>(s.bytes);
+    }
+
+    /**
+     * @return The last erased slot, else the next unused one (adding a
+     *         chunk if needed); taken once its value is constructed.
+     */
+    slot_index
+    next_slot()
+    {
+        if (!mFree.empty())
         {
-            isub = map.next();
-            return combine_index(isearch, isub);
+            return mFree.back();
         }
-
-        for (;;)
+        if (mUsed == mChunks.size() * CHUNK_LEN)
         {
-            isearch = (isearch + BLOCK_LEN) & mMask;
-            block = get_block(isearch);
-            map = block->find_empty();
-            if (map.has())
+            if (mUsed >= NONE)
             {
-                isub = map.next();
-                return combine_index(isearch, isub);
+                throw std::length_error("node_map slots exhausted");
             }
+            mChunks.emplace_back(new slot_type[CHUNK_LEN]);
         }
+        return slot_index(mUsed);
     }
 
-    size_type
-    link_empty(size_type ihead, size_type itail, uint8_t& frag)
+    void
+    destroy_values()
     noexcept
     {
-        //size_type iempty = find_empty((itail + 1) & mMask);
-        size_type iempty = find_empty((ihead + 1) & mMask);
-        size_type emptyPos = ((iempty + mLen) - ihead) & mMask;
-        size_type nextPos = ((itail + mLen) - ihead) & mMask;
-
-        if (LIKELY(emptyPos > nextPos))
-        {
-            link(itail, iempty, frag);
-            get_block(iempty)->set_end(iempty);
-        }
-        else
+        if (!std::is_trivially_destructible<mapped_type>::value)
         {
-            // Location of empty between head and tail.
-            size_type iprev = ihead;
-            bool scrap;
-            size_type inext = leap(ihead, ihead, scrap);
-
-            for (;;)
+            for (auto& kv : mMap)
             {
-                nextPos = ((inext + mLen) - ihead) & mMask;
-                if (emptyPos < nextPos)
-                {
-                    // Found the indices the empty lies between.
-                    break;
-                }
-                iprev = inext;
-                inext = leap(ihead, inext, scrap);
+                value_at(kv.second)->~mapped_type();
             }
+        }
+    }
 
-            auto empty = get_block(iempty);
-            auto next = get_block(inext);
+    map_type mMap;
+    std::vector<chunk_type> mChunks;
+    std::vector<slot_index> mFree;
+    size_type mUsed = 0;
+};
 
-            // Link previous to empty slot.
-            link(iprev, iempty, frag);
-            // Set the empty slot.
-            empty->set_hash(iempty, frag);
-            // Generate hash of next and link empty to next.
-            size_type hash = hash_key(next->get_value(inext).first);
-            uint8_t subhashnext = hash_fragment(hash);
-            subhashnext = block_type::set_link_hash(subhashnext);
-            link(iempty, inext, subhashnext);
-            // Check if we need to cascade hashes.
-            if (UNLIKELY(!next->is_local(inext)))
-            {
-                bool scrap;
-                size_type inextnext = leap(ihead, inext, scrap);
-                cascade(ihead, inextnext, subhashnext);
-            }
-            // Set possibly new subhash.
-            next->set_hash(inext, subhashnext);
-        }
-        
-        return iempty;
+/** @brief A frozen_map string key: its bytes, offset from the arena. */
+struct frozen_string
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+namespace detail
+{
+
+/** Never allocates: the table of a frozen_map belongs to its image. */
+template <typename T>
+struct FrozenAlloc
+{
+    using value_type = T;
+
+    FrozenAlloc() = default;
+
+    template <typename U>
+    FrozenAlloc(const FrozenAlloc<U>&)
+    noexcept
+    {}
+
+    T*
+    allocate(size_t)
+    {
+        throw std::bad_alloc();
     }
 
     void
-    link(size_type iprev, size_type inext, uint8_t& shash)
+    deallocate(T*, size_t)
+    noexcept
+    {}
+
+    bool
+    operator==(const FrozenAlloc&)
+    const noexcept
     {
-        // We convert dist to uint8_t leap value at end.
-        size_type dist = index_dist(iprev, inext);
-        auto block = get_block(iprev);
+        return true;
+    }
 
-        if (LIKELY(block_type::can_leap(dist)))
+    bool
+    operator!=(const FrozenAlloc&)
+    const noexcept
+    {
+        return false;
+    }
+};
+
+/** @return Bytes of k; offsets wrap, so a query key may lie anywhere. */
+static inline const char*
+frozen_bytes(const char* arena, const frozen_string& k)
+noexcept
+{
+    return reinterpret_cast<const char*>(
+        reinterpret_cast<uintptr_t>(arena) + uintptr_t(k.offset));
+}
+
+struct FrozenStringHash
+{
+    using is_avalanching = void;
+
+    const char* arena = nullptr;
+
+    size_type
+    operator()(const frozen_string& k)
+    const noexcept
+    {
+        return size_type(hash_bytes(frozen_bytes(arena, k), k.length));
+    }
+};
+
+struct FrozenStringEqual
+{
+    const char* arena = nullptr;
+
+    bool
+    operator()(const frozen_string& a, const frozen_string& b)
+    const noexcept
+    {
+        return a.length == b.length
+               && 0 == std::memcmp(frozen_bytes(arena, a),
+                                   frozen_bytes(arena, b), a.length);
+    }
+};
+
+/** How a frozen_map stores and looks up Key: trivially copyable as is. */
+template <typename Key, typename Hash, typename Pred>
+struct FrozenKey
+{
+    static_assert(std::is_trivially_copyable<Key>::value,
+                  "hackmap: frozen_map keys must be trivially copyable "
+                  "or std::string");
+
+    using stored_type = Key;
+    using hasher = Hash;
+    using key_equal = Pred;
+    using key_result = const Key&;
+
+    static hasher
+    make_hash(const char*)
+    {
+        return hasher();
+    }
+
+    static key_equal
+    make_equal(const char*)
+    {
+        return key_equal();
+    }
+
+    static const Key&
+    store(std::string&, const Key& k)
+    {
+        return k;
+    }
+
+    static const Key&
+    query(const char*, const Key& k)
+    noexcept
+    {
+        return k;
+    }
+
+    static const Key&
+    load(const char*, const Key& k)
+    noexcept
+    {
+        return k;
+    }
+
+    static bool
+    in_arena(const Key&, uint64_t)
+    noexcept
+    {
+        return true;
+    }
+};
+
+/** Strings live in the arena, hashed with hash_bytes. */
+template <typename Hash, typename Pred>
+struct FrozenKey<std::string, Hash, Pred>
+{
+    using stored_type = frozen_string;
+    using hasher = FrozenStringHash;
+    using key_equal = FrozenStringEqual;
+    using key_result = std::string;
+
+    static hasher
+    make_hash(const char* arena)
+    {
+        return hasher{ arena };
+    }
+
+    static key_equal
+    make_equal(const char* arena)
+    {
+        return key_equal{ arena };
+    }
+
+    static frozen_string
+    store(std::string& arena, const std::string& k)
+    {
+        frozen_string stored{ arena.size(), k.size() };
+        arena += k;
+        return stored;
+    }
+
+    static frozen_string
+    query(const char* arena, const std::string& k)
+    noexcept
+    {
+        return { uint64_t(reinterpret_cast<uintptr_t>(k.data())
+                          - reinterpret_cast<uintptr_t>(arena)),
+                 k.size() };
+    }
+
+    static std::string
+    load(const char* arena, const frozen_string& k)
+    {
+        return std::string(frozen_bytes(arena, k), k.length);
+    }
+
+    /** @return True if k's bytes lie within an arena of length bytes. */
+    static bool
+    in_arena(const frozen_string& k, uint64_t length)
+    noexcept
+    {
+        return k.offset <= length && k.length <= length - k.offset;
+    }
+};
+
+} /* namespace detail */
+
+/**
+ * @brief Read-only map queried in place from an image written by write().
+ *
+ * The image is a save()d table (snapshot_header, blocks, sentinel) then
+ * an arena length and arena holding std::string keys, which the table
+ * refers to by offset, so the image works at any address. open() maps a
+ * file read only and shared; the constructor takes an image already in
+ * memory. Neither parses, copies, or allocates: the table is used where
+ * it lies, with the map's own find and iteration, so startup costs the
+ * header check and the page faults of what is touched. That check covers
+ * the header, lengths, and a fingerprint of the first keys only, so the
+ * image must be trusted; a corrupt table can send a lookup outside it.
+ * Pass check to also walk the whole table, as load() does, and bound the
+ * string keys by the arena, so a bad image throws.
+ *
+ * Values must be trivially copyable. Other keys must be trivially
+ * copyable and hash alike in the writing and reading processes.
+ */
+template <typename Key,
+          typename T,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>
+          >
+class frozen_map
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "hackmap: frozen_map values must be trivially copyable");
+
+    using traits = detail::FrozenKey<Key, Hash, Pred>;
+    using stored_type = typename traits::stored_type;
+    using table_type = detail::unordered_map<97, stored_type, T,
+        typename traits::hasher, typename traits::key_equal,
+        detail::FrozenAlloc<unsigned char>>;
+    using build_type = detail::unordered_map<97, stored_type, T,
+        typename traits::hasher, typename traits::key_equal>;
+
+public:
+    using key_type = Key;
+    using mapped_type = T;
+
+    class const_iterator
+    {
+    public:
+        typename traits::key_result
+        key()
+        const
         {
-            block->set_leap(iprev, dist);
+            return traits::load(mArena, mIt->first);
         }
-        else
+
+        const mapped_type&
+        value()
+        const noexcept
         {
-            shash = block->get_hash_as_link(iprev);
-            block->set_find(iprev);
+            return mIt->second;
+        }
+
+        const_iterator&
+        operator++()
+        {
+            ++mIt;
+            return *this;
+        }
+
+        bool
+        operator==(const const_iterator& o)
+        const noexcept
+        {
+            return mIt == o.mIt;
         }
-    }
-
-    NOINLINE
-    void
-    unlink_complex(size_type ihead, size_type iprev, size_type iunlink)
-    {
-        auto un = get_block(iunlink);
-        auto prev = get_block(iprev);
 
-        // If the new leap stays local then we have an efficient solution.
-        if (LIKELY(prev->is_local(iprev) && un->is_local(iunlink)))
+        bool
+        operator!=(const const_iterator& o)
+        const noexcept
         {
-            // Calculate the distance from prev to next.
-            size_type dist = (size_type)(prev->get_leap(iprev))
-                           + (size_type)(un->get_leap(iunlink));
-            if (LIKELY(block_type::can_leap(dist)))
-            {
-                prev->set_leap(iprev, uint8_t(dist));
-                return;
-            }
+            return mIt != o.mIt;
         }
 
-        bool scrap;
-        size_type inext = leap(ihead, iunlink, scrap);
+    private:
+        friend class frozen_map;
 
-        // Propagate the subhash.
-        uint8_t subhashprev = prev->get_hash_as_link(iprev);
-        cascade(ihead, inext, subhashprev);
+        const_iterator(typename table_type::const_iterator it,
+                       const char* arena)
+            : mIt(it), mArena(arena)
+        {}
 
-        // Good, we can just replace the previous leap.
-        prev->set_find(iprev);
-    }
+        typename table_type::const_iterator mIt;
+        const char* mArena;
+    };
 
-    INLINE
-    void
-    unlink(size_type ihead, size_type iprev, size_type iunlink)
+    /**
+     * @brief Write the image of pairs [first, last) (unique keys).
+     * @throw std::runtime_error if the stream fails.
+     */
+    template <typename InputIt>
+    static void
+    write(std::ostream& os, InputIt first, InputIt last)
     {
-        // Remove entry from linked list.
-        auto un = get_block(iunlink);
-        auto prev = get_block(iprev);
+        std::string arena;
+        std::vector<std::pair<stored_type, T>> entries;
+        for (; first != last; ++first)
+        {
+            entries.emplace_back(traits::store(arena, first->first),
+                                 first->second);
+        }
 
-        if (un->is_end(iunlink))
+        build_type table(0, traits::make_hash(arena.data()),
+                         traits::make_equal(arena.data()));
+        table.reserve(entries.size());
+        for (const auto& kv : entries)
         {
-            prev->set_end(iprev);
+            table.emplace(kv.first, kv.second);
         }
-        else
+        table.save(os);
+
+        uint64_t length = arena.size();
+        if (!os.write(reinterpret_cast<const char*>(&length), sizeof(length))
+            || !os.write(arena.data(), std::streamsize(length)))
         {
-            unlink_complex(ihead, iprev, iunlink);
+            throw std::runtime_error("hackmap::frozen_map write");
         }
     }
 
-    NOINLINE
-    void
-    cascade(size_type ihead, size_type inext, uint8_t newsubhash)
+    /**
+     * @brief Use the image at [image, image + bytes), which must outlive
+     *        this map and stay unchanged. With check, walk the whole table
+     *        first; without, the image must come from a trusted write().
+     * @throw std::runtime_error if it is not an image of this type.
+     */
+    frozen_map(const void* image, size_type bytes, bool check = false)
+        : mTable(0, traits::make_hash(arena_of(image, bytes)),
+                 traits::make_equal(arena_of(image, bytes)))
+        , mArena(arena_of(image, bytes))
     {
-        auto block = get_block(inext);
+        attach(image, check);
+    }
 
-        for (;;)
+    /**
+     * @brief Map the image file at path read only and shared, checking
+     *        it as the constructor does.
+     * @throw std::runtime_error if it cannot be mapped or is not an image.
+     */
+    static frozen_map
+    open(const char* path, bool check = false)
+    {
+#ifdef HACKMAP_MMAP
+        int fd = ::open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) || st.st_size <= 0)
         {
-
-            if (block->is_local(inext))
+            if (fd >= 0)
             {
-                // If we are at the end or next entry isn't search, we're done.
-                break;
+                ::close(fd);
             }
-            
-            // Perform the search BEFORE we change the search hash.
-            size_type ifrom = (inext + block->get_leap(inext)) & mMask;
-            size_type inextnext = extended_leap(ihead, ifrom,
-                                                block->get_hash_as_link(inext));
-
-            // We can change the next's subhash.
-            block->set_hash(inext, newsubhash);
-
-            // Advance the slot pointer.
-            inext = inextnext;
-            block = get_block(inext);
+            throw std::runtime_error("hackmap::frozen_map cannot open image");
         }
-
-        // We can change the next's subhash.
-        block->set_hash(inext, newsubhash);
+        size_type bytes = size_type(st.st_size);
+        void* image = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (MAP_FAILED == image)
+        {
+            throw std::runtime_error("hackmap::frozen_map cannot map image");
+        }
+        try
+        {
+            frozen_map map(image, bytes, check);
+            map.mMapped = image;
+            map.mMappedBytes = bytes;
+            return map;
+        }
+        catch (...)
+        {
+            munmap(image, bytes);
+            throw;
+        }
+#else
+        (void)path;
+        throw std::runtime_error("hackmap::frozen_map needs mmap");
+#endif
     }
 
-    size_type
-    len_by_force_load(size_type minLoad)
-    const noexcept
+    frozen_map(frozen_map&& o)
+        : mTable(std::move(o.mTable))
+        , mArena(o.mArena)
+        , mMapped(o.mMapped)
+        , mMappedBytes(o.mMappedBytes)
     {
-        return size_type((100.0 / (double)MaxLoadFactor) * (double)minLoad);
+        o.mMapped = nullptr;
     }
 
-    void
-    update_load(size_type len)
+    frozen_map(const frozen_map&) = delete;
+    frozen_map& operator=(const frozen_map&) = delete;
+
+    ~frozen_map()
     {
-        mLoad = size_type(((double)MaxLoadFactor / 100.0) * (double)len);
-        if (mLoad > len)
+        // The table is not ours to walk or free.
+        mTable.set_moved_from();
+#ifdef HACKMAP_MMAP
+        if (mMapped)
         {
-            mLoad = len;
-        }
-        else if (mLoad < (len / 2))
-        {
-            mLoad = (len / 2);
+            munmap(mMapped, mMappedBytes);
         }
+#endif
     }
 
-    size_type
-    hash_key(const value_type& kv)
+    const_iterator
+    find(const key_type& k)
+    const
     {
-        return hasher::operator()(kv.first);
+        return { mTable.find(traits::query(mArena, k)), mArena };
     }
 
-    template <typename HashKey>
     size_type
-    hash_key(const HashKey& k)
+    count(const key_type& k)
+    const
     {
-        return hasher::operator()(k);
-        //return static_cast<hasher&>(*this)(k);
+        return mTable.count(traits::query(mArena, k));
     }
 
-    template <typename HashKey>
-    size_type
-    hash_key(const HashKey& k)
+    const_iterator
+    begin()
     const
     {
-        return hasher::operator()(k);
-        //return static_cast<const hasher&>(*this)(k);
+        return { mTable.cbegin(), mArena };
     }
 
-    template <typename LeftKey>
-    bool
-    compare_keys(const LeftKey& l, const value_type& r)
+    const_iterator
+    end()
     const noexcept
     {
-        return key_equal::operator()(l, r.first);
+        return { mTable.cend(), mArena };
     }
 
-    template <typename LeftKey, typename RightKey>
-    bool
-    compare_keys(const LeftKey& l, const RightKey& r)
+    size_type
+    size()
     const noexcept
     {
-        return key_equal::operator()(l, r);
-        //return static_cast<key_equal&>(*this)(l, r);
+        return mTable.size();
     }
 
-    size_type
-    hash_to_index(size_type hash)
+    bool
+    empty()
     const noexcept
     {
-        return hash & mMask;
+        return mTable.empty();
     }
 
-    template <typename IndexKey>
-    size_type
-    key_to_index(IndexKey&& k)
-    const noexcept
+private:
+    /** @return Start of the arena, or nullptr if bytes cannot hold one. */
+    static const char*
+    arena_of(const void* image, size_type bytes)
+    noexcept
     {
-        return hash_to_index(hash_key(k));
+        snapshot_header head;
+        if (bytes < sizeof(head))
+        {
+            return nullptr;
+        }
+        std::memcpy(&head, image, sizeof(head));
+        size_type at = sizeof(head) + size_type(head.bytes) + sizeof(uint64_t);
+        if (head.bytes > bytes || at > bytes)
+        {
+            return nullptr;
+        }
+        uint64_t length;
+        const char* arena = static_cast<const char*>(image) + at;
+        std::memcpy(&length, arena - sizeof(length), sizeof(length));
+        return length <= bytes - at ? arena : nullptr;
     }
 
-    size_type
-    index_dist(size_type istart, size_type iend)
+    /**
+     * @brief Check every block of an image's table, as load() does while
+     *        reading one, so find and iteration can trust it.
+     * @throw std::runtime_error if a check fails.
+     */
+    static void
+    check_table(typename table_type::block_type* block,
+                const snapshot_header& head)
     {
-        return ((iend + mLen) - istart) & mMask;
+        size_type words = table_type::summary_words(head.len);
+        std::vector<uint64_t> frees(words, 0);
+        std::vector<uint64_t> fulls(words, 0);
+        size_type count = 0;
+        bool bad = table_type::check_snapshot_blocks(block, head.len, 0,
+            head.len / detail::BLOCK_LEN, count, frees, fulls);
+        if (bad || count != head.size
+            || table_type::check_snapshot_tail(block, head.len, frees, fulls))
+        {
+            throw std::runtime_error("hackmap::frozen_map bad image");
+        }
     }
 
-    block_type*
-    get_block(size_type index)
+    /** @return True if every key lies in the arena (string keys). */
+    bool
+    keys_in_arena()
     const noexcept
     {
-        return block_type::get(mBlock, index);
+        uint64_t length;
+        std::memcpy(&length, mArena - sizeof(length), sizeof(length));
+        for (auto it = mTable.cbegin(); it != mTable.cend(); ++it)
+        {
+            if (!traits::in_arena(it->first, length))
+            {
+                return false;
+            }
+        }
+        return true;
     }
 
-    size_type
-    combine_index(size_type index, int isub)
-    const noexcept
+    /** @brief Point the table at the image's blocks after checking it. */
+    void
+    attach(const void* image, bool check)
     {
-        return block_type::construct_index(index, isub);
+        if (!mArena)
+        {
+            throw std::runtime_error("hackmap::frozen_map truncated image");
+        }
+        snapshot_header head;
+        std::memcpy(&head, image, sizeof(head));
+        if (std::memcmp(head.magic, "hackmap", 8) || 1 != head.version
+            || 1 != head.raw || head.layout != table_type::snapshot_layout()
+            || head.size > head.len
+            || reinterpret_cast<uintptr_t>(image)
+               % alignof(typename table_type::block_type))
+        {
+            throw std::runtime_error("hackmap::frozen_map bad image");
+        }
+        if (!head.len)
+        {
+            return;
+        }
+        if ((head.len & (head.len - 1))
+            || head.len < size_type(detail::BLOCK_LEN)
+            || head.bytes != table_type::total_memory_size(head.len))
+        {
+            throw std::runtime_error("hackmap::frozen_map bad image");
+        }
+
+        // The table and arena lengths were checked by arena_of().
+        auto block = reinterpret_cast<typename table_type::block_type*>(
+            const_cast<char*>(static_cast<const char*>(image) + sizeof(head)));
+        if (check)
+        {
+            check_table(block, head);
+        }
+        mTable.mBlock = block;
+        mTable.mSize = head.size;
+        mTable.mLen = head.len;
+        mTable.mMask = head.len - 1;
+        mTable.update_load(head.len);
+
+        if (check && !keys_in_arena())
+        {
+            mTable.set_moved_from();
+            throw std::runtime_error("hackmap::frozen_map bad image");
+        }
+
+        if (head.fingerprint != mTable.snapshot_fingerprint())
+        {
+            mTable.set_moved_from();
+            throw std::runtime_error("hackmap::frozen_map hash mismatch");
+        }
     }
 
-    uint8_t
-    hash_fragment(size_type hash)
-    const noexcept
+    table_type mTable;
+    const char* mArena;
+    void* mMapped = nullptr;
+    size_type mMappedBytes = 0;
+};
+
+/**
+ * @brief Read-only map over a minimal perfect hash of its keys.
+ *
+ * Built PTHash style: keys fall into buckets of about four, and each
+ * bucket, largest first, searches for a pilot that sends all of its keys
+ * to free slots. There are ~3% more slots than keys so the search stays
+ * short, and the keys landing past the end are remapped into the holes
+ * this leaves, so the entries are dense. A lookup reads one pilot and one
+ * entry (rarely one remap) and compares one key; misses too. Memory is
+ * the entries plus ~0.6 bytes per key.
+ */
+template <typename Key,
+          typename T,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>
+          >
+class perfect_map: private Hash, private Pred
+{
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<key_type, mapped_type>;
+    using hasher = Hash;
+    using key_equal = Pred;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+
+    /**
+     * @brief Build over the pairs [first, last), whose keys are unique.
+     * @throw std::runtime_error if two keys hash alike in all 64 bits.
+     */
+    template <typename InputIt>
+    perfect_map(InputIt first, InputIt last,
+                const hasher& hash = hasher(),
+                const key_equal& equal = key_equal())
+        : hasher(hash), key_equal(equal)
     {
-        return hash >> ((sizeof(size_type)*8) - 6);
+        std::vector<value_type> entries(first, last);
+        std::vector<uint64_t> hashes;
+        hashes.reserve(entries.size());
+        for (const auto& kv : entries)
+        {
+            hashes.push_back(uint64_t(hasher::operator()(kv.first)));
+        }
+
+        std::vector<uint32_t> slots;
+        for (uint64_t attempt = 0; !build(hashes, slots); ++attempt)
+        {
+            // Rare: some bucket found no pilot under this seed.
+            mSeed = detail::hash_int(attempt + 1, mSeed);
+        }
+
+        std::vector<uint32_t> order(entries.size());
+        for (size_type i = 0; i < entries.size(); ++i)
+        {
+            order[slots[i]] = uint32_t(i);
+        }
+        mEntries.reserve(entries.size());
+        for (uint32_t i : order)
+        {
+            mEntries.push_back(std::move(entries[i]));
+        }
     }
 
-    INLINE
-    size_type
-    leap(size_type ihead, size_type ifrom, bool& notrust)
-    const noexcept
+    const_iterator
+    find(const key_type& k)
+    const
     {
-        auto block = get_block(ifrom);
-        size_type index = (ifrom + block->get_leap(ifrom)) & mMask;
-        if (LIKELY(block->is_local(ifrom)))
+        if (mEntries.empty())
         {
-            notrust = false;
-            return index;
+            return end();
         }
-        else
+        uint64_t h = seeded(uint64_t(hasher::operator()(k)));
+        size_type slot = position(h, mPilot[reduce(h, mPilot.size())]);
+        if (slot >= mEntries.size())
         {
-            notrust = true;
-            return extended_leap(ihead, index, block->get_hash_as_link(ifrom));
+            slot = mRemap[slot - mEntries.size()];
         }
+        const_iterator it = mEntries.begin() + std::ptrdiff_t(slot);
+        return key_equal::operator()(it->first, k) ? it : end();
     }
 
-    /**
-     * @note Cannot compare subhash with "leap'd to" entry.
-     * @warn The reason this function works is because the maximum FIND
-     *       or leap value is >=16. This ensures that we start searching
-     *       outside the block of the leaped from entry and do not encounter
-     *       an infinite loop.
-     */
     size_type
-    extended_leap(size_type ihead, size_type ifrom, uint8_t findhash)
+    count(const key_type& k)
+    const
+    {
+        return find(k) != end() ? 1 : 0;
+    }
+
+    const_iterator
+    begin()
     const noexcept
     {
-        // Linear search through hashes.
-        // Use same subhash as leap entry for search efficiency.
-        findhash = block_type::set_link_hash(findhash);
+        return mEntries.begin();
+    }
 
-        // Iterate through every slot in the table starting at the leap point.
-        for (;;)
-        {
-            auto block = get_block(ifrom);
-            search_map map = block->find(findhash);
-            // For each entry in the map.
-            while (map.has())
-            {
-                // Discover the index that we're jumping to and test it
-                // to see if it is part of the same linked list.
-                int isub = map.next();
-                size_type iheadtest =
-                    key_to_index(block->get_value(isub).first);
-                if (ihead == iheadtest)
-                {
-                    return combine_index(ifrom, isub);
-                }
-                map.clear(isub);
-            }
+    const_iterator
+    end()
+    const noexcept
+    {
+        return mEntries.end();
+    }
 
-            ifrom = (ifrom + BLOCK_LEN) & mMask;
-        }
+    size_type
+    size()
+    const noexcept
+    {
+        return mEntries.size();
     }
 
-    /** @return True if we need to grow; false otherwise. */
     bool
-    needToGrow()
+    empty()
     const noexcept
     {
-        return mSize >= mLoad;
+        return mEntries.empty();
     }
 
-    /** @brief Grow the map. */
-    void
-    grow()
+    /** @return Bytes held: entries, pilots, and remapped slots. */
+    size_type
+    memory_usage()
+    const noexcept
     {
-        size_type newLen = mLen * 2;
+        return sizeof(*this) + mEntries.capacity() * sizeof(value_type)
+               + mPilot.capacity() * sizeof(uint16_t)
+               + mRemap.capacity() * sizeof(uint32_t);
+    }
 
-        if (UNLIKELY(newLen < mLen))
-        {
-            throw std::overflow_error("hackmap::unordered_map size overflow");
-        }
+private:
+    /** Keys per bucket, on average. */
+    static constexpr size_type BUCKET_KEYS = 4;
 
-        resize_to(newLen);
+    /** Pilots tried per bucket before giving up on the seed (10M keys
+     *  need under 7000). */
+    static constexpr uint32_t MAX_PILOT = uint32_t(1) << 16;
+
+    /** @return h scaled onto [0, n). */
+    static size_type
+    reduce(uint64_t h, uint64_t n)
+    noexcept
+    {
+        detail::wymum(h, n);
+        return size_type(n);
     }
 
-    /** @return Smallest power of 2 >= n. */
+    /** @return h mixed with mSeed; a bijection, so it keeps h unique. */
+    uint64_t
+    seeded(uint64_t h)
+    const noexcept
+    {
+        h = (h ^ mSeed) * 0x9E3779B97F4A7C15ULL;
+        return h ^ (h >> 29);
+    }
+
+    /** @return The slot of seeded hash h under pilot. */
     size_type
-    to_power_2(size_type n)
+    position(uint64_t h, uint32_t pilot)
+    const noexcept
+    {
+        return reduce((h ^ (pilot * 0x9E3779B97F4A7C15ULL))
+                      * 0xbf58476d1ce4e5b9ULL, mSlotCount);
+    }
+
+    /**
+     * @brief Find a pilot for every bucket and remap the slots past the
+     *        entries; slots[i] is then the entry index of key i.
+     * @return false if some bucket ran out of pilots under mSeed.
+     * @throw std::runtime_error if two raw hashes are equal.
+     */
+    bool
+    build(const std::vector<uint64_t>& raw, std::vector<uint32_t>& slots)
     {
+        size_type n = raw.size();
+        if (n > size_type(UINT32_MAX) - (n >> 6) - 1)
+        {
+            throw std::length_error("hackmap::perfect_map too many keys");
+        }
+        mSlotCount = n + (n >> 5) + 1;
+        mPilot.assign(n ? n / BUCKET_KEYS + 1 : 0, 0);
+        mRemap.assign(mSlotCount - n, 0);
+        slots.assign(n, 0);
         if (!n)
         {
-            return 1;
+            return true;
         }
 
-        if (!(n & (n - 1)))
+        std::vector<uint64_t> hashes(n);
+        for (size_type i = 0; i < n; ++i)
         {
-            return n;
+            hashes[i] = seeded(raw[i]);
         }
 
-        if (n > MAX_SIZE)
+        // Keys grouped by bucket, then buckets ordered largest first.
+        size_type buckets = mPilot.size();
+        std::vector<uint32_t> start(buckets + 1, 0);
+        for (uint64_t h : hashes)
         {
-            return MAX_SIZE;
+            ++start[reduce(h, buckets) + 1];
         }
-
-        size_type p = 1;
-
-        while (p < n)
+        size_type largest = 0;
+        for (size_type b = 0; b < buckets; ++b)
         {
-            p <<= 1;
+            largest = std::max(largest, size_type(start[b + 1]));
+            start[b + 1] += start[b];
+        }
+        // Hashes are copied in bucket order, as the search reads them
+        // many times over.
+        std::vector<uint32_t> keys(n);
+        std::vector<uint64_t> grouped(n);
+        {
+            std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+            for (size_type i = 0; i < n; ++i)
+            {
+                uint32_t at = fill[reduce(hashes[i], buckets)]++;
+                keys[at] = uint32_t(i);
+                grouped[at] = hashes[i];
+            }
+        }
+        std::vector<uint32_t> bySize;
+        bySize.reserve(buckets);
+        for (size_type len = largest; len > 0; --len)
+        {
+            for (size_type b = 0; b < buckets; ++b)
+            {
+                if (start[b + 1] - start[b] == len)
+                {
+                    bySize.push_back(uint32_t(b));
+                }
+            }
         }
 
-        return p;
-    }
-
-    template <bool IsMostlyFull>
-    void
-    insert_move_from(block_type* b, size_type len)
-    {
-        size_type blen = len / BLOCK_LEN;
-
-        for (size_type i = 0; i < blen; ++i)
+        std::vector<uint64_t> taken((mSlotCount + 63) / 64, 0);
+        auto test = [&taken](size_type slot)
+                    { return (taken[slot / 64] >> (slot % 64)) & 1; };
+        auto flip = [&taken](size_type slot)
+                    { taken[slot / 64] ^= uint64_t(1) << (slot % 64); };
+        std::vector<uint32_t> placed(largest);
+        for (uint32_t b : bySize)
         {
-            block_type* block = b + i;
+            size_type first = start[b];
+            size_type len = start[b + 1] - first;
+            for (size_type i = first; i < first + len; ++i)
+            {
+                for (size_type j = first; j < i; ++j)
+                {
+                    // seeded() is a bijection, so raw hashes are equal.
+                    if (grouped[i] == grouped[j])
+                    {
+                        throw std::runtime_error(
+                            "hackmap::perfect_map keys hash alike");
+                    }
+                }
+            }
 
-            if (IsMostlyFull)
+            uint32_t pilot = 0;
+            for (;; ++pilot)
             {
-                // Gets us 1-2 nanoseconds off on map growth.
-                // Probably due to loop unrolling.
-                for (int sub = 0; sub < BLOCK_LEN; ++sub)
+                if (MAX_PILOT == pilot)
                 {
-                    if (LIKELY(!block->is_empty_by_subindex(sub)))
+                    return false;
+                }
+                size_type i = 0;
+                for (; i < len; ++i)
+                {
+                    size_type slot = position(grouped[first + i], pilot);
+                    if (test(slot))
                     {
-                        upsert<false, true, false>(
-                            std::move(block->get_value_by_subindex(sub)));
+                        break;
                     }
+                    flip(slot);
+                    placed[i] = uint32_t(slot);
+                }
+                if (i == len)
+                {
+                    break;
+                }
+                while (i)
+                {
+                    flip(placed[--i]);
                 }
             }
-            else
+            mPilot[b] = uint16_t(pilot);
+            for (size_type i = 0; i < len; ++i)
             {
-                // Not performance tested yet, but should give better
-                // performance when shrinking the map.
-                search_map m = block->find_full();
-                while (m.has())
+                slots[keys[first + i]] = placed[i];
+            }
+        }
+
+        // Every slot past n that holds a key leaves a hole below n.
+        size_type hole = 0;
+        for (size_type i = 0; i < n; ++i)
+        {
+            if (slots[i] >= n)
+            {
+                while (test(hole))
                 {
-                    int sub = m.next();
-                    upsert<false, true, false>(
-                        std::move(block->get_value_by_subindex(sub)));
-                    m.clear(sub);
+                    ++hole;
                 }
+                mRemap[slots[i] - n] = uint32_t(hole);
+                slots[i] = uint32_t(hole++);
             }
         }
+        return true;
     }
 
-    /** @brief Resize the map (bigger/smaller). */
-    NOINLINE
-    void
-    resize_to(size_type minLen)
+    std::vector<value_type> mEntries;
+    std::vector<uint16_t> mPilot;
+    std::vector<uint32_t> mRemap;
+    size_type mSlotCount = 0;
+    uint64_t mSeed = 0x9E3779B97F4A7C15ULL;
+};
+
+/**
+ * @brief Fixed map of up to N integer or enum keys, laid out at compile
+ *        time.
+ *
+ * Built from an initializer list in a constexpr context, so a
+ * static constexpr static_map lives in .rodata with no startup work and
+ * no heap. Keys hash with fibonacci_hash::mix to a home block of 16
+ * one-byte hash fragments (FF empty) and take its first free entry, or
+ * the next block's. find() searches a block with the same SSE2 match as
+ * Block::find and stops at the first block with an empty entry. Blocks
+ * are at most 7/8 full. T must be a literal type, e.g. an integer or
+ * const char*.
+ */
+template <typename Key, typename T, size_type N>
+class static_map
+{
+    static_assert(std::is_integral<Key>::value || std::is_enum<Key>::value,
+                  "hackmap: static_map keys must be integers or enums");
+
+    static constexpr size_type
+    block_count(size_type blocks = 1)
     {
-        size_type lenPwr2 = to_power_2(minLen);
+        return blocks * detail::BLOCK_LEN * 7 / 8 >= N
+               ? blocks : block_count(blocks * 2);
+    }
 
-        if (lenPwr2 < BLOCK_LEN)
-        {
-            lenPwr2 = BLOCK_LEN;
-        }
+    static constexpr size_type BLOCKS = block_count();
+    static constexpr size_type LEN = BLOCKS * detail::BLOCK_LEN;
+    static constexpr uint8_t EMPTY = 0xFF;
+
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<key_type, mapped_type>;
 
-        if (lenPwr2 == mLen)
+    /**
+     * @throw std::length_error on more than N pairs, or
+     *        std::invalid_argument on a repeated key (in a constant
+     *        expression, either is a compile error).
+     */
+    constexpr
+    static_map(std::initializer_list<value_type> il)
+    {
+        for (size_type i = 0; i < LEN; ++i)
         {
-            return;
+            mHash[i] = EMPTY;
         }
-
-        if (lenPwr2 < minLen || lenPwr2 < mSize)
+        if (il.size() > N)
         {
-            throw std::overflow_error("hackmap::unordered_map size overflow");
+            throw std::length_error("hackmap::static_map too many keys");
         }
-
-        block_type* oldBlock = mBlock;
-        size_type oldLen = mLen;
-
-        mBlock = allocate_blocks(lenPwr2);
-        mLen = lenPwr2;
-        mMask = lenPwr2 - 1;
-        update_load(mLen);
-
-        if (reinterpret_cast<block_type*>(&NULL_BLOCK) == oldBlock)
+        for (const value_type& kv : il)
         {
-            return;
+            size_type hash = hash_key(kv.first);
+            size_type index = (hash & (BLOCKS - 1)) * detail::BLOCK_LEN;
+            for (;; index = (index + 1) & (LEN - 1))
+            {
+                if (EMPTY == mHash[index])
+                {
+                    break;
+                }
+                if (kv.first == mKey[index])
+                {
+                    throw std::invalid_argument(
+                        "hackmap::static_map repeated key");
+                }
+            }
+            mHash[index] = fragment(hash);
+            mKey[index] = kv.first;
+            mValue[index] = kv.second;
+            ++mSize;
         }
+    }
 
-        if (mSize)
+    /** @return The value of k, or nullptr. */
+    const mapped_type*
+    find(const key_type& k)
+    const noexcept
+    {
+        size_type hash = hash_key(k);
+        uint8_t frag = fragment(hash);
+        size_type block = hash & (BLOCKS - 1);
+        for (size_type n = 0; n < BLOCKS; ++n)
         {
-            size_type oldSize = mSize;
-            mSize = 0;
-            if (double(oldSize) > (double(oldLen)/2.0))
+            const uint8_t* hashes = mHash + block * detail::BLOCK_LEN;
+            detail::search_map found = detail::block_match(hashes, frag);
+            while (found.has())
             {
-                insert_move_from<true>(oldBlock, oldLen);
+                int i = found.next();
+                size_type index = block * detail::BLOCK_LEN + i;
+                if (k == mKey[index])
+                {
+                    return &mValue[index];
+                }
+                found.clear(i);
             }
-            else
+            if (detail::block_match(hashes, EMPTY))
             {
-                insert_move_from<false>(oldBlock, oldLen);
+                break;
             }
+            block = (block + 1) & (BLOCKS - 1);
         }
-
-        deallocate_blocks(oldBlock, oldLen);
+        return nullptr;
     }
 
-    /** @return Needed bytes for table (not sentinel). */
     size_type
-    memory_size(size_type len)
+    count(const key_type& k)
     const noexcept
     {
-        return sizeof(block_type) * (len / BLOCK_LEN);
+        return find(k) ? 1 : 0;
     }
 
-    /** @return Total memory size for deallocation. */
-    size_type
-    total_memory_size(size_type len)
+    /** @throw std::out_of_range if k is absent. */
+    const mapped_type&
+    at(const key_type& k)
+    const
     {
-        return memory_size(len) + block_type::sentinel_memory_size();
+        const mapped_type* v = find(k);
+        if (!v)
+        {
+            throw std::out_of_range("hackmap::static_map::at");
+        }
+        return *v;
     }
 
-    /** @brief Allocate and initialize memory. */
-    block_type*
-    allocate_blocks(size_type len)
+    constexpr size_type
+    size()
+    const noexcept
     {
-        size_type memory = memory_size(len);
-        size_type smemory = block_type::sentinel_memory_size();
-        unsigned char *p = allocator_traits::allocate(*this, memory + smemory);
-        block_type::fill_empty(p, memory);
-        block_type::fill_sentinel(p + memory);
-        block_type* b = reinterpret_cast<block_type*>(p);
-        return b;
+        return mSize;
     }
 
-    /** @brief Free our memory. */
-    void
-    deallocate_blocks(block_type* b, size_type len)
+    constexpr bool
+    empty()
+    const noexcept
     {
-        if (reinterpret_cast<block_type*>(&NULL_BLOCK) != b)
-        {
-            size_type memory = total_memory_size(len);
-            allocator_traits::deallocate(*this,
-                 reinterpret_cast<typename allocator_traits::pointer>(b),
-                 memory);
-        }
+        return !mSize;
     }
 
-    /** @brief Call destructor on every value. */
+    /** @brief Call fn(key, value) for each entry, in block order. */
+    template <typename Fn>
     void
-    destroy_values()
-    noexcept
+    for_each(Fn fn)
+    const
     {
-        iterator start = begin();
-        const_iterator stop = cend();
-
-        while (start != stop)
+        for (size_type i = 0; i < LEN; ++i)
         {
-            allocator_traits::destroy(*this, &(*start));
-            ++start;
+            if (EMPTY != mHash[i])
+            {
+                fn(mKey[i], mValue[i]);
+            }
         }
     }
 
-    /** @brief Set every entry to empty. */
-    void
-    clear_data()
+private:
+    static constexpr size_type
+    hash_key(const key_type& k)
     noexcept
     {
-        size_type memory = memory_size(mLen);
-        block_type::fill_empty(reinterpret_cast<unsigned char *>(mBlock),
-                               memory);
+        return fibonacci_hash<Key>::mix(size_type(k));
     }
 
-    /** @brief Set the state for the moved-from object. */
-    void
-    set_moved_from()
+    /** @return The top 7 bits, so never EMPTY. */
+    static constexpr uint8_t
+    fragment(size_type hash)
     noexcept
     {
-        mBlock = reinterpret_cast<block_type*>(&NULL_BLOCK);
-        mSize = 0;
-        mLoad = 0;
-        mLen = 0;
-        mMask = 0;
+        return uint8_t(hash >> (sizeof(size_type) * 8 - 7));
     }
-};
-
-
-} /* namespace detail */
 
-template <typename Key,
-          typename T,
-          typename Hash = fibonacci_hash<Key>,
-          typename Pred = std::equal_to<Key>,
-          typename Alloc = std::allocator<std::pair<Key, T> >
-          >
-class unordered_map
-    : public detail::unordered_map 
-             <97,
-              Key,
-              T,
-              Hash,
-              Pred,
-              typename std::allocator_traits<Alloc>::template
-                       rebind_alloc<unsigned char>
-              >
-{
+    alignas(16) uint8_t mHash[LEN] = {};
+    key_type mKey[LEN] = {};
+    mapped_type mValue[LEN] = {};
+    size_type mSize = 0;
 };
 
 
 
+
 } /* namespace hackmap */
 
 
@@ -0,0 +1,580 @@
+/*******************************************************************************
+ * Copyright (c) 2019 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * @file hackmap_query.hpp
+ * @brief Hash join and group-by over hackmap tables, threaded with
+ *        std::thread (so link with -pthread). Kept apart so hackmap.hpp
+ *        itself needs no threading.
+ */
+
+#ifndef HACKMAP_QUERY_H
+#define HACKMAP_QUERY_H
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "hackmap.hpp"
+
+namespace hackmap
+{
+
+/**
+ * @brief Equi-join: index the smaller input once, then stream the larger.
+ *
+ * build() reserves once and maps each key to a build row; further
+ * rows with the same key chain through a next array (only read for
+ * such keys), so duplicate keys on either side join fully. probe()
+ * hashes a batch of rows, prefetches their home entries, then looks
+ * them up, calling emit(build_row, probe_row) for every match (rows
+ * are offsets from the first iterator passed to build() and probe()).
+ *
+ * With partition_bits the rows are radix partitioned on hash bits the
+ * tables do not index by, into 2^partition_bits tables, each small
+ * enough to stay in cache while its rows are built or probed.
+ * probe() with threads > 1 splits the probe rows across threads; the
+ * tables are only read, but emit must be thread safe.
+ * Every table is a copy of one, so rows are hashed once with a single
+ * hasher (e.g. one seeded_hash seed) that every partition indexes by.
+ */
+template <typename Key,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>
+          >
+class hash_join
+{
+public:
+    using key_type = Key;
+    using table_type = detail::unordered_map<97, Key, size_type, Hash, Pred>;
+
+    /** Set on a row whose key has more rows, the next in mNext. */
+    static constexpr size_type MORE =
+        size_type(1) << (sizeof(size_type) * 8 - 1);
+    /** Rows hashed and prefetched ahead of their lookups. */
+    static constexpr size_type BATCH = 16;
+
+    explicit
+    hash_join(int partition_bits = 0, const Hash& hash = Hash())
+        : mBits(partition_bits)
+        , mTables(size_type(1) << partition_bits, table_type(0, hash))
+    {}
+
+    /** @brief Index rows [first, last), keyed by key_of(row). */
+    template <typename RandomIt, typename KeyOf>
+    void
+    build(RandomIt first, RandomIt last, KeyOf key_of)
+    {
+        size_type count = size_type(last - first);
+        for (auto& table : mTables)
+        {
+            table.clear();
+        }
+        mNext.assign(count, 0);
+
+        std::vector<size_type> rows = partition(first, count, key_of);
+
+        size_type start = 0;
+        for (size_type p = 0; p < mTables.size(); ++p)
+        {
+            size_type stop = mOffsets[p + 1];
+            table_type& table = mTables[p];
+            table.reserve(stop - start);
+            for (size_type i = start; i < stop; ++i)
+            {
+                size_type row = rows[i];
+                auto it = table.insert({ key_of(first[row]), row });
+                if (!it.second)
+                {
+                    mNext[row] = it.first->second;
+                    it.first->second = row | MORE;
+                }
+            }
+            start = stop;
+        }
+    }
+
+    /**
+     * @brief Join rows [first, last) against the build rows.
+     * @return Matched pairs emitted.
+     */
+    template <typename RandomIt, typename KeyOf, typename Emit>
+    size_type
+    probe(RandomIt first, RandomIt last, KeyOf key_of, Emit emit,
+          unsigned threads = 1)
+    const
+    {
+        size_type count = size_type(last - first);
+        if (threads <= 1 || count < threads * BATCH)
+        {
+            return probe_rows(first, 0, count, key_of, emit);
+        }
+
+        std::vector<std::thread> workers;
+        std::vector<size_type> matches(threads, 0);
+        size_type slice = count / threads;
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            size_type start = t * slice;
+            size_type stop = (t + 1 == threads) ? count : start + slice;
+            workers.emplace_back([&, t, start, stop]()
+            {
+                matches[t] = probe_rows(first, start, stop, key_of, emit);
+            });
+        }
+
+        size_type total = 0;
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            workers[t].join();
+            total += matches[t];
+        }
+        return total;
+    }
+
+    /** @return Build rows indexed. */
+    size_type
+    size()
+    const noexcept
+    {
+        return mNext.size();
+    }
+
+    /** @return Distinct build keys. */
+    size_type
+    keys()
+    const noexcept
+    {
+        size_type n = 0;
+        for (const auto& table : mTables)
+        {
+            n += table.size();
+        }
+        return n;
+    }
+
+    size_type
+    memory_usage()
+    const noexcept
+    {
+        size_type bytes = mNext.capacity() * sizeof(size_type);
+        for (const auto& table : mTables)
+        {
+            bytes += table.memory_usage();
+        }
+        return bytes;
+    }
+
+private:
+    size_type
+    partition_of(size_type hash)
+    const noexcept
+    {
+        // Above any index bits and below the fragment bits.
+        return (hash >> (sizeof(size_type) * 4)) & (mTables.size() - 1);
+    }
+
+    /**
+     * @return Row indexes grouped by partition, with partition p at
+     *         [mOffsets[p], mOffsets[p + 1]).
+     */
+    template <typename RandomIt, typename KeyOf>
+    std::vector<size_type>
+    partition(RandomIt first, size_type count, KeyOf& key_of)
+    {
+        std::vector<size_type> rows(count);
+        mOffsets.assign(mTables.size() + 1, 0);
+        if (!mBits)
+        {
+            mOffsets[1] = count;
+            for (size_type i = 0; i < count; ++i)
+            {
+                rows[i] = i;
+            }
+            return rows;
+        }
+
+        const table_type& hasher = mTables[0];
+        std::vector<size_type> hashes(count);
+        for (size_type i = 0; i < count; ++i)
+        {
+            hashes[i] = hasher.hash_of(key_of(first[i]));
+            ++mOffsets[partition_of(hashes[i]) + 1];
+        }
+        for (size_type p = 1; p <= mTables.size(); ++p)
+        {
+            mOffsets[p] += mOffsets[p - 1];
+        }
+
+        std::vector<size_type> fill(mOffsets.begin(), mOffsets.end() - 1);
+        for (size_type i = 0; i < count; ++i)
+        {
+            rows[fill[partition_of(hashes[i])]++] = i;
+        }
+        return rows;
+    }
+
+    /** @brief Probe rows [start, stop), partition by partition. */
+    template <typename RandomIt, typename KeyOf, typename Emit>
+    size_type
+    probe_rows(RandomIt first, size_type start, size_type stop,
+               KeyOf& key_of, Emit& emit)
+    const
+    {
+        size_type count = stop - start;
+        const table_type& hasher = mTables[0];
+
+        // (hash, row) grouped by partition; empty when there is only one.
+        std::vector<std::pair<size_type, size_type>> sorted;
+        if (mBits)
+        {
+            std::vector<size_type> hashes(count);
+            std::vector<size_type> fill(mTables.size() + 1, 0);
+            for (size_type i = 0; i < count; ++i)
+            {
+                hashes[i] = hasher.hash_of(key_of(first[start + i]));
+                ++fill[partition_of(hashes[i]) + 1];
+            }
+            for (size_type p = 1; p <= mTables.size(); ++p)
+            {
+                fill[p] += fill[p - 1];
+            }
+            sorted.resize(count);
+            for (size_type i = 0; i < count; ++i)
+            {
+                sorted[fill[partition_of(hashes[i])]++] = { hashes[i],
+                                                            start + i };
+            }
+        }
+
+        // Ring of rows hashed and prefetched BATCH lookups ahead.
+        size_type hashes[BATCH];
+        size_type rows[BATCH];
+        auto stage = [&](size_type i)
+        {
+            size_type slot = i % BATCH;
+            if (mBits)
+            {
+                hashes[slot] = sorted[i].first;
+                rows[slot] = sorted[i].second;
+            }
+            else
+            {
+                rows[slot] = start + i;
+                hashes[slot] = hasher.hash_of(key_of(first[start + i]));
+            }
+            mTables[partition_of(hashes[slot])].prefetch(hashes[slot]);
+        };
+
+        for (size_type i = 0; i < count && i < BATCH; ++i)
+        {
+            stage(i);
+        }
+
+        size_type matches = 0;
+        for (size_type i = 0; i < count; ++i)
+        {
+            size_type hash = hashes[i % BATCH];
+            size_type row = rows[i % BATCH];
+            if (i + BATCH < count)
+            {
+                stage(i + BATCH);
+            }
+
+            const table_type& table = mTables[partition_of(hash)];
+            auto it = table.find(key_of(first[row]), hash);
+            if (it != table.cend())
+            {
+                // Unique keys never touch mNext.
+                size_type r = it->second;
+                emit(r & ~MORE, row);
+                ++matches;
+                while (r & MORE)
+                {
+                    r = mNext[r & ~MORE];
+                    emit(r & ~MORE, row);
+                    ++matches;
+                }
+            }
+        }
+        return matches;
+    }
+
+    int mBits;
+    std::vector<table_type> mTables;
+    std::vector<size_type> mOffsets;
+    std::vector<size_type> mNext;
+};
+
+/** @brief Example aggregate for aggregator: row count and sum by key. */
+template <typename T>
+struct count_sum
+{
+    size_type count = 0;
+    T sum = T();
+
+    void
+    add(const T& value)
+    {
+        ++count;
+        sum += value;
+    }
+
+    void
+    merge(const count_sum& other)
+    {
+        count += other.count;
+        sum += other.sum;
+    }
+};
+
+/**
+ * @brief Group-by: fold rows into one Agg per distinct key.
+ *
+ * add() finds or inserts the key's Agg in a single probe, building
+ * Agg() only for a new key, then calls agg.add(args...). Each thread
+ * adds into its own tables, so no locks are taken; rows go to one of
+ * 2^partition_bits tables by hash bits the tables do not index by.
+ * merge() then folds every thread's partition p into thread 0's with
+ * agg.merge(other), one partition per worker, since no key can be in
+ * two partitions. Results are read after merge(). Every table is a
+ * copy of one, so all threads and partitions share a single hasher.
+ */
+template <typename Key,
+          typename Agg,
+          typename Hash = fibonacci_hash<Key>,
+          typename Pred = std::equal_to<Key>
+          >
+class aggregator
+{
+public:
+    using key_type = Key;
+    using mapped_type = Agg;
+    using table_type = detail::unordered_map<97, Key, Agg, Hash, Pred>;
+
+    explicit
+    aggregator(unsigned threads = 1, int partition_bits = 0,
+               const Hash& hash = Hash())
+        : mTables(threads ? threads : 1,
+                  std::vector<table_type>(size_type(1) << partition_bits,
+                                          table_type(0, hash)))
+    {}
+
+    /** @brief Fold a row into k's aggregate; only thread may use its tables. */
+    template <typename... Args>
+    void
+    add(unsigned thread, const key_type& k, Args&&... args)
+    {
+        std::vector<table_type>& tables = mTables[thread];
+        size_type hash = hash_of(k);
+        tables[partition_of(hash)].try_emplace_hashed(hash, k)
+            .first->second.add(std::forward<Args>(args)...);
+    }
+
+    /**
+     * @brief Fold every thread's tables into thread 0's.
+     * @note The other threads' tables are left empty.
+     */
+    void
+    merge()
+    {
+        size_type partitions = mTables[0].size();
+        unsigned workers = unsigned(std::min(size_type(mTables.size()),
+                                             partitions));
+        if (workers <= 1)
+        {
+            for (size_type p = 0; p < partitions; ++p)
+            {
+                merge_partition(p);
+            }
+            return;
+        }
+
+        std::vector<std::thread> pool;
+        for (unsigned w = 0; w < workers; ++w)
+        {
+            pool.emplace_back([this, w, workers, partitions]()
+            {
+                for (size_type p = w; p < partitions; p += workers)
+                {
+                    merge_partition(p);
+                }
+            });
+        }
+        for (auto& worker : pool)
+        {
+            worker.join();
+        }
+    }
+
+    /**
+     * @brief Aggregate rows [first, last) split across the threads, as
+     *        add(thread, key_of(row), value_of(row)), then merge().
+     */
+    template <typename RandomIt, typename KeyOf, typename ValueOf>
+    void
+    aggregate(RandomIt first, RandomIt last, KeyOf key_of, ValueOf value_of)
+    {
+        size_type count = size_type(last - first);
+        unsigned threads = unsigned(mTables.size());
+        auto rows = [&](unsigned t, size_type start, size_type stop)
+        {
+            for (size_type i = start; i < stop; ++i)
+            {
+                add(t, key_of(first[i]), value_of(first[i]));
+            }
+        };
+
+        if (threads <= 1 || count < threads)
+        {
+            rows(0, 0, count);
+        }
+        else
+        {
+            std::vector<std::thread> pool;
+            size_type slice = count / threads;
+            for (unsigned t = 0; t < threads; ++t)
+            {
+                size_type start = t * slice;
+                size_type stop = (t + 1 == threads) ? count : start + slice;
+                pool.emplace_back(rows, t, start, stop);
+            }
+            for (auto& worker : pool)
+            {
+                worker.join();
+            }
+        }
+        merge();
+    }
+
+    /** @return k's aggregate after merge(), or nullptr. */
+    const mapped_type*
+    find(const key_type& k)
+    const
+    {
+        const std::vector<table_type>& tables = mTables[0];
+        size_type hash = hash_of(k);
+        const table_type& table = tables[partition_of(hash)];
+        auto it = table.find(k, hash);
+        return it == table.cend() ? nullptr : &it->second;
+    }
+
+    /** @brief Call fn(key, agg) for every key after merge(). */
+    template <typename Fn>
+    void
+    for_each(Fn fn)
+    const
+    {
+        for (const auto& table : mTables[0])
+        {
+            for (const auto& kv : table)
+            {
+                fn(kv.first, kv.second);
+            }
+        }
+    }
+
+    /** @return Distinct keys after merge(). */
+    size_type
+    size()
+    const noexcept
+    {
+        size_type n = 0;
+        for (const auto& table : mTables[0])
+        {
+            n += table.size();
+        }
+        return n;
+    }
+
+    /** @brief Drop every aggregate, keeping each table's allocation. */
+    void
+    clear()
+    noexcept
+    {
+        for (auto& tables : mTables)
+        {
+            for (auto& table : tables)
+            {
+                table.clear();
+            }
+        }
+    }
+
+    size_type
+    memory_usage()
+    const noexcept
+    {
+        size_type bytes = 0;
+        for (const auto& tables : mTables)
+        {
+            for (const auto& table : tables)
+            {
+                bytes += table.memory_usage();
+            }
+        }
+        return bytes;
+    }
+
+private:
+    size_type
+    partition_of(size_type hash)
+    const noexcept
+    {
+        // Above any index bits and below the fragment bits.
+        return (hash >> (sizeof(size_type) * 4)) & (mTables[0].size() - 1);
+    }
+
+    /** @return Hash of k, the same in every thread's partition tables. */
+    size_type
+    hash_of(const key_type& k)
+    const
+    {
+        return mTables[0][0].hash_of(k);
+    }
+
+    void
+    merge_partition(size_type p)
+    {
+        table_type& into = mTables[0][p];
+        for (size_type t = 1; t < mTables.size(); ++t)
+        {
+            table_type& from = mTables[t][p];
+            for (const auto& kv : from)
+            {
+                into.try_emplace_hashed(hash_of(kv.first), kv.first)
+                    .first->second.merge(kv.second);
+            }
+            from.clear();
+        }
+    }
+
+    // Per thread, then per partition.
+    std::vector<std::vector<table_type>> mTables;
+};
+
+
+} /* namespace hackmap */
+
+
+#endif /* HACKMAP_QUERY_H */
@@ -0,0 +1,1515 @@
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <fstream>
+#include <list>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "util.h"
+
+#include "hackmap.hpp"
+#include "hackmap_query.hpp"
+
+#ifndef FORCESEED
+#define FORCESEED (0)
+#endif
+
+#ifndef MAXLEN
+#define MAXLEN (1000000)
+#endif
+
+#ifndef BULKLEN
+#define BULKLEN (10000000)
+#endif
+
+#ifndef JOINBUILD
+#define JOINBUILD (1000000)
+#endif
+
+#ifndef JOINPROBE
+#define JOINPROBE (10000000)
+#endif
+
+#ifndef AGGROWS
+#define AGGROWS (10000000)
+#endif
+
+#ifndef AGGKEYS
+#define AGGKEYS (1000000)
+#endif
+
+#ifndef CACHELEN
+#define CACHELEN (100000)
+#endif
+
+#ifndef TTLLEN
+#define TTLLEN (1000000)
+#endif
+
+using namespace std;
+
+/**
+ * Benchmarks for hackmap specific features and storage policies.
+ * Each section prints one JSON object per configuration.
+ */
+
+static double
+now(void)
+{
+    struct timespec t;
+    if (clock_gettime(CLOCK_MONOTONIC, &t))
+    {
+        printf("Error getting time: %d, %s\n", errno, strerror(errno));
+        exit(errno);
+    }
+    return (double)t.tv_sec + (double)t.tv_nsec / 1000000000.0;
+}
+
+/** Key comparison that counts how often the map calls it. */
+struct counting_equal
+{
+    static size_t calls;
+
+    bool
+    operator()(const string& a, const string& b) const
+    {
+        ++calls;
+        return a == b;
+    }
+};
+
+size_t counting_equal::calls = 0;
+
+/** @return 64 octet key sharing a long prefix, so comparisons are costly. */
+static string
+long_key(int n)
+{
+    char tail[16];
+    snprintf(tail, sizeof(tail), "%010d", n);
+    return string(54, 'k') + tail;
+}
+
+template <typename Map>
+static void
+bench_fragment(const char *mode, const vector<string>& in,
+               const vector<string>& out)
+{
+    using block_type = typename Map::block_type;
+
+    Map m;
+    counting_equal::calls = 0;
+
+    double t0 = now();
+    for (const string& k : in)
+    {
+        m.emplace(k, 1);
+    }
+    double t1 = now();
+    size_t insertcmp = counting_equal::calls;
+
+    counting_equal::calls = 0;
+    size_t hits = 0;
+    for (const string& k : in)
+    {
+        hits += m.count(k);
+    }
+    double t2 = now();
+    size_t hitcmp = counting_equal::calls;
+
+    counting_equal::calls = 0;
+    size_t misses = 0;
+    for (const string& k : out)
+    {
+        misses += 1 - m.count(k);
+    }
+    double t3 = now();
+    size_t misscmp = counting_equal::calls;
+
+    assert(hits == in.size() && misses == out.size() && "Fail: lookups");
+
+    size_t bytes = sizeof(block_type) * (m.bucket_count() / hackmap::detail::BLOCK_LEN);
+    printf("{\"bench\":\"fragment\",\"mode\":\"%s\",\"hashbits\":%d,"
+           "\"len\":%zu,\"bytes\":%zu,\"overhead\":%zu,"
+           "\"cmp\":{\"insert\":%zu,\"hit\":%zu,\"miss\":%zu},"
+           "\"seconds\":{\"insert\":%f,\"hit\":%f,\"miss\":%f}}\n",
+           mode, block_type::HASH_BITS, m.size(), bytes,
+           sizeof(block_type) / hackmap::detail::BLOCK_LEN
+               - sizeof(typename Map::value_type),
+           insertcmp, hitcmp, misscmp, t1 - t0, t2 - t1, t3 - t2);
+}
+
+#define EDGEMAX (1 << 16)
+
+/** Same idea as prove.cpp: small keys index directly, the rest collide. */
+struct edge_hash
+{
+    size_t
+    operator()(const int& k) const
+    {
+        size_t h = k;
+        if (k >= EDGEMAX)
+        {
+            h = 3 | (size_t(k) << ((sizeof(size_t) * 8) - 6));
+        }
+
+        return h;
+    }
+};
+
+/**
+ * Fill the direct hits, then add colliding keys in batches and report
+ * each batch's cost, so a recovery after reseeding shows up.
+ */
+template <typename Policy>
+static void
+bench_guard(const char *mode, int edges)
+{
+    using map_type = hackmap::unordered_map<int, int, edge_hash,
+        std::equal_to<int>, allocator<pair<const int, int>>, Policy>;
+    const int batch = edges / 10;
+    map_type m;
+    for (int i = 0; i < EDGEMAX; ++i)
+    {
+        m.emplace(i, 1);
+    }
+
+    printf("{\"bench\":\"guard\",\"mode\":\"%s\",\"len\":%d,\"nsperbatch\":[",
+           mode, edges);
+    double t0 = now();
+    for (int b = 0; b < edges; b += batch)
+    {
+        double b0 = now();
+        for (int i = b; i < b + batch; ++i)
+        {
+            m.emplace(EDGEMAX + i, 1);
+        }
+        printf("%s%.1f", b ? "," : "", (now() - b0) * 1e9 / batch);
+    }
+    double t1 = now();
+    size_t hits = 0;
+    for (int i = 0; i < edges; ++i)
+    {
+        hits += m.count(EDGEMAX + i);
+    }
+    double t2 = now();
+
+    assert(hits == size_t(edges) && "Fail: guard find");
+    printf("],\"reseeds\":%zu,\"ns\":{\"insert\":%f,\"hit\":%f}}\n",
+           m.reseed_count(), (t1 - t0) * 1e9 / edges, (t2 - t1) * 1e9 / edges);
+}
+
+/**
+ * Fill every entry with a direct hit, then empty one entry per gap and
+ * chain colliding keys through them, so each link is gap entries long.
+ */
+template <typename Map>
+static void
+bench_leap(const char *mode, int gap, int rounds)
+{
+    Map m;
+
+    for (int i = 0; i < EDGEMAX; ++i)
+    {
+        m.emplace(i, i);
+    }
+
+    vector<int> edges;
+    for (int i = 3; i < EDGEMAX; i += gap)
+    {
+        m.erase(i);
+        edges.push_back(EDGEMAX + i);
+    }
+
+    double t0 = now();
+    for (int k : edges)
+    {
+        m.emplace(k, k);
+    }
+    double t1 = now();
+
+    size_t found = 0;
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (int k : edges)
+        {
+            found += m.count(k);
+        }
+    }
+    double t2 = now();
+
+    assert(found == edges.size() * rounds && "Fail: find edges");
+
+    double lookups = double(edges.size()) * double(rounds);
+    printf("{\"bench\":\"leap\",\"mode\":\"%s\",\"gap\":%d,"
+           "\"chain\":%zu,\"leapbytes\":%zu,"
+           "\"seconds\":{\"insert\":%f,\"lookup\":%f},"
+           "\"nsperlookup\":%f}\n",
+           mode, gap, edges.size(), sizeof(typename Map::leap_type),
+           t1 - t0, t2 - t1, ((t2 - t1) * 1e9) / lookups);
+
+    hackmap::unordered_map_stats stats;
+    m.gather_stats(stats);
+    stats.print();
+}
+
+template <typename Policy>
+using edge_map = hackmap::detail::unordered_map<100, int, int, edge_hash,
+                                                equal_to<int>,
+                                                allocator<unsigned char>,
+                                                Policy>;
+
+/** Pairs of keys share a head, so a random insert order builds a cluster. */
+struct pair_hash
+{
+    size_t
+    operator()(const int& k) const
+    {
+        return size_t(k) >> 1;
+    }
+};
+
+/**
+ * Insert keys into a table reserved for all of them (no growth) and time
+ * the inserts that take the load from 90% to 97%.
+ */
+template <typename Map>
+static void
+bench_high_load(const char *mode, const char *keys, const vector<int>& n)
+{
+    Map m;
+    m.reserve(n.size());
+
+    size_t start = size_t(double(m.bucket_count()) * 0.90);
+    if (start > n.size())
+    {
+        start = n.size();
+    }
+
+    double t0 = now();
+    for (size_t i = 0; i < start; ++i)
+    {
+        m.emplace(n[i], 0);
+    }
+    double t1 = now();
+    for (size_t i = start; i < n.size(); ++i)
+    {
+        m.emplace(n[i], 0);
+    }
+    double t2 = now();
+
+    assert(m.size() == n.size() && "Fail: high load size");
+
+    printf("{\"bench\":\"highload\",\"mode\":\"%s\",\"keys\":\"%s\","
+           "\"len\":%zu,\"load\":%f,"
+           "\"seconds\":{\"tolow\":%f,\"tohigh\":%f},"
+           "\"nsperinsert\":{\"tolow\":%f,\"tohigh\":%f}}\n",
+           mode, keys, m.size(), m.load_factor(), t1 - t0, t2 - t1,
+           ((t1 - t0) * 1e9) / double(start ? start : 1),
+           ((t2 - t1) * 1e9) / double(n.size() - start));
+}
+
+/**
+ * Fill a table to 97% (reserved, so no growth) and time lookups of which
+ * nine in ten miss.
+ */
+template <typename Map>
+static void
+bench_miss(const char *mode, const vector<int>& in, const vector<int>& query)
+{
+    Map m;
+    m.reserve(in.size());
+    for (int k : in)
+    {
+        m.emplace(k, 0);
+    }
+
+    size_t found = 0;
+    double t0 = now();
+    for (int k : query)
+    {
+        found += m.count(k);
+    }
+    double t1 = now();
+
+    printf("{\"bench\":\"miss\",\"mode\":\"%s\",\"len\":%zu,"
+           "\"load\":%f,\"lookups\":%zu,\"found\":%zu,\"seconds\":%f,"
+           "\"nsperlookup\":%f}\n",
+           mode, m.size(), m.load_factor(), query.size(), found, t1 - t0,
+           ((t1 - t0) * 1e9) / double(query.size()));
+}
+
+struct leap_summary_policy: public hackmap::wide_leap_policy
+{
+    static constexpr bool free_summary = true;
+};
+
+template <typename Policy>
+using fib_map = hackmap::detail::unordered_map<97, int, int,
+                                               hackmap::fibonacci_hash<int>,
+                                               equal_to<int>,
+                                               allocator<unsigned char>,
+                                               Policy>;
+
+template <typename Policy>
+using pair_map = hackmap::detail::unordered_map<97, int, int, pair_hash,
+                                                equal_to<int>,
+                                                allocator<unsigned char>,
+                                                Policy>;
+
+template <typename Map>
+static void
+time_iteration(const char *mode, const Map& m, int rounds)
+{
+    double t0 = now();
+    size_t sum = 0;
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (auto it = m.cbegin(); it != m.cend(); ++it)
+        {
+            sum += size_t(it->second);
+        }
+    }
+    double t1 = now();
+
+    assert(sum == m.size() * size_t(rounds) && "Fail: iterate");
+
+    printf("{\"bench\":\"iterate\",\"mode\":\"%s\",\"len\":%zu,"
+           "\"slots\":%zu,\"fill\":%f,\"seconds\":%f,"
+           "\"nsperentry\":%f}\n",
+           mode, m.size(), m.bucket_count(), m.load_factor(), t1 - t0,
+           ((t1 - t0) * 1e9) / double(m.size() * size_t(rounds)));
+}
+
+/** Fill to 90%, then erase down to 10% and 1% timing iteration at each. */
+template <typename Map>
+static void
+bench_iterate(const char *mode, const int *n, size_t slots)
+{
+    Map m;
+    m.reserve(size_t(double(slots) * 0.90));
+
+    size_t len = size_t(double(m.bucket_count()) * 0.90);
+    for (size_t i = 0; i < len; ++i)
+    {
+        m.emplace(n[i], 1);
+    }
+    time_iteration(mode, m, 10);
+
+    const double fills[] = { 0.10, 0.01, 0.001 };
+    size_t ierase = 0;
+    for (double fill : fills)
+    {
+        size_t keep = size_t(double(m.bucket_count()) * fill);
+        for (; m.size() > keep; ++ierase)
+        {
+            m.erase(n[ierase]);
+        }
+        time_iteration(mode, m, 10);
+    }
+}
+
+enum build_e
+{
+    BUILD_INSERT = 0,  // insert(first, last) growing as needed.
+    BUILD_RESERVE = 1, // reserve then insert(first, last).
+    BUILD_BULK = 2,    // bulk_insert(first, last).
+};
+
+template <typename Map>
+static void
+bench_build(const char *mode, build_e build, const vector<pair<int, int>>& v)
+{
+    double t0 = now();
+    {
+        Map m;
+        switch (build)
+        {
+            case BUILD_INSERT:
+                m.insert(v.begin(), v.end());
+                break;
+            case BUILD_RESERVE:
+                m.reserve(v.size());
+                m.insert(v.begin(), v.end());
+                break;
+            case BUILD_BULK:
+                m.bulk_insert(v.begin(), v.end());
+                break;
+        }
+        double t1 = now();
+
+        assert(m.size() == v.size() && "Fail: build size");
+
+        printf("{\"bench\":\"build\",\"mode\":\"%s\",\"len\":%zu,"
+               "\"slots\":%zu,\"seconds\":%f,\"nsperentry\":%f}\n",
+               mode, m.size(), m.bucket_count(), t1 - t0,
+               ((t1 - t0) * 1e9) / double(v.size()));
+    }
+}
+
+/**
+ * Reload a map from a file: a text dump reinserted line by line, the
+ * save(os, write_value) stream reinserted, and save(os) read in place.
+ */
+static void
+bench_snapshot(const vector<pair<int, int>>& v)
+{
+    using map = hackmap::unordered_map<int, int>;
+    const char *path = "bench.snapshot";
+    map m;
+    m.bulk_insert(v.begin(), v.end());
+
+    auto write_value = [](ostream& os, const map::value_type& kv)
+    {
+        os.write(reinterpret_cast<const char*>(&kv.first), sizeof(int));
+        os.write(reinterpret_cast<const char*>(&kv.second), sizeof(int));
+    };
+    auto read_value = [](istream& is)
+    {
+        pair<int, int> kv;
+        is.read(reinterpret_cast<char*>(&kv.first), sizeof(int));
+        is.read(reinterpret_cast<char*>(&kv.second), sizeof(int));
+        return kv;
+    };
+
+    const char *modes[] = { "text", "stream", "raw" };
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        double t0 = now();
+        {
+            ofstream os(path, ios::binary);
+            if (0 == mode)
+            {
+                for (const auto& kv : m)
+                {
+                    os << kv.first << ' ' << kv.second << '\n';
+                }
+            }
+            else if (1 == mode)
+            {
+                m.save(os, write_value);
+            }
+            else
+            {
+                m.save(os);
+            }
+        }
+        double t1 = now();
+
+        map loaded;
+        {
+            ifstream is(path, ios::binary);
+            if (0 == mode)
+            {
+                // Without reserve, keys arriving in bucket order pile
+                // into the front half of each smaller table (minutes).
+                loaded.reserve(m.size());
+                int k;
+                int val;
+                while (is >> k >> val)
+                {
+                    loaded.insert({ k, val });
+                }
+            }
+            else if (1 == mode)
+            {
+                loaded.load(is, read_value);
+            }
+            else
+            {
+                loaded.load(is);
+            }
+        }
+        double t2 = now();
+
+        assert(loaded.size() == m.size() && "Fail: snapshot size");
+        assert(loaded.at(v[0].first) == v[0].second && "Fail: snapshot");
+        printf("{\"bench\":\"snapshot\",\"mode\":\"%s\",\"len\":%zu,"
+               "\"seconds\":{\"save\":%f,\"load\":%f}}\n",
+               modes[mode], m.size(), t1 - t0, t2 - t1);
+    }
+    remove(path);
+}
+
+/**
+ * Start serving lookups from a file: load(is) into a new table against
+ * frozen_map::open() mapping the image, each followed by a pass of finds.
+ */
+static void
+bench_frozen(const vector<pair<int, int>>& v)
+{
+    using frozen = hackmap::frozen_map<int, int>;
+    const char *path = "bench.frozen";
+    {
+        ofstream os(path, ios::binary);
+        frozen::write(os, v.begin(), v.end());
+    }
+
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        size_t found = 0;
+        double t0 = now();
+        double t1;
+        if (0 == mode)
+        {
+            hackmap::unordered_map<int, int> loaded;
+            ifstream is(path, ios::binary);
+            loaded.load(is);
+            t1 = now();
+            for (const auto& kv : v)
+            {
+                found += loaded.count(kv.first);
+            }
+        }
+        else
+        {
+            frozen mapped = frozen::open(path);
+            t1 = now();
+            for (const auto& kv : v)
+            {
+                found += mapped.count(kv.first);
+            }
+        }
+        double t2 = now();
+
+        assert(found == v.size() && "Fail: frozen find");
+        printf("{\"bench\":\"frozen\",\"mode\":\"%s\",\"len\":%zu,"
+               "\"seconds\":{\"open\":%f,\"find\":%f}}\n",
+               mode ? "mmap" : "load", v.size(), t1 - t0, t2 - t1);
+    }
+    remove(path);
+}
+
+/**
+ * Freeze a built map into a perfect_map and time a pass of hits (in
+ * random order, as v's order follows the live map's buckets) and a pass
+ * of misses against both.
+ */
+static void
+bench_freeze(const vector<pair<int, int>>& v)
+{
+    hackmap::unordered_map<int, int> live;
+    live.bulk_insert(v.begin(), v.end());
+    double t0 = now();
+    auto frozen = live.freeze();
+    double t1 = now();
+
+    vector<int> hits;
+    hits.reserve(v.size());
+    for (const auto& kv : v)
+    {
+        hits.push_back(kv.first);
+    }
+    std::mt19937 rng(1);
+    std::shuffle(hits.begin(), hits.end(), rng);
+
+    // Keys are i * 2654435761 for i < len, so i >= len misses.
+    auto miss = [](size_t i) { return int(uint32_t(i) * 2654435761U); };
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        size_t found = 0;
+        double t2 = now();
+        for (int k : hits)
+        {
+            found += mode ? frozen.count(k) : live.count(k);
+        }
+        double t3 = now();
+        for (size_t i = v.size(); i < 2 * v.size(); ++i)
+        {
+            found += mode ? frozen.count(miss(i)) : live.count(miss(i));
+        }
+        double t4 = now();
+
+        assert(found == v.size() && "Fail: freeze find");
+        printf("{\"bench\":\"freeze\",\"mode\":\"%s\",\"len\":%zu,"
+               "\"seconds\":{\"build\":%f,\"hit\":%f,\"miss\":%f},"
+               "\"bytes\":%zu}\n",
+               mode ? "perfect" : "live", v.size(), mode ? t1 - t0 : 0.0,
+               t3 - t2, t4 - t3,
+               mode ? frozen.memory_usage() : live.memory_usage());
+    }
+}
+
+enum join_e
+{
+    JOIN_LOOP = 0,  // unordered_map built with insert, probed with find.
+    JOIN_HASH = 1,  // hash_join with batched prefetching probes.
+};
+
+/** @return Probe key i: one in two matches a build key. */
+static int
+join_key(uint64_t i, size_t build)
+{
+    uint64_t x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 29;
+    return int(uint32_t(x % (2 * build)) * 2654435761U);
+}
+
+/**
+ * Join build rows against JOINPROBE generated rows, a million at a time
+ * so the probe side never has to fit in memory.
+ */
+static void
+bench_join(const char *mode, join_e join, int bits, unsigned threads,
+           const vector<pair<int, int>>& build)
+{
+    const size_t chunk = 1000000;
+    const size_t probes = JOINPROBE;
+    auto key_of = [](const pair<int, int>& r) { return r.first; };
+    vector<pair<int, int>> rows(chunk);
+    size_t matches = 0;
+    size_t checksum = 0;
+    double probetime = 0;
+
+    double t0 = now();
+    hackmap::unordered_map<int, size_t> map;
+    hackmap::hash_join<int> table(bits);
+    if (JOIN_LOOP == join)
+    {
+        for (size_t i = 0; i < build.size(); ++i)
+        {
+            map.insert({ build[i].first, i });
+        }
+    }
+    else
+    {
+        table.build(build.begin(), build.end(), key_of);
+    }
+    double t1 = now();
+
+    for (size_t base = 0; base < probes; base += chunk)
+    {
+        size_t n = probes - base < chunk ? probes - base : chunk;
+        rows.resize(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            rows[i] = { join_key(base + i, build.size()), int(i) };
+        }
+
+        double p0 = now();
+        if (JOIN_LOOP == join)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                auto it = map.find(rows[i].first);
+                if (it != map.end())
+                {
+                    checksum += it->second ^ i;
+                    ++matches;
+                }
+            }
+        }
+        else if (1 == threads)
+        {
+            matches += table.probe(rows.begin(), rows.end(), key_of,
+                                   [&checksum](size_t b, size_t p)
+                                   { checksum += b ^ p; });
+        }
+        else
+        {
+            std::atomic<size_t> sum(0);
+            matches += table.probe(rows.begin(), rows.end(), key_of,
+                                   [&sum](size_t b, size_t p)
+                                   {
+                                       sum.fetch_add(b ^ p,
+                                           std::memory_order_relaxed);
+                                   }, threads);
+            checksum += sum;
+        }
+        probetime += now() - p0;
+    }
+
+    assert(matches > probes / 4 && matches < probes * 3 / 4 && "Fail: join");
+    printf("{\"bench\":\"join\",\"mode\":\"%s\",\"build\":%zu,"
+           "\"probe\":%zu,\"bits\":%d,\"threads\":%u,\"matches\":%zu,"
+           "\"checksum\":%zu,\"ns\":{\"build\":%f,\"probe\":%f}}\n",
+           mode, build.size(), probes, bits, threads, matches, checksum,
+           (t1 - t0) * 1e9 / build.size(), probetime * 1e9 / probes);
+}
+
+enum agg_e
+{
+    AGG_STD = 0,        // std::unordered_map, agg = map[key] per row.
+    AGG_SUBSCRIPT = 1,  // hackmap::unordered_map, agg = map[key] per row.
+    AGG_FUSED = 2,      // hackmap::aggregator.
+};
+
+using agg_type = hackmap::count_sum<long>;
+
+/** @return rows keys out of keys distinct, uniform or Zipfian (s = 1). */
+static vector<pair<int, long>>
+agg_rows(size_t rows, size_t keys, bool zipf)
+{
+    vector<double> cdf(keys);
+    double total = 0;
+    for (size_t k = 0; k < keys; ++k)
+    {
+        total += zipf ? 1.0 / double(k + 1) : 1.0;
+        cdf[k] = total;
+    }
+
+    vector<pair<int, long>> v(rows);
+    for (size_t i = 0; i < rows; ++i)
+    {
+        double r = double(rand()) / (double(RAND_MAX) + 1.0) * total;
+        size_t k = size_t(upper_bound(cdf.begin(), cdf.end(), r) - cdf.begin());
+        // Scatter the ranks so hot keys are not neighbours.
+        v[i] = { int(uint32_t(k) * 2654435761U), long(i & 0xff) };
+    }
+    return v;
+}
+
+/** Count and sum the rows by key. */
+static void
+bench_aggregate(const char *mode, const char *keys, agg_e agg, int bits,
+                unsigned threads, const vector<pair<int, long>>& v)
+{
+    size_t groups = 0;
+    long sum = 0;
+
+    double t0 = now();
+    if (AGG_STD == agg)
+    {
+        std::unordered_map<int, agg_type> map;
+        for (const auto& r : v)
+        {
+            map[r.first].add(r.second);
+        }
+        groups = map.size();
+        for (const auto& kv : map)
+        {
+            sum += kv.second.sum;
+        }
+    }
+    else if (AGG_SUBSCRIPT == agg)
+    {
+        hackmap::unordered_map<int, agg_type> map;
+        for (const auto& r : v)
+        {
+            map[r.first].add(r.second);
+        }
+        groups = map.size();
+        for (const auto& kv : map)
+        {
+            sum += kv.second.sum;
+        }
+    }
+    else
+    {
+        hackmap::aggregator<int, agg_type> a(threads, bits);
+        a.aggregate(v.begin(), v.end(),
+                    [](const pair<int, long>& r) { return r.first; },
+                    [](const pair<int, long>& r) { return r.second; });
+        groups = a.size();
+        a.for_each([&sum](int, const agg_type& g) { sum += g.sum; });
+    }
+    double t1 = now();
+
+    printf("{\"bench\":\"aggregate\",\"mode\":\"%s\",\"keys\":\"%s\","
+           "\"rows\":%zu,\"groups\":%zu,\"bits\":%d,\"threads\":%u,"
+           "\"sum\":%ld,\"seconds\":%f,\"nsperrow\":%f}\n",
+           mode, keys, v.size(), groups, bits, threads, sum, t1 - t0,
+           (t1 - t0) * 1e9 / double(v.size()));
+}
+
+enum counter_e
+{
+    COUNTER_FIND = 0,    // find, then insert on a miss.
+    COUNTER_UPSERT = 1,  // upsert(k, factory, updater).
+};
+
+/** Count key occurrences, then count them back down, erasing at zero. */
+static void
+bench_counter(const char *mode, counter_e counter,
+              const vector<pair<int, long>>& v)
+{
+    hackmap::unordered_map<int, int> map;
+    auto release = [](int& c)
+    {
+        return --c ? hackmap::compute_action::keep
+                   : hackmap::compute_action::erase;
+    };
+
+    double t0 = now();
+    for (const auto& r : v)
+    {
+        if (COUNTER_FIND == counter)
+        {
+            auto it = map.find(r.first);
+            if (it != map.end())
+            {
+                ++it->second;
+            }
+            else
+            {
+                map.insert({ r.first, 1 });
+            }
+        }
+        else
+        {
+            map.upsert(r.first, [] { return 1; }, [](int& c) { ++c; });
+        }
+    }
+    size_t groups = map.size();
+    double t1 = now();
+    for (const auto& r : v)
+    {
+        if (COUNTER_FIND == counter)
+        {
+            auto it = map.find(r.first);
+            if (0 == --it->second)
+            {
+                map.erase(r.first);
+            }
+        }
+        else
+        {
+            map.compute(r.first, release);
+        }
+    }
+    double t2 = now();
+
+    assert(map.empty() && "Fail: counter");
+    printf("{\"bench\":\"counter\",\"mode\":\"%s\",\"rows\":%zu,"
+           "\"groups\":%zu,\"ns\":{\"up\":%f,\"down\":%f}}\n",
+           mode, v.size(), groups, (t1 - t0) * 1e9 / double(v.size()),
+           (t2 - t1) * 1e9 / double(v.size()));
+}
+
+/** The usual LRU: std::unordered_map into a std::list in use order. */
+struct lru_cache
+{
+    using list_type = list<pair<int, long>>;
+
+    explicit
+    lru_cache(size_t capacity)
+        : capacity(capacity)
+    {
+        index.reserve(capacity);
+    }
+
+    long*
+    get(int k)
+    {
+        auto it = index.find(k);
+        if (it == index.end())
+        {
+            return nullptr;
+        }
+        order.splice(order.begin(), order, it->second);
+        return &it->second->second;
+    }
+
+    void
+    put(int k, long v)
+    {
+        if (index.size() >= capacity)
+        {
+            index.erase(order.back().first);
+            order.pop_back();
+        }
+        order.emplace_front(k, v);
+        index[k] = order.begin();
+    }
+
+    size_t capacity;
+    list_type order;
+    std::unordered_map<int, list_type::iterator> index;
+};
+
+/** Look up every row's key, putting it on a miss. */
+template <typename Cache>
+static void
+bench_cache(const char *mode, const char *keys,
+            const vector<pair<int, long>>& v)
+{
+    Cache cache(CACHELEN);
+    size_t hits = 0;
+
+    double t0 = now();
+    for (const auto& r : v)
+    {
+        if (cache.get(r.first))
+        {
+            ++hits;
+        }
+        else
+        {
+            cache.put(r.first, r.second);
+        }
+    }
+    double t1 = now();
+
+    printf("{\"bench\":\"cache\",\"mode\":\"%s\",\"keys\":\"%s\","
+           "\"rows\":%zu,\"capacity\":%d,\"hitrate\":%f,\"nsperrow\":%f}\n",
+           mode, keys, v.size(), CACHELEN, double(hits) / double(v.size()),
+           (t1 - t0) * 1e9 / double(v.size()));
+}
+
+enum ttl_e
+{
+    TTL_PURGE = 0,  // unordered_map, expired entries purged every second.
+    TTL_SWEEP = 1,  // expiring_map, swept a block per put.
+};
+
+/** HTTP status codes to a small id, as a table known at compile time. */
+static constexpr hackmap::static_map<int, int, 24> STATUS_IDS{
+    { 100, 1 }, { 101, 2 }, { 200, 3 }, { 201, 4 }, { 202, 5 }, { 204, 6 },
+    { 206, 7 }, { 301, 8 }, { 302, 9 }, { 303, 10 }, { 304, 11 },
+    { 307, 12 }, { 308, 13 }, { 400, 14 }, { 401, 15 }, { 403, 16 },
+    { 404, 17 }, { 405, 18 }, { 409, 19 }, { 429, 20 }, { 500, 21 },
+    { 502, 22 }, { 503, 23 }, { 504, 24 } };
+
+/**
+ * Look up status codes, one in four unknown, in STATUS_IDS and in maps
+ * filled at startup with emplace (the time to fill them is reported).
+ */
+template <typename Map>
+static void
+bench_static(const char *mode, const vector<int>& codes)
+{
+    double t0 = now();
+    Map m;
+    STATUS_IDS.for_each([&m](int k, int v) { m.emplace(k, v); });
+    double t1 = now();
+    long sum = 0;
+    for (int k : codes)
+    {
+        auto it = m.find(k);
+        sum += it != m.end() ? it->second : 0;
+    }
+    double t2 = now();
+    printf("{\"bench\":\"static\",\"mode\":\"%s\",\"len\":%zu,"
+           "\"sum\":%ld,\"seconds\":{\"build\":%f,\"find\":%f}}\n",
+           mode, codes.size(), sum, t1 - t0, t2 - t1);
+}
+
+static void
+bench_static_map(const vector<int>& codes)
+{
+    double t1 = now();
+    long sum = 0;
+    for (int k : codes)
+    {
+        const int* v = STATUS_IDS.find(k);
+        sum += v ? *v : 0;
+    }
+    double t2 = now();
+    printf("{\"bench\":\"static\",\"mode\":\"static_map\",\"len\":%zu,"
+           "\"sum\":%ld,\"seconds\":{\"build\":%f,\"find\":%f}}\n",
+           codes.size(), sum, 0.0, t2 - t1);
+}
+
+struct payload
+{
+    char bytes[512];
+};
+
+/**
+ * Insert 512 octet values without reserving, grow with reserve for
+ * twice the buckets, then find every key: inline values move on each
+ * grow, node values stay in their slab.
+ */
+static const char*
+node_bytes(const hackmap::unordered_map<int, payload>& m, int k)
+{
+    return m.find(k)->second.bytes;
+}
+
+static const char*
+node_bytes(const hackmap::node_map<int, payload>& m, int k)
+{
+    return m.find(k)->bytes;
+}
+
+template <typename Map>
+static void
+bench_node(const char *mode, const int *n, size_t len)
+{
+    Map m;
+    double t0 = now();
+    for (size_t i = 0; i < len; ++i)
+    {
+        m[n[i]].bytes[0] = char(i);
+    }
+    double t1 = now();
+    m.reserve(2 * m.bucket_count());
+    double t2 = now();
+    long sum = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        sum += node_bytes(m, n[i])[0];
+    }
+    double t3 = now();
+    printf("{\"bench\":\"node\",\"mode\":\"%s\",\"len\":%zu,"
+           "\"sum\":%ld,\"memory\":%zu,"
+           "\"seconds\":{\"insert\":%f,\"reserve\":%f,\"find\":%f}}\n",
+           mode, m.size(), sum, m.memory_usage(), t1 - t0, t2 - t1, t3 - t2);
+}
+
+/**
+ * Steady state with TTLLEN entries living 10 seconds (ticks are
+ * milliseconds), so 10% expire per second: each millisecond puts
+ * TTLLEN / 10000 new keys and finds 9 times as many recent ones.
+ */
+static void
+bench_ttl(const char *mode, ttl_e ttl)
+{
+    const uint32_t life = 10000;
+    const size_t puts = TTLLEN / life;
+    const uint32_t warm = 2 * life;
+    const uint32_t ticks = 3 * life;
+    hackmap::unordered_map<int, pair<long, uint32_t>> map;
+    hackmap::expiring_map<int, long> expiring(life);
+    vector<int> dead;
+    uint64_t next = 0;
+    uint64_t rng = 1;
+    size_t found = 0;
+    double worst = 0;
+    double t0 = 0;
+
+    for (uint32_t t = 0; t < ticks; ++t)
+    {
+        if (warm == t)
+        {
+            t0 = now();
+        }
+        double s0 = now();
+
+        if (TTL_PURGE == ttl && 0 == t % 1000)
+        {
+            for (const auto& kv : map)
+            {
+                if (int32_t(kv.second.second - t) <= 0)
+                {
+                    dead.push_back(kv.first);
+                }
+            }
+            for (int k : dead)
+            {
+                map.erase(k);
+            }
+            dead.clear();
+        }
+        expiring.tick(t);
+
+        for (size_t i = 0; i < puts; ++i, ++next)
+        {
+            int k = int(uint32_t(next) * 2654435761U);
+            if (TTL_PURGE == ttl)
+            {
+                map[k] = { long(next), t + life };
+            }
+            else
+            {
+                expiring.put(k, long(next));
+            }
+
+            for (int f = 0; f < 9; ++f)
+            {
+                rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint64_t back = (rng >> 33) % (puts * life);
+                int key = int(uint32_t(next - (back < next ? back : 0))
+                              * 2654435761U);
+                if (TTL_PURGE == ttl)
+                {
+                    auto it = map.find(key);
+                    found += (it != map.end()
+                              && int32_t(it->second.second - t) > 0);
+                }
+                else
+                {
+                    found += !!expiring.find(key);
+                }
+            }
+        }
+
+        double s1 = now();
+        if (t >= warm && s1 - s0 > worst)
+        {
+            worst = s1 - s0;
+        }
+    }
+    double t1 = now();
+
+    size_t ops = size_t(ticks - warm) * puts * 10;
+    printf("{\"bench\":\"ttl\",\"mode\":\"%s\",\"live\":%zu,"
+           "\"held\":%zu,\"found\":%zu,\"nsperop\":%f,\"worstms\":%f}\n",
+           mode, size_t(TTLLEN),
+           TTL_PURGE == ttl ? map.size() : expiring.size(), found,
+           (t1 - t0) * 1e9 / double(ops), worst * 1e3);
+}
+
+/**
+ * @return Keys that fibonacci_hash<uint64_t> sends to one head,
+ * found by running the hash backwards.
+ */
+static vector<uint64_t>
+adversarial_keys(size_t count)
+{
+    using fib = hackmap::fibonacci_hash<uint64_t>;
+    // Newton iteration for the inverse of the odd multiplier mod 2**64.
+    uint64_t inv = fib::FIB;
+    for (int i = 0; i < 6; ++i)
+    {
+        inv *= 2 - fib::FIB * inv;
+    }
+
+    vector<uint64_t> keys;
+    for (size_t i = 1; i <= count; ++i)
+    {
+        uint64_t h = uint64_t(i) << 32;
+        uint64_t r = (h << fib::RSHIFT) | (h >> fib::LSHIFT);
+        keys.push_back(r * inv);
+    }
+    return keys;
+}
+
+/**
+ * Insert the keys in batches, tracking the slowest batch, then find them.
+ */
+template <typename Map>
+static void
+bench_adversarial(const char *mode, const vector<uint64_t>& keys)
+{
+    const size_t batch = 1000;
+    Map m;
+    double worst = 0;
+    double t0 = now();
+    for (size_t i = 0; i < keys.size(); i += batch)
+    {
+        double b0 = now();
+        for (size_t j = i; j < i + batch && j < keys.size(); ++j)
+        {
+            m.emplace(keys[j], 1);
+        }
+        double b1 = now();
+        worst = b1 - b0 > worst ? b1 - b0 : worst;
+    }
+    double t1 = now();
+    size_t hits = 0;
+    for (uint64_t k : keys)
+    {
+        hits += m.count(k);
+    }
+    double t2 = now();
+
+    assert(hits == keys.size() && "Fail: adversarial find");
+    printf("{\"bench\":\"adversarial\",\"mode\":\"%s\",\"len\":%zu,"
+           "\"ns\":{\"insert\":%f,\"worstinsert\":%f,\"hit\":%f}}\n",
+           mode, keys.size(), (t1 - t0) * 1e9 / keys.size(),
+           worst * 1e9 / batch, (t2 - t1) * 1e9 / keys.size());
+}
+
+using string_hash = hackmap::fibonacci_hash<string>;
+
+template <typename Policy>
+using string_map = hackmap::unordered_map<string, int, string_hash,
+                                          counting_equal,
+                                          allocator<pair<string, int>>,
+                                          Policy>;
+
+/**
+ * Time raw hashing, then insert, hit, and miss through a map using Hash.
+ */
+template <typename Key, typename Hash>
+static void
+bench_hash(const char *mode, const char *keys, const vector<Key>& in,
+           const vector<Key>& out)
+{
+    Hash h;
+    size_t sink = 0;
+    double t0 = now();
+    for (const Key& k : in)
+    {
+        sink += h(k);
+    }
+    double t1 = now();
+
+    hackmap::unordered_map<Key, int, Hash> m;
+    for (const Key& k : in)
+    {
+        m.emplace(k, 1);
+    }
+    double t2 = now();
+    size_t hits = 0;
+    for (const Key& k : in)
+    {
+        hits += m.count(k);
+    }
+    double t3 = now();
+    size_t misses = 0;
+    for (const Key& k : out)
+    {
+        misses += 1 - m.count(k);
+    }
+    double t4 = now();
+
+    assert(misses <= out.size() && "Fail: lookups");
+    printf("{\"bench\":\"hash\",\"mode\":\"%s\",\"keys\":\"%s\","
+           "\"len\":%zu,\"hits\":%zu,\"sink\":%zu,"
+           "\"ns\":{\"hash\":%f,\"insert\":%f,\"hit\":%f,\"miss\":%f}}\n",
+           mode, keys, in.size(), hits, sink & 1,
+           (t1 - t0) * 1e9 / in.size(), (t2 - t1) * 1e9 / in.size(),
+           (t3 - t2) * 1e9 / in.size(), (t4 - t3) * 1e9 / out.size());
+}
+
+/** Run bench_hash with the default wrapper and the avalanching family. */
+template <typename Key>
+static void
+bench_hashers(const char *keys, const vector<Key>& in, const vector<Key>& out)
+{
+    bench_hash<Key, hackmap::fibonacci_hash<Key>>("fibonacci", keys, in, out);
+    bench_hash<Key, hackmap::hash<Key>>("hackmap", keys, in, out);
+}
+
+int
+main(void)
+{
+    int seed = FORCESEED;
+    int forceseed = FORCESEED;
+    const int len = MAXLEN;
+
+    int *n = rand_intarr_new(len * 4, &seed, forceseed);
+    printf("SEED: %d\n", seed);
+
+    {
+        // Wide hash fragment versus the default octet.
+        vector<string> in;
+        vector<string> out;
+        for (int i = 0; i < len; ++i)
+        {
+            in.push_back(long_key(n[i]));
+            out.push_back(long_key(n[len + i]));
+        }
+
+        bench_fragment<string_map<hackmap::default_policy>>("8bit", in, out);
+        bench_fragment<string_map<hackmap::wide_hash_policy>>("16bit", in, out);
+    }
+
+    {
+        // Wide leaps versus extended searches on an adversarial hash.
+        const int gaps[] = { 100, 300, 1000 };
+        for (int gap : gaps)
+        {
+            bench_leap<edge_map<hackmap::default_policy>>("8bit", gap, 20);
+            bench_leap<edge_map<hackmap::wide_leap_policy>>("16bit", gap, 20);
+        }
+    }
+
+    {
+        // Insert at high load with and without the free summary.
+        const size_t slots = size_t(1) << 21;
+        vector<int> uniform(n, n + size_t(double(slots) * 0.97));
+        bench_high_load<fib_map<hackmap::default_policy>>(
+            "default", "uniform", uniform);
+        bench_high_load<fib_map<hackmap::free_summary_policy>>(
+            "summary", "uniform", uniform);
+
+        const size_t cslots = size_t(1) << 16;
+        vector<int> cluster;
+        for (size_t i = 0; i < size_t(double(cslots) * 0.97); ++i)
+        {
+            cluster.push_back(int(i));
+        }
+        for (size_t i = 0; i < cluster.size(); ++i)
+        {
+            swap(cluster[i], cluster[rand_int_range(0, int(cluster.size()) - 1)]);
+        }
+        bench_high_load<pair_map<hackmap::wide_leap_policy>>(
+            "default", "cluster", cluster);
+        bench_high_load<pair_map<leap_summary_policy>>(
+            "summary", "cluster", cluster);
+    }
+
+    {
+        // Mostly missing lookups at 97% load with and without the filter.
+        const size_t slots = size_t(1) << 21;
+        size_t fill = size_t(double(slots) * 0.97);
+        vector<int> in(n, n + fill);
+        vector<int> query;
+        for (size_t i = 0; i < 10000000; ++i)
+        {
+            query.push_back(i % 10 ? n[fill + i % (size_t(len) * 4 - fill)]
+                                   : in[(i * 7919) % fill]);
+        }
+        bench_miss<fib_map<hackmap::default_policy>>("default", in, query);
+        bench_miss<fib_map<hackmap::miss_filter_policy>>("filter", in, query);
+    }
+
+    {
+        // Iterate sparse tables with and without the full summary.
+        const size_t slots = size_t(1) << 22;
+        bench_iterate<fib_map<hackmap::default_policy>>("default", n, slots);
+        bench_iterate<fib_map<hackmap::full_summary_policy>>("summary", n, slots);
+    }
+
+    {
+        // Build a map from a vector (use -DBULKLEN=100000000 for 100M).
+        vector<pair<int, int>> v;
+        v.reserve(BULKLEN);
+        for (size_t i = 0; i < size_t(BULKLEN); ++i)
+        {
+            // Odd multiplier permutes 32 bits, so keys are unique.
+            v.push_back({ int(uint32_t(i) * 2654435761U), int(i) });
+        }
+
+        using map = hackmap::unordered_map<int, int>;
+        bench_build<map>("insert", BUILD_INSERT, v);
+        bench_build<map>("reserve", BUILD_RESERVE, v);
+        bench_build<map>("bulk", BUILD_BULK, v);
+        bench_snapshot(v);
+        bench_frozen(v);
+        bench_freeze(v);
+    }
+
+    {
+        // Equi-join (use -DJOINBUILD=10000000 -DJOINPROBE=100000000).
+        vector<pair<int, int>> build;
+        build.reserve(JOINBUILD);
+        for (size_t i = 0; i < size_t(JOINBUILD); ++i)
+        {
+            build.push_back({ int(uint32_t(i) * 2654435761U), int(i) });
+        }
+
+        // Partitions of ~32k rows keep each table within L2.
+        int bits = 0;
+        while ((build.size() >> bits) > 32768)
+        {
+            ++bits;
+        }
+        unsigned threads = thread::hardware_concurrency();
+        threads = threads ? threads : 1;
+
+        bench_join("loop", JOIN_LOOP, 0, 1, build);
+        bench_join("join", JOIN_HASH, 0, 1, build);
+        bench_join("partitioned", JOIN_HASH, bits, 1, build);
+        bench_join("threads", JOIN_HASH, 0, threads, build);
+        bench_join("partitioned", JOIN_HASH, bits, threads, build);
+    }
+
+    {
+        // Group-by, counters, and caches (use -DAGGROWS=1000000000 for a billion rows).
+        unsigned threads = thread::hardware_concurrency();
+        threads = threads ? threads : 1;
+        for (bool zipf : { false, true })
+        {
+            const char *keys = zipf ? "zipf" : "uniform";
+            vector<pair<int, long>> v = agg_rows(AGGROWS, AGGKEYS, zipf);
+            bench_aggregate("std", keys, AGG_STD, 0, 1, v);
+            bench_aggregate("subscript", keys, AGG_SUBSCRIPT, 0, 1, v);
+            bench_aggregate("fused", keys, AGG_FUSED, 0, 1, v);
+            bench_aggregate("partitioned", keys, AGG_FUSED, 4, 1, v);
+            bench_aggregate("threads", keys, AGG_FUSED, 4, threads, v);
+            bench_counter("find", COUNTER_FIND, v);
+            bench_counter("upsert", COUNTER_UPSERT, v);
+            bench_cache<lru_cache>("lru", keys, v);
+            bench_cache<hackmap::clock_cache<int, long>>("clock", keys, v);
+        }
+    }
+
+    {
+        // Expiring entries (use -DTTLLEN=10000000 for 10M live).
+        bench_ttl("purge", TTL_PURGE);
+        bench_ttl("sweep", TTL_SWEEP);
+    }
+
+    {
+        // Small constant table: 10M lookups.
+        vector<int> codes;
+        vector<int> known;
+        STATUS_IDS.for_each([&known](int k, int) { known.push_back(k); });
+        for (size_t i = 0; i < 10000000; ++i)
+        {
+            uint32_t r = uint32_t(i * 2654435761U) >> 8;
+            codes.push_back(r % 4 ? known[r % known.size()] : int(r % 600));
+        }
+        bench_static<std::unordered_map<int, int>>("std", codes);
+        bench_static<hackmap::unordered_map<int, int>>("hackmap", codes);
+        bench_static_map(codes);
+    }
+
+    {
+        // Resize with large values inline and in a node slab.
+        const size_t nodes = 200000;
+        bench_node<hackmap::unordered_map<int, payload>>("inline", n, nodes);
+        bench_node<hackmap::node_map<int, payload>>("node", n, nodes);
+    }
+
+    {
+        // Default fibonacci wrapper versus the avalanching hash family.
+        vector<int> iin(n, n + len);
+        vector<int> iout(n + len, n + 2 * len);
+        bench_hashers<int>("int", iin, iout);
+
+        vector<int> seqin;
+        vector<int> seqout;
+        for (int i = 0; i < len; ++i)
+        {
+            seqin.push_back(i << 8);
+            seqout.push_back((i << 8) + 1);
+        }
+        bench_hashers<int>("stride", seqin, seqout);
+
+        vector<pair<int, int>> pin;
+        vector<pair<int, int>> pout;
+        for (int i = 0; i < len; ++i)
+        {
+            pin.push_back({ n[i], i });
+            pout.push_back({ n[len + i], i });
+        }
+        bench_hash<pair<int, int>, hackmap::hash<pair<int, int>>>(
+            "hackmap", "pair", pin, pout);
+
+        vector<int *> ptrin;
+        vector<int *> ptrout;
+        for (int i = 0; i < len; ++i)
+        {
+            ptrin.push_back(n + i);
+            ptrout.push_back(n + len + i);
+        }
+        bench_hashers<int *>("pointer", ptrin, ptrout);
+
+        vector<string> sin;
+        vector<string> sout;
+        for (int i = 0; i < len; ++i)
+        {
+            sin.push_back(to_string(n[i]));
+            sout.push_back(to_string(n[len + i]));
+        }
+        bench_hashers<string>("short", sin, sout);
+
+        for (int i = 0; i < len; ++i)
+        {
+            sin[i] = long_key(n[i]);
+            sout[i] = long_key(n[len + i]);
+        }
+        bench_hashers<string>("long", sin, sout);
+    }
+
+    {
+        // Keys crafted against the unseeded hash, replayed against a seed.
+        vector<uint64_t> keys = adversarial_keys(20000);
+        bench_adversarial<hackmap::unordered_map<uint64_t, int>>("unseeded", keys);
+        bench_adversarial<hackmap::unordered_map<uint64_t, int,
+            hackmap::seeded_hash<uint64_t>>>("seeded", keys);
+    }
+
+    {
+        // A degenerate hash with and without bad hash detection.
+        bench_guard<hackmap::default_policy>("default", 20000);
+        bench_guard<hackmap::hash_guard_policy>("guard", 20000);
+    }
+
+    rand_intarr_free(n);
+
+    return 0;
+}
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #include "util.h"
 
@@ -53,6 +55,33 @@
 #endif
 #endif
 
+/*
+ * Optional hasher shared by every map (make hasher=...):
+ * HASH_STD = std::hash, HASH_FIB = fibonacci_hash over std::hash,
+ * HASH_MIX = hackmap::hash, HASH_FIB_MIX = fibonacci_hash over hackmap::hash.
+ */
+#if defined(HASH_STD) || defined(HASH_FIB) || defined(HASH_MIX) || defined(HASH_FIB_MIX)
+#ifndef HASHMAP
+#include "hackmap.hpp"
+#endif
+#endif
+
+#if defined(HASH_STD)
+using hash_type = std::hash<int>;
+#define MAP_ARGS int, bool, hash_type
+#elif defined(HASH_FIB)
+using hash_type = hackmap::fibonacci_hash<int>;
+#define MAP_ARGS int, bool, hash_type
+#elif defined(HASH_MIX)
+using hash_type = hackmap::hash<int>;
+#define MAP_ARGS int, bool, hash_type
+#elif defined(HASH_FIB_MIX)
+using hash_type = hackmap::fibonacci_hash<int, hackmap::hash<int>>;
+#define MAP_ARGS int, bool, hash_type
+#else
+#define MAP_ARGS int, bool
+#endif
+
 using namespace std;
 
 typedef enum state_e
@@ -78,31 +107,31 @@ typedef struct entry_s
 } entry_t;
 
 #ifdef HASHMAP
-template class hackmap::unordered_map<int, bool>;
-using map_type = hackmap::unordered_map<int, bool>;
+template class hackmap::unordered_map<MAP_ARGS>;
+using map_type = hackmap::unordered_map<MAP_ARGS>;
 #else
 
 #ifdef UNORDERED_MAP
-using map_type = std::unordered_map<int, bool>;
+using map_type = std::unordered_map<MAP_ARGS>;
 #else
 
 #ifdef BYTELL_HASH_MAP
-using map_type = ska::bytell_hash_map<int, bool>;
+using map_type = ska::bytell_hash_map<MAP_ARGS>;
 #else
 
 #ifdef FLAT_HASH_MAP
-using map_type = ska::flat_hash_map<int, bool>;
+using map_type = ska::flat_hash_map<MAP_ARGS>;
 #else
 
 #ifdef UNORDERED_MAP_FIB
-using map_type = ska::unordered_map<int, bool>;
+using map_type = ska::unordered_map<MAP_ARGS>;
 #else
 
 #ifdef ROBINHOOD
-using map_type = robin_hood::unordered_map<int, bool>;
+using map_type = robin_hood::unordered_map<MAP_ARGS>;
 #else
 
-using map_type = std::unordered_map<int, bool>;
+using map_type = std::unordered_map<MAP_ARGS>;
 
 #endif
 #endif
@@ -113,6 +142,10 @@ using map_type = std::unordered_map<int, bool>;
 
 
 
+#if defined(HASHMAP) && defined(HACKMAP_LATENCY)
+static hackmap::unordered_map_latency latency;
+#endif
+
 static void
 runtest(entry_t *e, int elen, int maxactions)
 {
@@ -210,6 +243,64 @@ runtest(entry_t *e, int elen, int maxactions)
 #endif
         }
     }
+
+#if defined(HASHMAP) && defined(HACKMAP_LATENCY)
+    latency += m.latency();
+#endif
+}
+
+/** @return Resident set size in bytes (0 if unknown). */
+static long
+rss_bytes(void)
+{
+    long size = 0;
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (2 != fscanf(f, "%ld %ld", &size, &pages))
+        {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/** @return Peak resident set size in KiB. */
+static long
+peak_rss_kib(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+    {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+/** Fill one map with every element and report what it costs per entry. */
+static void
+memtest(entry_t *e, int elen)
+{
+    long before = rss_bytes();
+    map_type *m = new map_type;
+    for (int i = 0; i < elen; ++i)
+    {
+        m->insert({ e[i].val, true });
+    }
+    long after = rss_bytes();
+
+    printf("# Memory: {\"len\":%zu,\"rss_bytes\":%ld,\"rss_per_entry\":%f",
+           m->size(), after - before,
+           m->size() ? double(after - before) / double(m->size()) : 0.0);
+#ifdef HASHMAP
+    printf(",\"memory_usage\":%zu,\"bytes_per_entry\":%f",
+           m->memory_usage(), m->bytes_per_element());
+#endif
+    printf("}\n");
+
+    delete m;
 }
 
 static int
@@ -254,6 +345,7 @@ main(void)
     rand_intarr_free(n);
 
     printf("# Done generating random elements.\n");
+    memtest(e, maxlen);
     printf("# Format:\n"
            "# len = number of elements per iteration\n"
            "# iter = number of iterations\n"
@@ -298,6 +390,13 @@ main(void)
 
     free(e);
 
+    printf("# Peak RSS: %ld KiB\n", peak_rss_kib());
+
+#if defined(HASHMAP) && defined(HACKMAP_LATENCY)
+    printf("# Sampled latency (TSC cycles):\n");
+    latency.print();
+#endif
+
     return 0;
 }
 
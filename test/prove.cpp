@@ -1,5 +1,13 @@
 
+#include <fstream>
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 #include <assert.h>
 #include <stdio.h>
 #include <iostream>
@@ -7,10 +15,11 @@
 #include "util.h"
 
 #include "hackmap.hpp"
+#include "hackmap_query.hpp"
 
 
 #ifdef DEBUG
-#define INVARIANT_CHECK {assert(map.invariant(&cout) && "Fail: invariant")};
+#define INVARIANT_CHECK {assert(map.invariant(&cout) && "Fail: invariant");}
 #else
 #define INVARIANT_CHECK
 #endif
@@ -90,8 +99,163 @@ using map_type = hackmap::unordered_map<int, bool>;
 template class hackmap::detail::unordered_map<100, int, bool>;
 using map_full_type = hackmap::detail::unordered_map<100, int, bool>;
 
+template class hackmap::detail::unordered_map<100, int, bool, hashit::edge_hash,
+    std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::wide_hash_policy>;
+using map_wide_hash_edge_type = hackmap::detail::unordered_map<100, int, bool,
+    hashit::edge_hash, std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::wide_hash_policy>;
+
+template class hackmap::detail::unordered_map<100, int, bool, hashit::edge_hash,
+    std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::wide_leap_policy>;
+using map_wide_leap_edge_type = hackmap::detail::unordered_map<100, int, bool,
+    hashit::edge_hash, std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::wide_leap_policy>;
+
+struct wide_policy: public hackmap::wide_hash_policy
+{
+    using leap_type = uint16_t;
+};
+
+using map_wide_edge_type = hackmap::detail::unordered_map<100, int, bool,
+    hashit::edge_hash, std::equal_to<int>, std::allocator<unsigned char>,
+    wide_policy>;
+
+template class hackmap::detail::unordered_map<100, int, bool, hashit::edge_hash,
+    std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::free_summary_policy>;
+using map_summary_edge_type = hackmap::detail::unordered_map<100, int, bool,
+    hashit::edge_hash, std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::free_summary_policy>;
+
+template class hackmap::detail::unordered_map<100, int, bool, hashit::edge_hash,
+    std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::full_summary_policy>;
+using map_full_summary_edge_type = hackmap::detail::unordered_map<100, int,
+    bool, hashit::edge_hash, std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::full_summary_policy>;
+
+template class hackmap::detail::unordered_map<100, int, bool, hashit::edge_hash,
+    std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::miss_filter_policy>;
+using map_filter_edge_type = hackmap::detail::unordered_map<100, int, bool,
+    hashit::edge_hash, std::equal_to<int>, std::allocator<unsigned char>,
+    hackmap::miss_filter_policy>;
+
+using map_filter_type = hackmap::unordered_map<int, bool,
+    hackmap::fibonacci_hash<int>, std::equal_to<int>,
+    std::allocator<std::pair<int, bool>>, hackmap::miss_filter_policy>;
+
+struct summary_policy: public hackmap::free_summary_policy
+{
+    static constexpr bool full_summary = true;
+};
+
+using map_summary_type = hackmap::unordered_map<int, bool,
+    hackmap::fibonacci_hash<int>, std::equal_to<int>,
+    std::allocator<std::pair<int, bool>>, summary_policy>;
+
 using stats_type = hackmap::unordered_map_stats;
 
+using map_listen_type = hackmap::unordered_map<int, bool,
+    hackmap::fibonacci_hash<int>, std::equal_to<int>,
+    std::allocator<std::pair<int, bool>>, hackmap::resize_listener_policy>;
+
+/** Records every resize event it is told of. */
+struct resize_log: public hackmap::resize_listener
+{
+    std::vector<hackmap::resize_event> events;
+
+    void
+    on_resize(const hackmap::resize_event& e)
+    noexcept override
+    {
+        events.push_back(e);
+    }
+};
+
+/**
+ * Fill the map with direct hits, then pile keys onto a single head so
+ * the list needs long leaps, extended leaps, and cascades.
+ */
+template <typename Map>
+static void
+edge_policy_test(void)
+{
+    Map map;
+
+    for (int i = 0; i < EDGEMAX; ++i)
+    {
+        map.emplace(i, true);
+    }
+
+    for (int i = 0; i < EDGEMAX; i += 3)
+    {
+        map.erase(i);
+    }
+
+    const int edges = EDGEMAX / 3;
+    for (int i = 0; i < edges; ++i)
+    {
+        assert(map.emplace(EDGEMAX + i, false).second && "Fail: add edge");
+    }
+    INVARIANT_CHECK;
+
+    for (int i = 0; i < EDGEMAX; ++i)
+    {
+        bool in = (i % 3) != 0;
+        assert(in == (1 == map.count(i)) && "Fail: count");
+    }
+
+    for (int i = 0; i < edges; ++i)
+    {
+        assert(1 == map.count(EDGEMAX + i) && "Fail: find edge");
+    }
+
+    for (int i = 0; i < edges; i += 2)
+    {
+        assert(1 == map.erase(EDGEMAX + i) && "Fail: erase edge");
+    }
+    INVARIANT_CHECK;
+
+    for (int i = 0; i < edges; ++i)
+    {
+        bool in = (i % 2) != 0;
+        assert(in == (1 == map.count(EDGEMAX + i)) && "Fail: count edge");
+    }
+
+    // Space the empty entries further apart than an octet leap.
+    map.clear();
+    for (int i = 0; i < EDGEMAX; ++i)
+    {
+        map.emplace(i, true);
+    }
+
+    const int gap = 300;
+    int far = 0;
+    for (int i = 3; i < EDGEMAX; i += gap)
+    {
+        map.erase(i);
+        assert(map.emplace(EDGEMAX + i, false).second && "Fail: add far");
+        ++far;
+    }
+    INVARIANT_CHECK;
+
+    for (int i = 3; i < EDGEMAX; i += gap)
+    {
+        assert(1 == map.count(EDGEMAX + i) && "Fail: find far");
+    }
+
+    // Erase from the middle, then the head.
+    assert(1 == map.erase(EDGEMAX + 3 + gap) && "Fail: erase far");
+    INVARIANT_CHECK;
+    assert(1 == map.erase(EDGEMAX + 3) && "Fail: erase far head");
+    INVARIANT_CHECK;
+    assert(size_t(EDGEMAX - 2) == map.size() && "Fail: far size");
+    assert(far > 2 && "Fail: far count");
+}
+
 int
 main(void)
 {
@@ -524,8 +688,1400 @@ main(void)
 
         cout << "PASSED CONSTRUCTORS TEST" << endl;
     }
+
+    {
+        // Test alternate storage policies.
+        edge_policy_test<map_edge_type>();
+        edge_policy_test<map_wide_hash_edge_type>();
+        edge_policy_test<map_wide_leap_edge_type>();
+        edge_policy_test<map_wide_edge_type>();
+        edge_policy_test<map_summary_edge_type>();
+        edge_policy_test<map_full_summary_edge_type>();
+        edge_policy_test<map_filter_edge_type>();
+
+        map_wide_hash_edge_type map;
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            map.emplace(i, true);
+        }
+        map.erase(3);
+        // Fragments differ only beyond the low 6 bits.
+        map.emplace(EDGEMAX + 64, false);
+        map.emplace(EDGEMAX + 128, false);
+        assert(map.find(EDGEMAX + 64)->first == EDGEMAX + 64 && "Fail: find");
+        assert(map.find(EDGEMAX + 128)->first == EDGEMAX + 128 && "Fail: find");
+        assert(map.find(EDGEMAX + 192) == map.end() && "Fail: no find");
+        INVARIANT_CHECK;
+
+        {
+            // Fill past the load factor and back with the free summary.
+            map_summary_type map;
+            const int len = 10000;
+            int seed = 0;
+            int *n = rand_intarr_new(len, &seed, FORCESEED);
+            for (int i = 0; i < len; ++i)
+            {
+                assert(map.emplace(n[i], true).second && "Fail: add");
+            }
+            INVARIANT_CHECK;
+            for (int i = 0; i < len; i += 2)
+            {
+                assert(1 == map.erase(n[i]) && "Fail: erase");
+            }
+            INVARIANT_CHECK;
+            for (int i = 0; i < len; ++i)
+            {
+                assert((i % 2) == int(map.count(n[i])) && "Fail: count");
+            }
+
+            // Leave a sparse table and iterate it.
+            for (int i = 1; i < len - 100; i += 2)
+            {
+                assert(1 == map.erase(n[i]) && "Fail: erase");
+            }
+            INVARIANT_CHECK;
+            size_t iterated = 0;
+            for (auto it = map.cbegin(); it != map.cend(); ++it)
+            {
+                assert(1 == map.count(it->first) && "Fail: iterate");
+                ++iterated;
+            }
+            assert(iterated == map.size() && "Fail: iterate size");
+            map.clear();
+            assert(map.begin() == map.end() && "Fail: empty iterate");
+            INVARIANT_CHECK;
+            rand_intarr_free(n);
+        }
+
+        {
+            // The miss filter never hides a key, through erase and growth.
+            map_filter_type map;
+            assert(map.end() == map.find(1) && 0 == map.erase(1)
+                   && "Fail: filter empty");
+            for (int i = 0; i < 20000; ++i)
+            {
+                map.emplace(i * 7, true);
+                if (0 == i % 5)
+                {
+                    assert(1 == map.erase(i * 7 - 35) + (i < 5)
+                           && "Fail: filter erase");
+                }
+            }
+            INVARIANT_CHECK;
+            for (int i = 0; i < 140000; ++i)
+            {
+                bool in = 0 == i % 7 && (i / 7 % 5 || i / 7 >= 19995);
+                assert(in == (1 == map.count(i)) && "Fail: filter count");
+            }
+            map.rehash(0);
+            INVARIANT_CHECK;
+            assert(map.size() == 16001 && "Fail: filter size");
+        }
+
+        {
+            // Churn at a steady size: erases leave stale bits, but a word
+            // is rebuilt once it passes FILTER_FILL, so none saturate.
+            map_filter_type map;
+            const int live = 15000;
+            for (int i = 0; i < live; ++i)
+            {
+                map.emplace(i, true);
+            }
+            size_t len = map.bucket_count();
+            float fresh = map.filter_fill();
+            for (int i = live; i < 40 * live; ++i)
+            {
+                assert(1 == map.erase(i - live) && "Fail: filter churn");
+                map.emplace(i, true);
+            }
+            INVARIANT_CHECK;
+            assert(len == map.bucket_count() && "Fail: filter churn grew");
+            assert(fresh > 0 && map.filter_fill() >= fresh
+                   && map.filter_fill()
+                      <= hackmap::detail::FILTER_FILL / 64.0f
+                   && "Fail: filter stale bits");
+        }
+
+        cout << "PASSED STORAGE POLICY TEST" << endl;
+    }
+
+    {
+        // Test bulk insertion.
+        map_type map;
+        map.emplace(7, false);
+
+        vector<pair<int, bool>> v;
+        for (int i = 0; i < 5000; ++i)
+        {
+            v.push_back({ i * 3, true });
+        }
+        v.push_back({ 3, false }); // Duplicate keeps the first.
+
+        map.bulk_insert(v.begin(), v.end());
+        assert(map.size() == 5001 && "Fail: bulk size");
+        assert(!map.at(7) && "Fail: bulk keeps existing");
+        assert(map.at(3) && "Fail: bulk keeps first");
+        for (int i = 0; i < 5000; ++i)
+        {
+            assert(1 == map.count(i * 3) && "Fail: bulk find");
+        }
+        INVARIANT_CHECK;
+
+        // Forward range into a map with a degenerate hash.
+        map_edge_type edge;
+        list<pair<int, bool>> l;
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            l.push_back({ EDGEMAX + i, true });
+        }
+        edge.bulk_insert(l.begin(), l.end());
+        edge.bulk_insert(l.begin(), l.begin());
+        assert(edge.size() == EDGEMAX && "Fail: bulk edge size");
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            assert(1 == edge.count(EDGEMAX + i) && "Fail: bulk edge find");
+        }
+
+        cout << "PASSED BULK INSERT TEST" << endl;
+    }
+
+    {
+        // Test the avalanching hash family.
+        hackmap::hash<int> ih;
+        hackmap::hash<uint64_t> lh;
+        static_assert(hackmap::is_avalanching<hackmap::hash<int>>::value, "avalanche");
+        static_assert(!hackmap::is_avalanching<std::hash<int>>::value, "no avalanche");
+
+        // Sequential keys must spread into both the index and fragment bits.
+        set<size_t> low;
+        set<size_t> high;
+        for (int i = 0; i < 4096; ++i)
+        {
+            low.insert(ih(i) & 0xFFF);
+            high.insert(lh(uint64_t(i)) >> (sizeof(size_t) * 8 - 12));
+        }
+        assert(low.size() > 2400 && "Fail: low bits");
+        assert(high.size() > 2400 && "Fail: high bits");
+
+        hackmap::fibonacci_hash<int, hackmap::hash<int>> fh;
+        assert(fh(12345) == ih(12345) && "Fail: fib skips mixing");
+
+        int x;
+        hackmap::hash<int *> ph;
+        assert(ph(&x) != ph(&x + 1) && "Fail: pointer");
+
+        // Every length class of the byte hash.
+        hackmap::hash<string> sh;
+        set<size_t> strs;
+        string str;
+        for (int i = 0; i < 200; ++i)
+        {
+            assert(sh(str) == sh(string(str.data(), str.size())) && "Fail: str");
+            strs.insert(sh(str));
+            str.push_back(char('a' + i % 26));
+        }
+        assert(strs.size() == 200 && "Fail: str distinct");
+        assert(sh("abcdefgh") != sh("abcdefgi") && "Fail: str last");
+        assert(sh(string(100, 'a')) != sh(string(101, 'a').replace(100, 1, 1, '\0')) && "Fail: str len");
+
+        hackmap::hash<pair<int, int>> pairh;
+        hackmap::hash<tuple<int, string, int>> th;
+        assert(pairh({1, 2}) != pairh({2, 1}) && "Fail: pair order");
+        assert(th(make_tuple(1, string("a"), 2)) != th(make_tuple(2, string("a"), 1))
+            && "Fail: tuple order");
+
+        hackmap::unordered_map<string, int, hackmap::hash<string>> smap;
+        for (int i = 0; i < 10000; ++i)
+        {
+            smap.emplace(to_string(i), i);
+        }
+        for (int i = 0; i < 10000; ++i)
+        {
+            assert(smap.at(to_string(i)) == i && "Fail: string map");
+        }
+        assert(smap.count("x") == 0 && "Fail: string map miss");
+
+        hackmap::unordered_map<pair<int, int>, int, hackmap::hash<pair<int, int>>> pmap;
+        for (int i = 0; i < 100; ++i)
+        {
+            for (int j = 0; j < 100; ++j)
+            {
+                pmap.emplace(make_pair(i, j), i * j);
+            }
+        }
+        assert(pmap.size() == 10000 && "Fail: pair map size");
+        assert(pmap.at(make_pair(7, 9)) == 63 && "Fail: pair map");
+
+        cout << "PASSED HASH FAMILY TEST" << endl;
+    }
+
+    {
+        // Test seeded hashing.
+        using seeded = hackmap::seeded_hash<int>;
+        seeded a;
+        seeded b;
+        assert(a.seed() != b.seed() && "Fail: seed per instance");
+        assert(seeded(7)(12) == seeded(7)(12) && "Fail: seed repeat");
+        assert(seeded(7)(12) != seeded(8)(12) && "Fail: seed used");
+        assert(hackmap::seeded_hash<string>(7)("key")
+            != hackmap::seeded_hash<string>(8)("key") && "Fail: seed string");
+        using seeded_pair = hackmap::seeded_hash<pair<int, int>>;
+        assert(seeded_pair(7)(make_pair(1, 2)) != seeded_pair(8)(make_pair(1, 2))
+            && "Fail: seed pair");
+
+        using seeded_map = hackmap::unordered_map<int, int, seeded>;
+        seeded_map map(0, seeded(1));
+        seeded_map other(0, seeded(2));
+        assert(map.hash_function().seed() == 1 && "Fail: stored hasher");
+        for (int i = 0; i < 1000; ++i)
+        {
+            map.emplace(i, i);
+            other.emplace(-i, i);
+        }
+        INVARIANT_CHECK;
+
+        seeded_map copy(map);
+        assert(copy.hash_function().seed() == 1 && "Fail: copy seed");
+        assert(copy == map && "Fail: copy");
+
+        map.swap(other);
+        assert(map.hash_function().seed() == 2 && "Fail: swap seed");
+        assert(other.hash_function().seed() == 1 && "Fail: swap seed");
+        for (int i = 1; i < 1000; ++i)
+        {
+            assert(map.at(-i) == i && "Fail: swap find");
+            assert(other.at(i) == i && "Fail: swap find");
+        }
+        INVARIANT_CHECK;
+
+        cout << "PASSED SEEDED HASH TEST" << endl;
+    }
+
+    {
+        // Test bad hash detection.
+        using guard_map = hackmap::unordered_map<int, bool, hashit::edge_hash,
+            std::equal_to<int>, std::allocator<std::pair<int, bool>>,
+            hackmap::hash_guard_policy>;
+        guard_map map;
+        map_edge_type plain;
+
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            map.emplace(i, true);
+        }
+        assert(map.reseed_count() == 0 && "Fail: good hash reseeded");
+
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            map.emplace(EDGEMAX + i, false);
+            if (i < 2000)
+            {
+                plain.emplace(EDGEMAX + i, false);
+            }
+        }
+        assert(map.reseed_count() >= 1 && "Fail: no reseed");
+        assert(plain.reseed_count() == 0 && "Fail: unguarded reseed");
+        assert(map.size() == size_t(2 * EDGEMAX) && "Fail: guard size");
+        INVARIANT_CHECK;
+
+        for (int i = 0; i < 2 * EDGEMAX; ++i)
+        {
+            assert(map.at(i) == (i < EDGEMAX) && "Fail: guard find");
+        }
+        for (int i = 0; i < EDGEMAX; i += 2)
+        {
+            assert(1 == map.erase(EDGEMAX + i) && "Fail: guard erase");
+        }
+        INVARIANT_CHECK;
+
+        guard_map moved(std::move(map));
+        assert(moved.reseed_count() >= 1 && "Fail: move keeps seed");
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            bool in = i % 2;
+            assert(in == (1 == moved.count(EDGEMAX + i)) && "Fail: guard move");
+        }
+
+        // A reseed partway through a bulk insert.
+        guard_map bulk;
+        vector<pair<int, bool>> v;
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            v.push_back({ EDGEMAX + i, true });
+        }
+        bulk.bulk_insert(v.begin(), v.end());
+        assert(bulk.reseed_count() >= 1 && "Fail: bulk reseed");
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            assert(1 == bulk.count(EDGEMAX + i) && "Fail: bulk guard find");
+        }
+
+        // Now and then a costly insert at a steady size: cheap chained
+        // inserts in between forgive the strikes, so it never reseeds.
+        struct rare_hash
+        {
+            size_t
+            operator()(const int& k) const
+            {
+                return k < 0 ? 5 : size_t(k);
+            }
+        };
+        using rare_map = hackmap::unordered_map<int, bool, rare_hash,
+            std::equal_to<int>, std::allocator<std::pair<int, bool>>,
+            hackmap::hash_guard_policy>;
+        rare_map rare;
+        rare.reserve(15000);
+        const int len = int(rare.bucket_count());
+        for (int i = 0; i < len / 2; ++i)
+        {
+            rare.emplace(i, true);
+        }
+        for (int i = 1; i <= 115; ++i)
+        {
+            rare.emplace(-i, true);
+        }
+        for (int round = 0; round < 30; ++round)
+        {
+            for (int i = 116; i <= 119; ++i)
+            {
+                rare.emplace(-i, true);
+            }
+            for (int i = 116; i <= 119; ++i)
+            {
+                rare.erase(-i);
+            }
+            for (int i = 0; i < 6000; ++i)
+            {
+                rare.emplace(len + i, true);
+            }
+            for (int i = 0; i < 6000; ++i)
+            {
+                rare.erase(len + i);
+            }
+        }
+        assert(len == int(rare.bucket_count()) && "Fail: rare grew");
+        assert(0 == rare.reseed_count() && "Fail: strikes never decay");
+
+        cout << "PASSED HASH GUARD TEST" << endl;
+    }
+
+    {
+        // Test operation counters.
+        map_type map;
+        map.reset_counters();
+        for (int i = 0; i < 1000; ++i)
+        {
+            map.emplace(i, true);
+        }
+        for (int i = 0; i < 2000; ++i)
+        {
+            map.count(i);
+        }
+        hackmap::unordered_map_counters c = map.counters();
+#if defined(HACKMAP_COUNTERS) || defined(HACKMAP_COUNTERS_THREAD)
+        assert(c.hits == 1000 && "Fail: hits");
+        assert(c.misses == 1000 && "Fail: misses");
+        assert(c.lookups() == 2000 && "Fail: lookups");
+        assert(c.compares >= 1000 && "Fail: compares");
+        assert(c.false_positives <= c.compares - 1000 && "Fail: false positives");
+        assert(c.resizes > 0 && c.bytes_moved > 0 && "Fail: resizes");
+
+        // Links further apart than an octet leap need extended searches.
+        map_edge_type edge;
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            edge.emplace(i, true);
+        }
+        size_t far = 0;
+        for (int i = 3; i < EDGEMAX; i += 300)
+        {
+            edge.erase(i);
+            edge.emplace(EDGEMAX + i, true);
+            ++far;
+        }
+        edge.reset_counters();
+        assert(edge.counters().leaps == 0 && "Fail: reset");
+        for (int i = 3; i < EDGEMAX; i += 300)
+        {
+            edge.count(EDGEMAX + i);
+        }
+        c = edge.counters();
+        assert(c.leaps >= far * (far - 1) / 2 && "Fail: leaps");
+        assert(c.extended_leaps > 0 && c.extended_blocks >= c.extended_leaps
+            && "Fail: extended leaps");
+        edge.erase(EDGEMAX + 3);
+        edge.emplace(EDGEMAX + 4, true);
+        assert(edge.counters().empty_blocks > 0 && "Fail: empty blocks");
+
+        hackmap::unordered_map_counters total = map.counters();
+        total += edge.counters();
+        assert(total.hits == map.counters().hits + edge.counters().hits
+            && "Fail: merge");
+#endif
+#if defined(HACKMAP_COUNTERS) && !defined(HACKMAP_COUNTERS_THREAD)
+        // Const lookups on several threads all count in the map's own.
+        map.reset_counters();
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t)
+        {
+            readers.emplace_back([&map]()
+            {
+                const map_type& shared = map;
+                for (int i = 0; i < 20000; ++i)
+                {
+                    shared.count(i % 2000);
+                }
+            });
+        }
+        for (auto& reader : readers)
+        {
+            reader.join();
+        }
+        c = map.counters();
+        assert(c.lookups() == 80000 && c.hits == 40000 && "Fail: threaded");
+#endif
+#if !defined(HACKMAP_COUNTERS) && !defined(HACKMAP_COUNTERS_THREAD)
+        assert(c.lookups() == 0 && c.compares == 0 && "Fail: disabled");
+#endif
+
+        cout << "PASSED COUNTERS TEST" << endl;
+    }
+
+    {
+        // Test latency histograms.
+        using hist_type = hackmap::latency_histogram;
+        for (uint64_t v = 0; v < 100000; v = v * 2 + 1)
+        {
+            uint64_t low = hist_type::value(hist_type::index(v));
+            assert(low <= v && v - low <= v / hist_type::SUB && "Fail: bucket");
+        }
+        assert(hist_type::index(~uint64_t(0)) == hist_type::LEN - 1 && "Fail: cap");
+
+        hist_type hist;
+        for (uint64_t v = 1; v <= 1000; ++v)
+        {
+            hist.record(v);
+        }
+        assert(hist.count() == 1000 && hist.max() == 1000 && "Fail: record");
+        assert(hist.percentile(0.5) <= 500 && hist.percentile(0.5) > 400
+            && "Fail: p50");
+        assert(hist.percentile(0.99) <= hist.percentile(1.0) && "Fail: p99");
+        hist_type other;
+        other.record(5000);
+        hist += other;
+        assert(hist.count() == 1001 && hist.max() == 5000 && "Fail: merge");
+
+        map_type map;
+        for (int i = 0; i < 10000; ++i)
+        {
+            map.emplace(i, true);
+            map.count(i);
+        }
+        for (int i = 0; i < 10000; ++i)
+        {
+            map.erase(i);
+        }
+        hackmap::unordered_map_latency lat = map.latency();
+#ifdef HACKMAP_LATENCY
+        // The sample tick is per thread, so earlier maps shift it.
+        const uint64_t rate = HACKMAP_LATENCY_RATE;
+        assert(lat.insert.count() - 10000 / rate <= 1 && "Fail: inserts");
+        assert(lat.find.count() - 10000 / rate <= 1 && "Fail: finds");
+        assert(lat.erase.count() > 0 && "Fail: erases");
+        assert(lat.resize.count() > 5 && "Fail: resizes");
+        map.reset_latency();
+        assert(map.latency().find.count() == 0 && "Fail: reset");
+
+        // Const finds on several threads each sample on their own tick.
+        for (int i = 0; i < 2000; ++i)
+        {
+            map.emplace(i, true);
+        }
+        map.reset_latency();
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t)
+        {
+            readers.emplace_back([&map]()
+            {
+                const map_type& shared = map;
+                for (int i = 0; i < 20000; ++i)
+                {
+                    shared.count(i % 2000);
+                }
+            });
+        }
+        for (auto& reader : readers)
+        {
+            reader.join();
+        }
+        lat = map.latency();
+        assert(lat.find.count() - 4 * (20000 / rate) <= 4 && "Fail: threaded");
+#else
+        assert(lat.insert.count() == 0 && lat.resize.count() == 0 && "Fail: disabled");
+#endif
+
+        cout << "PASSED LATENCY TEST" << endl;
+    }
+#endif
+
+#if 1
+    {
+        // Structural statistics.
+        map_type map;
+        stats_type stats;
+
+        int max = 5000;
+        for (int i = 0; i < max; ++i)
+        {
+            map.insert({i * 977, true});
+        }
+
+        map.gather_stats(stats);
+
+        size_t chained = 0;
+        size_t chains = 0;
+        for (size_t i = 0; i < stats.chain_lengths().size(); ++i)
+        {
+            chained += i * stats.chain_lengths()[i];
+            chains += stats.chain_lengths()[i];
+        }
+        assert(chained == map.size() && "Fail: chain lengths");
+
+        size_t filled = 0;
+        size_t blocks = 0;
+        for (size_t i = 0; i < stats.block_fills().size(); ++i)
+        {
+            filled += i * stats.block_fills()[i];
+            blocks += stats.block_fills()[i];
+        }
+        assert(filled == map.size() && "Fail: block fill");
+        assert(blocks * 16 == map.bucket_count() && "Fail: block count");
+        assert(stats.block_fills().size() <= 17 && "Fail: block fill range");
+
+        assert(stats.leaps() == map.size() - chains && "Fail: leaps");
+        assert(stats.find_leaps() <= stats.leaps() && "Fail: find leaps");
+        assert(stats.find_leap_fraction() >= 0.0
+               && stats.find_leap_fraction() <= 1.0 && "Fail: fraction");
+
+        // Gathering again starts from scratch.
+        std::ostringstream once;
+        std::ostringstream twice;
+        stats.print_csv(once);
+        map.gather_stats(stats);
+        stats.print_csv(twice);
+        assert(once.str() == twice.str() && "Fail: restart");
+        assert(0 == once.str().find("metric,index,value\n") && "Fail: csv");
+
+        std::ostringstream json;
+        stats.print_json(json);
+        assert('{' == json.str()[0] && "Fail: json");
+        assert(std::string::npos != json.str().find("\"chain_lengths\":[")
+               && "Fail: json chains");
+
+        cout << "PASSED STATS TEST" << endl;
+    }
 #endif
 
+    {
+        // Resize listener.
+        using hackmap::resize_reason;
+        resize_log log;
+        log.events.reserve(64);
+        map_listen_type map;
+        assert(nullptr == map.get_resize_listener() && "Fail: default");
+        map.set_resize_listener(&log);
+
+        for (int i = 0; i < 1000; ++i)
+        {
+            map.emplace(i, true);
+        }
+
+        assert(log.events.size() >= 2 && "Fail: grow events");
+        assert(0 == log.events[0].old_len && "Fail: first allocation");
+        assert(0 == log.events[0].bytes_freed && "Fail: first free");
+        for (size_t i = 1; i < log.events.size(); ++i)
+        {
+            const hackmap::resize_event& prev = log.events[i - 1];
+            const hackmap::resize_event& e = log.events[i];
+            assert(resize_reason::grow == e.reason && "Fail: grow reason");
+            assert(e.old_len == prev.new_len && "Fail: lengths");
+            assert(e.new_len == 2 * e.old_len && "Fail: doubled");
+            assert(e.bytes_freed == prev.bytes_allocated && "Fail: bytes");
+        }
+        assert(log.events.back().new_len == map.bucket_count()
+               && "Fail: final length");
+
+        size_t grows = log.events.size();
+        map.reserve(100000);
+        assert(grows + 1 == log.events.size() && "Fail: reserve event");
+        assert(resize_reason::reserve == log.events.back().reason
+               && "Fail: reserve reason");
+        assert(1000 == log.events.back().size && "Fail: moved");
+
+        map.rehash(2000);
+        assert(resize_reason::rehash == log.events.back().reason
+               && "Fail: rehash reason");
+        assert(log.events.back().new_len < log.events.back().old_len
+               && "Fail: shrink");
+
+        map_listen_type moved(std::move(map));
+        moved.clear();
+        assert(resize_reason::clear == log.events.back().reason
+               && "Fail: clear reason");
+        assert(1000 == log.events.back().size && "Fail: dropped");
+
+        size_t before = log.events.size();
+        moved.set_resize_listener(nullptr);
+        for (int i = 0; i < 100000; ++i)
+        {
+            moved.emplace(i, true);
+        }
+        assert(before == log.events.size() && "Fail: uninstalled");
+
+        cout << "PASSED RESIZE LISTENER TEST" << endl;
+    }
+
+    {
+        // Collision hotspots.
+        map_edge_type map;
+        for (int i = 0; i < EDGEMAX; ++i)
+        {
+            map.emplace(i, true);
+        }
+        int edges = 0;
+        for (int i = 3; i < EDGEMAX; i += 300)
+        {
+            map.erase(i);
+            map.emplace(EDGEMAX + i, true);
+            ++edges;
+        }
+
+        auto spots = map.hotspots(3, 4, [](const int& k)
+                                        { return std::to_string(k); });
+        assert(3 == spots.by_length.size() && "Fail: top k");
+        const hackmap::unordered_map_hotspot& worst = spots.by_length[0];
+        assert(3 == worst.home && "Fail: edge home");
+        assert(edges == int(worst.length) && "Fail: edge length");
+        assert(size_t(std::min(edges, 4)) == worst.keys.size()
+               && "Fail: samples");
+        assert(std::to_string(EDGEMAX + 3) == worst.keys[0]
+               && "Fail: head sample");
+        assert(spots.by_length[1].length <= worst.length && "Fail: order");
+        assert(!spots.by_extended.empty() && "Fail: no extended");
+        assert(3 == spots.by_extended[0].home && "Fail: extended home");
+        for (const auto& h : spots.by_extended)
+        {
+            assert(h.find_leaps && h.extended_distance && "Fail: extended");
+        }
+
+        auto bare = map.hotspots(1);
+        assert(1 == bare.by_length.size() && "Fail: bare top");
+        assert(bare.by_length[0].keys.empty() && "Fail: bare samples");
+        assert(bare.by_length[0].length == worst.length && "Fail: bare length");
+
+        cout << "PASSED HOTSPOTS TEST" << endl;
+    }
+
+    {
+        // Memory accounting.
+        map_type map;
+        assert(0 == map.memory_usage() && "Fail: unallocated");
+        assert(0.0 == map.bytes_per_element() && "Fail: empty per element");
+
+        for (int i = 0; i < 1000; ++i)
+        {
+            map.emplace(i, true);
+        }
+        using block_type = map_type::block_type;
+        size_t table = sizeof(block_type) * (map.bucket_count() / BLOCK_LEN);
+        assert(map.memory_usage() > table && "Fail: sentinel");
+        assert(map.memory_usage() <= table + sizeof(block_type)
+               && "Fail: table bytes");
+        assert(map.bytes_per_element() * 1000 == double(map.memory_usage())
+               && "Fail: per element");
+        assert(map.memory_usage([](const map_type::value_type&)
+                                { return size_t(8); })
+               == map.memory_usage() + 8000 && "Fail: value sizes");
+
+        map_summary_type summary;
+        summary.emplace(1, true);
+        size_t plain = sizeof(map_summary_type::block_type)
+                       * (summary.bucket_count() / BLOCK_LEN);
+        assert(summary.memory_usage() > plain + sizeof(uint64_t)
+               && "Fail: summary bytes");
+
+        cout << "PASSED MEMORY USAGE TEST" << endl;
+    }
+
+    {
+        // Hash join against a nested loop.
+        std::vector<std::pair<int, int>> build;
+        std::vector<std::pair<int, int>> probe;
+        for (int i = 0; i < 3000; ++i)
+        {
+            build.push_back({ (i * 7) % 2000, i });
+        }
+        for (int i = 0; i < 5000; ++i)
+        {
+            probe.push_back({ (i * 13) % 4000, i });
+        }
+        auto key_of = [](const std::pair<int, int>& r) { return r.first; };
+
+        std::set<std::pair<size_t, size_t>> expect;
+        for (size_t b = 0; b < build.size(); ++b)
+        {
+            for (size_t p = 0; p < probe.size(); ++p)
+            {
+                if (build[b].first == probe[p].first)
+                {
+                    expect.insert({ b, p });
+                }
+            }
+        }
+
+        for (int bits : { 0, 3 })
+        {
+            hackmap::hash_join<int> join(bits);
+            join.build(build.begin(), build.end(), key_of);
+            assert(3000 == join.size() && "Fail: join rows");
+            assert(2000 == join.keys() && "Fail: join keys");
+
+            std::set<std::pair<size_t, size_t>> got;
+            size_t n = join.probe(probe.begin(), probe.end(), key_of,
+                                  [&](size_t b, size_t p)
+                                  { got.insert({ b, p }); });
+            assert(n == expect.size() && got == expect && "Fail: join");
+
+            std::atomic<size_t> matched(0);
+            n = join.probe(probe.begin(), probe.end(), key_of,
+                           [&](size_t b, size_t p)
+                           {
+                               if (build[b].first == probe[p].first)
+                               {
+                                   ++matched;
+                               }
+                           }, 3);
+            assert(n == expect.size() && matched == n && "Fail: join threads");
+        }
+
+        // A per instance hasher indexes every partition alike.
+        std::vector<unsigned long> keys;
+        for (unsigned long i = 0; i < 10000; ++i)
+        {
+            keys.push_back(i * 2654435761UL);
+        }
+        auto self = [](unsigned long k) { return k; };
+        hackmap::hash_join<unsigned long,
+                           hackmap::seeded_hash<unsigned long>> seeded(4);
+        seeded.build(keys.begin(), keys.end(), self);
+        size_t same = 0;
+        size_t n = seeded.probe(keys.begin(), keys.end(), self,
+                                [&](size_t b, size_t p) { same += b == p; });
+        assert(10000 == n && 10000 == same && "Fail: seeded join");
+
+        cout << "PASSED HASH JOIN TEST" << endl;
+    }
+
+    {
+        // try_emplace only builds a value for a new key.
+        hackmap::unordered_map<std::string, std::string> strings;
+        assert(strings.try_emplace("a", 3, 'x').second && "Fail: try new");
+        assert(!strings.try_emplace("a", 2, 'y').second && "Fail: try exists");
+        assert("xxx" == strings["a"] && "Fail: try kept value");
+        strings["b"] += "z";
+        assert("z" == strings.find("b")->second && "Fail: operator[]");
+
+        // Group-by against a std::map, threaded and partitioned.
+        std::vector<std::pair<int, long>> rows;
+        std::map<int, hackmap::count_sum<long>> expect;
+        for (int i = 0; i < 20000; ++i)
+        {
+            int key = (i * i) % 997;
+            rows.push_back({ key, i });
+            expect[key].add(i);
+        }
+
+        for (unsigned threads : { 1u, 3u })
+        {
+            for (int bits : { 0, 2 })
+            {
+                hackmap::aggregator<int, hackmap::count_sum<long>> agg(threads,
+                                                                       bits);
+                agg.aggregate(rows.begin(), rows.end(),
+                              [](const std::pair<int, long>& r)
+                              { return r.first; },
+                              [](const std::pair<int, long>& r)
+                              { return r.second; });
+                assert(expect.size() == agg.size() && "Fail: groups");
+
+                size_t seen = 0;
+                agg.for_each([&](int k, const hackmap::count_sum<long>& a)
+                {
+                    assert(expect[k].count == a.count && "Fail: count");
+                    assert(expect[k].sum == a.sum && "Fail: sum");
+                    ++seen;
+                });
+                assert(expect.size() == seen && "Fail: for_each");
+                assert(agg.find(4) && expect[4].sum == agg.find(4)->sum
+                       && "Fail: find");
+                assert(!agg.find(-1) && "Fail: no find");
+            }
+        }
+
+        // A per instance hasher, kept across resizes and the merge.
+        using seeded_type = hackmap::seeded_hash<unsigned long>;
+        hackmap::aggregator<unsigned long, hackmap::count_sum<unsigned long>,
+                            seeded_type> seeded(2, 3);
+        for (unsigned long i = 0; i < 30000; ++i)
+        {
+            seeded.add(i % 2, i % 10000, 1);
+        }
+        seeded.merge();
+        assert(10000 == seeded.size() && "Fail: seeded groups");
+        for (unsigned long k = 0; k < 10000; ++k)
+        {
+            assert(seeded.find(k) && 3 == seeded.find(k)->count
+                   && "Fail: seeded count");
+        }
+
+        cout << "PASSED AGGREGATOR TEST" << endl;
+    }
+
+    {
+        // Update in place, erasing on request, down long chains.
+        hackmap::detail::unordered_map<100, int, int, hashit::edge_hash> map;
+        auto count = [&map](int k)
+        {
+            return map.upsert(k, [] { return 1; }, [](int& v) { ++v; });
+        };
+        const int edges = EDGEMAX / 4;
+        for (int i = 0; i < EDGEMAX + edges; ++i)
+        {
+            assert(count(i).second && "Fail: upsert new");
+        }
+        for (int i = 0; i < EDGEMAX + edges; i += 3)
+        {
+            assert(!count(i).second && "Fail: upsert exists");
+        }
+        for (int i = 0; i < EDGEMAX + edges; ++i)
+        {
+            assert((i % 3 ? 1 : 2) == map[i] && "Fail: upsert value");
+        }
+        INVARIANT_CHECK;
+
+        // Count every key down, erasing at zero; chain heads go first.
+        auto release = [](int& v)
+        {
+            return --v ? hackmap::compute_action::keep
+                       : hackmap::compute_action::erase;
+        };
+        for (int i = EDGEMAX + edges - 1; i >= 0; --i)
+        {
+            auto it = map.compute(i, release);
+            assert((i % 3 ? it == map.end() : 1 == it->second)
+                   && "Fail: compute");
+        }
+        INVARIANT_CHECK;
+        assert(size_t((EDGEMAX + edges + 2) / 3) == map.size()
+               && "Fail: compute size");
+
+        auto it = map.upsert(0, [] { return 9; },
+                             [](int&) { return hackmap::compute_action::erase; });
+        assert(it.first == map.end() && !it.second && 0 == map.count(0)
+               && "Fail: upsert erase");
+        assert(-1 == map.compute(-5, [](int& v) { v = -1; })->second
+               && "Fail: compute insert");
+        INVARIANT_CHECK;
+
+        cout << "PASSED COMPUTE TEST" << endl;
+    }
+
+    {
+        // CLOCK cache: bounded, never grows, and keeps what is reused.
+        const size_t capacity = 1000;
+        hackmap::clock_cache<int, int> cache(capacity);
+        size_t bytes = cache.memory_usage();
+
+        for (int i = 0; i < 100; ++i)
+        {
+            assert(cache.put(i, i) && "Fail: put new");
+        }
+        assert(!cache.put(7, 70) && 70 == *cache.get(7) && "Fail: put again");
+        cache.put(7, 7);
+
+        // Touch the 100 hot keys between every 50 cold ones.
+        for (int round = 0; round < 200; ++round)
+        {
+            for (int i = 0; i < 100; ++i)
+            {
+                int* v = cache.get(i);
+                assert(v && i == *v && "Fail: hot key evicted");
+            }
+            for (int i = 0; i < 50; ++i)
+            {
+                int k = 1000 + round * 50 + i;
+                assert(!cache.get(k) && "Fail: cold hit");
+                cache.put(k, k);
+                assert(cache.size() <= capacity && "Fail: capacity");
+            }
+        }
+        assert(capacity == cache.size() && "Fail: full");
+        assert(bytes == cache.memory_usage() && "Fail: cache grew");
+        assert(200 * 100 + 1 == cache.hits() && "Fail: hits");
+        assert(200 * 50 == cache.misses() && "Fail: misses");
+        assert(100 + 200 * 50 - capacity == cache.evictions()
+               && "Fail: evictions");
+
+        assert(1 == cache.erase(5) && !cache.get(5) && "Fail: cache erase");
+        cache.clear();
+        assert(0 == cache.size() && !cache.get(1) && "Fail: cache clear");
+
+        cout << "PASSED CLOCK CACHE TEST" << endl;
+    }
+
+    {
+        // Expiry: one key per tick, live for 100 ticks, some chained.
+        hackmap::expiring_map<int, int, hashit::edge_hash> map(100);
+        const int puts = 3 * EDGEMAX;
+        for (int t = 0; t < puts; ++t)
+        {
+            int k = (t % 2) ? t : EDGEMAX + t;
+            map.tick(t);
+            assert(map.put(k, t) && "Fail: put new");
+            assert(map.size() < 3 * 100 && "Fail: sweep keeps up");
+        }
+
+        int now = puts - 1;
+        for (int t = 0; t < puts; ++t)
+        {
+            int k = (t % 2) ? t : EDGEMAX + t;
+            const int* v = map.find(k);
+            assert((t > now - 100) == !!v && "Fail: expired find");
+            assert((!v || t == *v) && "Fail: expiring value");
+        }
+
+        // A put revives an expired key; erase skips them.
+        assert(!map.put(now, -1) && -1 == *map.find(now) && "Fail: put live");
+        assert(map.put(1, 1) && 1 == *map.find(1) && "Fail: put expired");
+        assert(0 == map.erase(3) && 1 == map.erase(1) && "Fail: erase expired");
+
+        size_t reclaimed = map.expired_count();
+        map.tick(now + 50, size_t(1) << 20);
+        assert(50 == map.size() && "Fail: full sweep");
+        assert(map.expired_count() > reclaimed && "Fail: expired count");
+        map.tick(now + 200, size_t(1) << 20);
+        assert(0 == map.size() && "Fail: all expired");
+
+        cout << "PASSED EXPIRING MAP TEST" << endl;
+    }
+
+    {
+        // Raw snapshots reload in place, or rebuild if the hash changed.
+        map_full_type saved;
+        for (int i = 0; i < 5000; ++i)
+        {
+            saved.emplace(i * 3, i & 1);
+        }
+        std::stringstream raw;
+        saved.save(raw);
+        std::string bytes = raw.str();
+
+        map_full_type map;
+        map.emplace(-1, true);
+        map.load(raw);
+        INVARIANT_CHECK;
+        assert(saved.size() == map.size() && 0 == map.count(-1)
+               && saved.bucket_count() == map.bucket_count()
+               && "Fail: raw load");
+        assert(std::equal(saved.begin(), saved.end(), map.begin())
+               && "Fail: raw same order");
+
+        {
+            hackmap::detail::unordered_map<100, int, bool, std::hash<int>> map;
+            std::stringstream again(bytes);
+            map.load(again);
+            INVARIANT_CHECK;
+            for (int i = 0; i < 5000; ++i)
+            {
+                assert(map.count(i * 3) && (i & 1) == map.at(i * 3)
+                       && "Fail: rehashed load");
+            }
+        }
+
+        std::stringstream empty;
+        map_full_type().save(empty);
+        map.load(empty);
+        assert(map.empty() && "Fail: empty load");
+
+        std::stringstream truncated(bytes.substr(0, bytes.size() / 2));
+        bool threw = false;
+        try
+        {
+            map.load(truncated);
+        }
+        catch (const std::runtime_error&)
+        {
+            threw = true;
+        }
+        assert(threw && "Fail: truncated load");
+
+        // Headers and tables that don't hang together leave the map be.
+        auto rejects = [&map](const std::string& image)
+        {
+            std::stringstream bad(image);
+            try
+            {
+                map.load(bad);
+            }
+            catch (const std::runtime_error&)
+            {
+                return true;
+            }
+            return false;
+        };
+        map.emplace(-1, true);
+        std::string bad = bytes;
+        uint64_t size = 1 << 20;
+        std::memcpy(&bad[offsetof(hackmap::snapshot_header, size)],
+                    &size, sizeof(size));
+        assert(rejects(bad) && "Fail: size past load");
+        {
+            hackmap::detail::unordered_map<50, int, bool> other;
+            std::stringstream raw50(bytes);
+            threw = false;
+            try
+            {
+                other.load(raw50);
+            }
+            catch (const std::runtime_error&)
+            {
+                threw = true;
+            }
+            assert(threw && "Fail: load factor");
+        }
+        // The table starts with the first block's 16 one octet hashes.
+        size_t table = sizeof(hackmap::snapshot_header);
+        size_t hole = bytes.find(char(0xFF), table);
+        assert(hole < table + 16 && "Fail: no empty entry");
+        bad = bytes;
+        bad[hole] = char(0xFD);
+        assert(rejects(bad) && "Fail: special hash");
+        bad[hole] = 0;
+        assert(rejects(bad) && "Fail: uncounted entry");
+        assert(1 == map.size() && map.count(-1) && "Fail: kept on reject");
+        INVARIANT_CHECK;
+
+        // Any type through write and read hooks.
+        hackmap::unordered_map<std::string, int> names;
+        for (int i = 0; i < 1000; ++i)
+        {
+            names.emplace(std::to_string(i), i);
+        }
+        std::stringstream text;
+        names.save(text, [](std::ostream& os,
+                            const std::pair<const std::string, int>& kv)
+                         { os << kv.first << ' ' << kv.second << '\n'; });
+        hackmap::unordered_map<std::string, int> reread;
+        reread.load(text, [](std::istream& is)
+                          {
+                              std::pair<std::string, int> kv;
+                              is >> kv.first >> kv.second;
+                              return kv;
+                          });
+        assert(1000 == reread.size() && 42 == reread.at("42")
+               && "Fail: stream load");
+
+        cout << "PASSED SNAPSHOT TEST" << endl;
+    }
+
+    {
+        // Frozen images are queried where they lie, in memory or mapped.
+        std::vector<std::pair<std::string, int>> rows;
+        for (int i = 0; i < 3000; ++i)
+        {
+            rows.emplace_back("key" + std::to_string(i * 7), i);
+        }
+        using frozen_type = hackmap::frozen_map<std::string, int>;
+        std::stringstream out;
+        frozen_type::write(out, rows.begin(), rows.end());
+        std::string bytes = out.str();
+        std::vector<uint64_t> image((bytes.size() + 7) / 8);
+        std::memcpy(image.data(), bytes.data(), bytes.size());
+
+        frozen_type map(image.data(), bytes.size());
+        assert(3000 == map.size() && "Fail: frozen size");
+        assert(3000 == frozen_type(image.data(), bytes.size(), true).size()
+               && "Fail: frozen checked");
+        for (const auto& kv : rows)
+        {
+            auto it = map.find(kv.first);
+            assert(it != map.end() && kv.first == it.key()
+                   && kv.second == it.value() && "Fail: frozen find");
+        }
+        assert(0 == map.count("key1") && map.end() == map.find("")
+               && "Fail: frozen miss");
+        size_t n = 0;
+        for (auto it = map.begin(); it != map.end(); ++it, ++n)
+        {
+        }
+        assert(3000 == n && "Fail: frozen iterate");
+
+        bool threw = false;
+        try
+        {
+            frozen_type cut(image.data(), bytes.size() / 2);
+        }
+        catch (const std::runtime_error&)
+        {
+            threw = true;
+        }
+        assert(threw && "Fail: frozen truncated");
+
+        // A checked attach throws on corrupt blocks or keys past the arena.
+        auto rejects = [&](const std::string& bad)
+        {
+            std::vector<uint64_t> copy((bad.size() + 7) / 8);
+            std::memcpy(copy.data(), bad.data(), bad.size());
+            try
+            {
+                frozen_type attached(copy.data(), bad.size(), true);
+            }
+            catch (const std::runtime_error&)
+            {
+                return true;
+            }
+            return false;
+        };
+        hackmap::snapshot_header head;
+        std::memcpy(&head, bytes.data(), sizeof(head));
+        size_t blocks = size_t(head.len) / hackmap::detail::BLOCK_LEN;
+        size_t last = sizeof(head) + size_t(head.bytes) / blocks * (blocks - 1);
+        std::string bad = bytes;
+        std::memset(&bad[last], 0xff, hackmap::detail::BLOCK_LEN);
+        assert(rejects(bad) && "Fail: frozen bad block");
+        bad = bytes;
+        std::memset(&bad[sizeof(head) + head.bytes], 0, sizeof(uint64_t));
+        assert(rejects(bad) && "Fail: frozen key past arena");
+
+        std::stringstream none;
+        frozen_type::write(none, rows.end(), rows.end());
+        std::string empty = none.str();
+        std::memcpy(image.data(), empty.data(), empty.size());
+        assert(frozen_type(image.data(), empty.size()).empty()
+               && "Fail: frozen empty");
+
+        std::vector<std::pair<int, double>> numbers;
+        for (int i = 0; i < 1000; ++i)
+        {
+            numbers.emplace_back(i * 5, i * 0.5);
+        }
+        const char* path = "prove_frozen.bin";
+        {
+            std::ofstream file(path, std::ios::binary);
+            hackmap::frozen_map<int, double>::write(file, numbers.begin(),
+                                                    numbers.end());
+        }
+        {
+            auto mapped = hackmap::frozen_map<int, double>::open(path, true);
+            assert(1000 == mapped.size() && 0.5 == mapped.find(5).value()
+                   && mapped.end() == mapped.find(6) && "Fail: frozen open");
+        }
+        std::remove(path);
+
+        cout << "PASSED FROZEN MAP TEST" << endl;
+    }
+
+    {
+        // freeze() finds every key in one slot and rejects the rest.
+        map_full_type live;
+        for (int i = 0; i < 20000; ++i)
+        {
+            live.emplace(i * 3, i & 1);
+        }
+        auto map = live.freeze();
+        assert(live.size() == map.size() && "Fail: freeze size");
+        for (int i = 0; i < 60000; ++i)
+        {
+            auto it = map.find(i);
+            assert((0 == i % 3) == (it != map.end()) && "Fail: freeze find");
+            assert((it == map.end() || (it->first == i
+                                        && ((i / 3) & 1) == it->second))
+                   && "Fail: freeze value");
+        }
+        for (const auto& kv : map)
+        {
+            assert(live.at(kv.first) == kv.second && "Fail: freeze entries");
+        }
+
+        hackmap::unordered_map<std::string, int> names;
+        for (int i = 0; i < 1000; ++i)
+        {
+            names.emplace(std::to_string(i), i);
+        }
+        auto frozen = names.freeze();
+        assert(1000 == frozen.size() && 7 == frozen.find("7")->second
+               && 0 == frozen.count("1000") && "Fail: freeze strings");
+        auto none = map_full_type().freeze();
+        assert(none.empty() && none.end() == none.find(1)
+               && "Fail: freeze empty");
+
+        std::vector<std::pair<int, int>> twice = { { 1, 1 }, { 2, 2 }, { 1, 3 } };
+        bool threw = false;
+        try
+        {
+            hackmap::perfect_map<int, int> dup(twice.begin(), twice.end());
+        }
+        catch (const std::runtime_error&)
+        {
+            threw = true;
+        }
+        assert(threw && "Fail: freeze duplicate");
+
+        cout << "PASSED FREEZE TEST" << endl;
+    }
+
+    {
+        // Laid out by the compiler; lookups search blocks as the map does.
+        enum class status { ok = 200, created = 201, missing = 404,
+                            failed = 500 };
+        static constexpr hackmap::static_map<status, const char*, 4> names{
+            { status::ok, "OK" }, { status::created, "Created" },
+            { status::missing, "Not Found" }, { status::failed, "Error" } };
+        static_assert(4 == names.size(), "static_map is constexpr");
+        assert(std::string("Not Found") == names.at(status::missing)
+               && !names.find(status(302)) && "Fail: static find");
+
+        static constexpr hackmap::static_map<int, int, 100> squares{
+            { 0, 0 }, { 1, 1 }, { 2, 4 }, { 3, 9 }, { 4, 16 }, { 5, 25 },
+            { 6, 36 }, { 7, 49 }, { 8, 64 }, { 9, 81 }, { -1, 7 },
+            { 1000000, -1 }, { 1 << 20, 20 }, { 1 << 24, 24 } };
+        static_assert(14 == squares.size(), "static_map is constexpr");
+        for (int i = 0; i < 10; ++i)
+        {
+            assert(i * i == *squares.find(i) && "Fail: static value");
+        }
+        assert(7 == squares.at(-1) && 20 == squares.at(1 << 20)
+               && 0 == squares.count(11) && 0 == squares.count(1 << 21)
+               && "Fail: static miss");
+        size_t n = 0;
+        squares.for_each([&n](int k, int v) { n += (k * k == v); });
+        assert(10 == n && "Fail: static for_each");
+
+        // Fourteen keys fill one block to 7/8.
+        static constexpr hackmap::static_map<int, int, 14> block{
+            { 0, 0 }, { 1, 1 }, { 2, 2 }, { 3, 3 }, { 4, 4 }, { 5, 5 },
+            { 6, 6 }, { 7, 7 }, { 8, 8 }, { 9, 9 }, { 10, 10 }, { 11, 11 },
+            { 12, 12 }, { 13, 13 } };
+        for (int i = 0; i < 14; ++i)
+        {
+            assert(i == block.at(i) && "Fail: static block");
+        }
+        assert(!block.find(14) && "Fail: static block miss");
+
+        hackmap::static_map<int, int, 2> none{};
+        assert(none.empty() && !none.find(0) && "Fail: static empty");
+        int threw = 0;
+        try
+        {
+            hackmap::static_map<int, int, 2> dup{ { 1, 1 }, { 1, 2 } };
+        }
+        catch (const std::invalid_argument&)
+        {
+            ++threw;
+        }
+        try
+        {
+            hackmap::static_map<int, int, 1> over{ { 1, 1 }, { 2, 2 } };
+        }
+        catch (const std::length_error&)
+        {
+            ++threw;
+        }
+        assert(2 == threw && "Fail: static bad list");
+
+        cout << "PASSED STATIC MAP TEST" << endl;
+    }
+
+    {
+        // Values stay put while the table grows around them.
+        struct pinned
+        {
+            pinned(int v, int* live)
+                : value(v)
+                , live(live)
+            {
+                if (v < 0)
+                {
+                    throw std::invalid_argument("pinned");
+                }
+                ++*live;
+            }
+            pinned(const pinned&) = delete;
+            pinned& operator=(const pinned&) = delete;
+            ~pinned() { --*live; }
+
+            int value;
+            int* live;
+        };
+
+        int live = 0;
+        {
+            hackmap::node_map<int, pinned> map;
+            std::vector<const pinned*> where;
+            const int n = 10000;
+            for (int i = 0; i < n; ++i)
+            {
+                auto p = map.try_emplace(i, i, &live);
+                assert(p.second && i == p.first->value && "Fail: node insert");
+                where.push_back(p.first);
+            }
+            assert(!map.try_emplace(0, -1, &live).second
+                   && 0 == map.find(0)->value && "Fail: node present");
+            map.reserve(4 * map.bucket_count());
+            for (int i = 0; i < n; ++i)
+            {
+                assert(where[i] == map.find(i) && "Fail: node stable");
+            }
+            assert(n == live && n == int(map.size()) && "Fail: node live");
+
+            // A throwing constructor leaves no entry and no slot behind.
+            bool threw = false;
+            try
+            {
+                map.try_emplace(n, -1, &live);
+            }
+            catch (const std::invalid_argument&)
+            {
+                threw = true;
+            }
+            assert(threw && 0 == map.count(n) && "Fail: node throw");
+
+            // Erased slots are reused, last erased first.
+            assert(1 == map.erase(5) && 0 == map.erase(5) && n - 1 == live
+                   && "Fail: node erase");
+            assert(where[5] == map.try_emplace(n, n, &live).first
+                   && "Fail: node reuse");
+            size_t same = 0;
+            map.for_each([&same](int k, pinned& v) { same += (k == v.value); });
+            assert(size_t(n) == same && "Fail: node for_each");
+
+            map.clear();
+            assert(0 == live && map.empty() && "Fail: node clear");
+            map.try_emplace(1, 1, &live);
+            hackmap::node_map<int, pinned> moved(std::move(map));
+            assert(1 == live && 1 == moved.find(1)->value && "Fail: node move");
+        }
+        assert(0 == live && "Fail: node destroy");
+
+        hackmap::node_map<std::string, std::string> names;
+        names["a"] = "apple";
+        names["b"];
+        assert("apple" == *names.find("a") && names.find("b")->empty()
+               && !names.find("c") && "Fail: node operator[]");
+
+        cout << "PASSED NODE MAP TEST" << endl;
+    }
+
 #if 1
     {
         // Larger linear test.